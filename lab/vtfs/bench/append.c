@@ -0,0 +1,70 @@
+// Sequential append benchmark: appends fixed-size records to one file and
+// prints cumulative time per step, so O(n) vs O(n^2) growth is visible.
+//
+//   ./bench/append <file> [record_bytes] [total_mib] [steps]
+//
+// Output is CSV: bytes,seconds,mib_per_s
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <file> [record_bytes] [total_mib] [steps]\n", argv[0]);
+    return 2;
+  }
+
+  size_t record = argc > 2 ? strtoul(argv[2], NULL, 0) : 4096;
+  size_t total = (argc > 3 ? strtoul(argv[3], NULL, 0) : 256) << 20;
+  int steps = argc > 4 ? atoi(argv[4]) : 16;
+
+  char *buf = malloc(record);
+  if (buf == NULL) {
+    return 1;
+  }
+  memset(buf, 'x', record);
+
+  int fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (fd < 0) {
+    perror("open");
+    return 1;
+  }
+
+  printf("bytes,seconds,mib_per_s\n");
+
+  size_t written = 0;
+  size_t step = total / steps;
+  double start = now();
+  double last = start;
+  size_t last_written = 0;
+
+  while (written < total) {
+    if (write(fd, buf, record) != (ssize_t)record) {
+      perror("write");
+      return 1;
+    }
+    written += record;
+
+    if (written - last_written >= step || written >= total) {
+      double t = now();
+      printf("%zu,%.6f,%.1f\n", written, t - start,
+             (written - last_written) / (1024.0 * 1024.0) / (t - last));
+      last = t;
+      last_written = written;
+    }
+  }
+
+  close(fd);
+  free(buf);
+  return 0;
+}
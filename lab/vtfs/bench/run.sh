@@ -0,0 +1,55 @@
+#!/bin/sh
+# Runs the vtfsbench grid against a mounted vtfs and a tmpfs baseline and
+# writes one CSV to stdout (see bench/vtfsbench.c for the columns).
+#
+#   make bench
+#   sudo bench/run.sh /mnt/vt > results.csv
+#
+# The tmpfs is mounted on a temporary directory unless TMPFS_DIR names an
+# existing one. QUICK=1 runs a reduced grid.
+
+set -e
+
+if [ $# -ne 1 ]; then
+  echo "usage: $0 <vtfs_mountpoint>" >&2
+  exit 2
+fi
+
+BENCH=$(dirname "$0")/vtfsbench
+VTFS=$1
+
+if [ "$QUICK" = 1 ]; then
+  ENTRIES="1000 10000"
+  THREADS="1 4"
+  FILE_MIB="1 16"
+  BLOCKS="4096 65536"
+else
+  ENTRIES="1000 10000 100000"
+  THREADS="1 2 4 8"
+  FILE_MIB="1 16 256"
+  BLOCKS="4096 65536 1048576"
+fi
+
+if [ -z "$TMPFS_DIR" ]; then
+  TMPFS_DIR=$(mktemp -d)
+  mount -t tmpfs tmpfs "$TMPFS_DIR"
+  trap 'umount "$TMPFS_DIR"; rmdir "$TMPFS_DIR"' EXIT
+fi
+
+"$BENCH" header
+for target in "vtfs $VTFS" "tmpfs $TMPFS_DIR"; do
+  set -- $target
+  for n in $ENTRIES; do
+    for t in $THREADS; do
+      "$BENCH" meta "$1" "$2" "$n" "$t" shared
+      "$BENCH" meta "$1" "$2" "$n" "$t" private
+      "$BENCH" link "$1" "$2" "$n" "$t"
+    done
+    "$BENCH" readdir "$1" "$2" "$n"
+  done
+  for mib in $FILE_MIB; do
+    for bs in $BLOCKS; do
+      "$BENCH" rw "$1" "$2" "$mib" "$bs"
+    done
+  done
+done
@@ -0,0 +1,388 @@
+// Metadata and data path benchmarks for vtfs (or any other filesystem, for
+// comparison). Every run prints CSV rows, one per measured phase:
+//
+//   label,workload,op,threads,entries,bytes,block,seconds,ops_per_s,mib_per_s
+//
+//   ./bench/vtfsbench header
+//   ./bench/vtfsbench meta    <label> <dir> <entries> <threads> [shared|private]
+//   ./bench/vtfsbench readdir <label> <dir> <entries> [passes]
+//   ./bench/vtfsbench rw      <label> <dir> <file_mib> <block_bytes>
+//   ./bench/vtfsbench link    <label> <dir> <links> <threads>
+//
+// meta creates, stats and unlinks <entries> files split between <threads>
+// threads, all in one directory (shared, the default) or one per thread.
+// readdir lists a directory of <entries> files. rw writes and reads a file
+// sequentially and then at random block-aligned offsets (fixed seed), with
+// fsync counted in the writes; reads are served from the page cache. link
+// gives one file <links> names, stats them and unlinks them.
+//
+// Everything a run creates is removed before it exits. bench/run.sh runs
+// the standard grid against a vtfs and a tmpfs mount.
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *label;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what, const char *path) {
+  fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+  exit(1);
+}
+
+static void report(const char *workload, const char *op, int threads,
+                   long entries, long long bytes, long block, long ops,
+                   double seconds) {
+  printf("%s,%s,%s,%d,%ld,%lld,%ld,%.6f,%.1f,%.1f\n", label, workload, op,
+         threads, entries, bytes, block, seconds, ops / seconds,
+         bytes / (1024.0 * 1024.0) / seconds);
+  fflush(stdout);
+}
+
+// Runs fn(arg + i * size) on `threads` threads and returns the wall time
+// from the first of them leaving worker_begin to the last one finishing.
+// The start is taken by the workers: the main thread may not get the CPU
+// back until they are done.
+static pthread_barrier_t barrier;
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static double start_time;
+
+static void worker_begin(void) {
+  pthread_barrier_wait(&barrier);
+  double t = now();
+  pthread_mutex_lock(&start_lock);
+  if (start_time == 0 || t < start_time) {
+    start_time = t;
+  }
+  pthread_mutex_unlock(&start_lock);
+}
+
+static double run_threads(int threads, void *(*fn)(void *), void *arg,
+                          size_t size) {
+  pthread_t *tids = calloc(threads, sizeof(pthread_t));
+
+  start_time = 0;
+  pthread_barrier_init(&barrier, NULL, threads);
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&tids[i], NULL, fn, (char *)arg + i * size);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  pthread_barrier_destroy(&barrier);
+  free(tids);
+  return now() - start_time;
+}
+
+// ---- meta ------------------------------------------------------------------
+
+enum meta_op { META_CREATE, META_STAT, META_UNLINK };
+
+struct meta_worker {
+  const char *dir;
+  long first;
+  long count;
+  enum meta_op op;
+};
+
+static void *meta_run(void *arg) {
+  struct meta_worker *w = arg;
+  char path[4096];
+  struct stat st;
+
+  worker_begin();
+  for (long i = w->first; i < w->first + w->count; i++) {
+    snprintf(path, sizeof(path), "%s/f%ld", w->dir, i);
+    switch (w->op) {
+    case META_CREATE: {
+      int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+      if (fd < 0) {
+        die("create", path);
+      }
+      close(fd);
+      break;
+    }
+    case META_STAT:
+      if (stat(path, &st) != 0) {
+        die("stat", path);
+      }
+      break;
+    case META_UNLINK:
+      if (unlink(path) != 0) {
+        die("unlink", path);
+      }
+      break;
+    }
+  }
+  return NULL;
+}
+
+static int bench_meta(const char *dir, long entries, int threads,
+                      int shared) {
+  struct meta_worker *w = calloc(threads, sizeof(*w));
+  char **dirs = calloc(threads, sizeof(char *));
+  static const char *const names[] = {"create", "stat", "unlink"};
+
+  for (int i = 0; i < threads; i++) {
+    if (asprintf(&dirs[i], "%s/meta.%d", dir, shared ? 0 : i) < 0) {
+      return 1;
+    }
+    if ((!shared || i == 0) && mkdir(dirs[i], 0755) != 0) {
+      die("mkdir", dirs[i]);
+    }
+    w[i].dir = dirs[i];
+    w[i].first = entries * i / threads;
+    w[i].count = entries * (i + 1) / threads - w[i].first;
+  }
+
+  for (int op = META_CREATE; op <= META_UNLINK; op++) {
+    for (int i = 0; i < threads; i++) {
+      w[i].op = op;
+    }
+    double t = run_threads(threads, meta_run, w, sizeof(*w));
+    report(shared ? "meta_shared" : "meta_private", names[op], threads,
+           entries, 0, 0, entries, t);
+  }
+
+  for (int i = 0; i < threads; i++) {
+    if (!shared || i == 0) {
+      rmdir(dirs[i]);
+    }
+    free(dirs[i]);
+  }
+  free(dirs);
+  free(w);
+  return 0;
+}
+
+// ---- readdir ---------------------------------------------------------------
+
+static int bench_readdir(const char *dir, long entries, int passes) {
+  char sub[4000], path[4096];
+
+  snprintf(sub, sizeof(sub), "%s/readdir", dir);
+  if (mkdir(sub, 0755) != 0) {
+    die("mkdir", sub);
+  }
+  for (long i = 0; i < entries; i++) {
+    snprintf(path, sizeof(path), "%s/f%ld", sub, i);
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+      die("create", path);
+    }
+    close(fd);
+  }
+
+  for (int pass = 0; pass < passes; pass++) {
+    double start = now();
+    DIR *d = opendir(sub);
+    long seen = 0;
+
+    if (d == NULL) {
+      die("opendir", sub);
+    }
+    while (readdir(d) != NULL) {
+      seen++;
+    }
+    closedir(d);
+    double t = now() - start;
+
+    if (seen != entries + 2) {
+      fprintf(stderr, "readdir %s: %ld entries, expected %ld\n", sub, seen,
+              entries + 2);
+      return 1;
+    }
+    report("readdir", pass == 0 ? "first" : "again", 1, entries, 0, 0, seen,
+           t);
+  }
+
+  for (long i = 0; i < entries; i++) {
+    snprintf(path, sizeof(path), "%s/f%ld", sub, i);
+    unlink(path);
+  }
+  rmdir(sub);
+  return 0;
+}
+
+// ---- rw --------------------------------------------------------------------
+
+// xorshift64, so that random runs hit the same offsets every time
+static uint64_t rng = 0x9e3779b97f4a7c15ull;
+
+static uint64_t next_random(void) {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng;
+}
+
+static int bench_rw(const char *dir, long file_mib, long block) {
+  long long size = (long long)file_mib << 20;
+  long blocks = size / block;
+  char path[4096];
+  char *buf;
+
+  if (blocks == 0) {
+    fprintf(stderr, "block is larger than the file\n");
+    return 1;
+  }
+  buf = malloc(block);
+  if (buf == NULL) {
+    return 1;
+  }
+  memset(buf, 'x', block);
+
+  snprintf(path, sizeof(path), "%s/rw", dir);
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    die("open", path);
+  }
+
+  for (int random = 0; random < 2; random++) {
+    const char *workload = random ? "rw_random" : "rw_seq";
+    double start = now();
+
+    for (long i = 0; i < blocks; i++) {
+      off_t pos = (random ? next_random() % blocks : i) * block;
+      if (pwrite(fd, buf, block, pos) != block) {
+        die("write", path);
+      }
+    }
+    if (fsync(fd) != 0) {
+      die("fsync", path);
+    }
+    report(workload, "write", 1, 0, (long long)blocks * block, block, blocks,
+           now() - start);
+
+    start = now();
+    for (long i = 0; i < blocks; i++) {
+      off_t pos = (random ? next_random() % blocks : i) * block;
+      if (pread(fd, buf, block, pos) != block) {
+        die("read", path);
+      }
+    }
+    report(workload, "read", 1, 0, (long long)blocks * block, block, blocks,
+           now() - start);
+  }
+
+  close(fd);
+  unlink(path);
+  free(buf);
+  return 0;
+}
+
+// ---- link ------------------------------------------------------------------
+
+static int bench_link(const char *dir, long links, int threads) {
+  struct meta_worker *w = calloc(threads, sizeof(*w));
+  char sub[4000], target[4000], path[4096];
+
+  snprintf(sub, sizeof(sub), "%s/link", dir);
+  snprintf(target, sizeof(target), "%s/target", dir);
+  if (mkdir(sub, 0755) != 0) {
+    die("mkdir", sub);
+  }
+  int fd = open(target, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    die("create", target);
+  }
+  close(fd);
+
+  for (int i = 0; i < threads; i++) {
+    w[i].dir = sub;
+    w[i].first = links * i / threads;
+    w[i].count = links * (i + 1) / threads - w[i].first;
+  }
+
+  double start = now();
+  for (long i = 0; i < links; i++) {
+    snprintf(path, sizeof(path), "%s/f%ld", sub, i);
+    if (link(target, path) != 0) {
+      die("link", path);
+    }
+  }
+  report("link", "link", 1, links, 0, 0, links, now() - start);
+
+  struct stat st;
+  if (stat(target, &st) != 0 || st.st_nlink != (nlink_t)links + 1) {
+    fprintf(stderr, "link %s: nlink %lu, expected %ld\n", target,
+            (unsigned long)st.st_nlink, links + 1);
+    return 1;
+  }
+
+  // stat and unlink reuse the meta workers on the link names
+  for (int op = META_STAT; op <= META_UNLINK; op++) {
+    for (int i = 0; i < threads; i++) {
+      w[i].op = op;
+    }
+    double t = run_threads(threads, meta_run, w, sizeof(*w));
+    report("link", op == META_STAT ? "stat" : "unlink", threads, links, 0, 0,
+           links, t);
+  }
+
+  unlink(target);
+  rmdir(sub);
+  free(w);
+  return 0;
+}
+
+static int usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s header\n"
+          "       %s meta    <label> <dir> <entries> <threads> [shared|private]\n"
+          "       %s readdir <label> <dir> <entries> [passes]\n"
+          "       %s rw      <label> <dir> <file_mib> <block_bytes>\n"
+          "       %s link    <label> <dir> <links> <threads>\n",
+          prog, prog, prog, prog, prog);
+  return 2;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 2 && strcmp(argv[1], "header") == 0) {
+    printf("label,workload,op,threads,entries,bytes,block,seconds,"
+           "ops_per_s,mib_per_s\n");
+    return 0;
+  }
+  if (argc < 5) {
+    return usage(argv[0]);
+  }
+
+  const char *cmd = argv[1];
+  const char *dir = argv[3];
+  long n = strtol(argv[4], NULL, 0);
+  long m = argc > 5 ? strtol(argv[5], NULL, 0) : 0;
+
+  label = argv[2];
+  if (n <= 0) {
+    return usage(argv[0]);
+  }
+
+  if (strcmp(cmd, "meta") == 0 && m > 0) {
+    return bench_meta(dir, n, m, argc <= 6 || strcmp(argv[6], "private") != 0);
+  }
+  if (strcmp(cmd, "readdir") == 0) {
+    return bench_readdir(dir, n, m > 0 ? m : 3);
+  }
+  if (strcmp(cmd, "rw") == 0 && m > 0) {
+    return bench_rw(dir, n, m);
+  }
+  if (strcmp(cmd, "link") == 0 && m > 0) {
+    return bench_link(dir, n, m);
+  }
+  return usage(argv[0]);
+}
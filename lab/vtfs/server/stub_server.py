@@ -0,0 +1,290 @@
+#!/usr/bin/env python3
+"""In-memory stand-in for the vtfs server, for exercising remote mode.
+
+Speaks both protocols used by vtfs_remote.c:
+
+  HTTP   GET /api/<method>?token=...&... over HTTP/1.1 keep-alive.  Every
+         reply body is an int64 status (0, or a positive errno) followed
+         by the little-endian payload of the method.
+  binary (--binary-port) struct vtfs_bin_req frames followed by token,
+         name and raw data, answered by a struct vtfs_bin_resp header
+         and the same payloads.
+"""
+
+import argparse
+import errno
+import socketserver
+import struct
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import unquote_to_bytes
+
+ROOT_INO = 1000
+S_IFDIR = 0o040000
+S_IFREG = 0o100000
+
+BIN_MAGIC = 0x42465456
+BIN_REQ = struct.Struct("<IHHIIQQQ")
+BIN_RESP = struct.Struct("<IIII")
+
+
+class Node:
+    def __init__(self, ino, mode):
+        self.ino = ino
+        self.mode = mode
+        self.children = {} if mode & S_IFDIR else None
+        self.data = bytearray()
+
+
+class Tree:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.nodes = {ROOT_INO: Node(ROOT_INO, S_IFDIR | 0o777)}
+        self.next_ino = ROOT_INO + 1
+
+    def dir(self, ino):
+        node = self.nodes.get(ino)
+        if node is None:
+            raise OSError(errno.ENOENT, "no such directory")
+        if node.children is None:
+            raise OSError(errno.ENOTDIR, "not a directory")
+        return node
+
+    def file(self, ino):
+        node = self.nodes.get(ino)
+        if node is None:
+            raise OSError(errno.ENOENT, "no such file")
+        if node.children is not None:
+            raise OSError(errno.EISDIR, "is a directory")
+        return node
+
+
+def attr(node):
+    return struct.pack("<QIIQ", node.ino, node.mode, 0, len(node.data))
+
+
+def parse_query(query):
+    args = {}
+    for pair in query.split("&"):
+        key, _, value = pair.partition("=")
+        args[key] = unquote_to_bytes(value)
+    return args
+
+
+def do_lookup(tree, args):
+    node = tree.dir(int(args["parent"])).children.get(args["name"])
+    if node is None:
+        raise OSError(errno.ENOENT, "no such entry")
+    return attr(node)
+
+
+def do_create(tree, args, mode=S_IFREG | 0o777):
+    parent = tree.dir(int(args["parent"]))
+    if args["name"] in parent.children:
+        raise OSError(errno.EEXIST, "entry exists")
+    node = Node(tree.next_ino, mode)
+    tree.next_ino += 1
+    tree.nodes[node.ino] = node
+    parent.children[args["name"]] = node
+    return attr(node)
+
+
+def do_mkdir(tree, args):
+    return do_create(tree, args, S_IFDIR | 0o777)
+
+
+def do_unlink(tree, args):
+    parent = tree.dir(int(args["parent"]))
+    node = parent.children.get(args["name"])
+    if node is None:
+        raise OSError(errno.ENOENT, "no such entry")
+    if node.children is not None:
+        raise OSError(errno.EISDIR, "is a directory")
+    del parent.children[args["name"]]
+    return b""
+
+
+def do_rmdir(tree, args):
+    parent = tree.dir(int(args["parent"]))
+    node = parent.children.get(args["name"])
+    if node is None:
+        raise OSError(errno.ENOENT, "no such entry")
+    if node.children is None:
+        raise OSError(errno.ENOTDIR, "not a directory")
+    if node.children:
+        raise OSError(errno.ENOTEMPTY, "directory not empty")
+    del parent.children[args["name"]]
+    return b""
+
+
+def do_link(tree, args):
+    node = tree.file(int(args["ino"]))
+    parent = tree.dir(int(args["parent"]))
+    if args["name"] in parent.children:
+        raise OSError(errno.EEXIST, "entry exists")
+    parent.children[args["name"]] = node
+    return b""
+
+
+def do_list(tree, args):
+    children = tree.dir(int(args["ino"])).children
+    out = [struct.pack("<I", len(children))]
+    for name, node in children.items():
+        out.append(attr(node) + struct.pack("<H", len(name)) + name)
+    return b"".join(out)
+
+
+def do_read(tree, args):
+    node = tree.file(int(args["ino"]))
+    offset = int(args["offset"])
+    return bytes(node.data[offset:offset + int(args["length"])])
+
+
+def do_write(tree, args):
+    node = tree.file(int(args["ino"]))
+    offset = int(args["offset"])
+    data = args["data"]
+    if len(node.data) < offset:
+        node.data.extend(bytes(offset - len(node.data)))
+    node.data[offset:offset + len(data)] = data
+    return b""
+
+
+def do_truncate(tree, args):
+    node = tree.file(int(args["ino"]))
+    size = int(args["size"])
+    if size < len(node.data):
+        del node.data[size:]
+    else:
+        node.data.extend(bytes(size - len(node.data)))
+    return b""
+
+
+METHODS = {
+    "lookup": do_lookup,
+    "create": do_create,
+    "mkdir": do_mkdir,
+    "unlink": do_unlink,
+    "rmdir": do_rmdir,
+    "link": do_link,
+    "list": do_list,
+    "read": do_read,
+    "write": do_write,
+    "truncate": do_truncate,
+}
+
+
+def call(server, method, args):
+    """Runs one method; returns (status, payload)."""
+    if server.delay:
+        time.sleep(server.delay)
+    with server.tree.lock:
+        try:
+            return 0, method(server.tree, args)
+        except OSError as e:
+            return e.errno, b""
+        except (KeyError, ValueError):
+            return errno.EINVAL, b""
+
+
+# op -> (method, names of ino, arg[0], arg[1]); see enum vtfs_bin_op
+BIN_OPS = {
+    1: (do_lookup, ("parent",)),
+    2: (do_create, ("parent",)),
+    3: (do_mkdir, ("parent",)),
+    4: (do_unlink, ("parent",)),
+    5: (do_rmdir, ("parent",)),
+    6: (do_link, ("ino", "parent")),
+    7: (do_list, ("ino",)),
+    8: (do_read, ("ino", "offset", "length")),
+    9: (do_write, ("ino", "offset")),
+    10: (do_truncate, ("ino", "size")),
+}
+
+
+class BinaryHandler(socketserver.StreamRequestHandler):
+    disable_nagle_algorithm = True
+
+    def read(self, n):
+        data = self.rfile.read(n)
+        if len(data) != n:
+            raise EOFError
+        return data
+
+    def handle(self):
+        while True:
+            try:
+                hdr = self.read(BIN_REQ.size)
+            except EOFError:
+                return
+            magic, op, name_len, token_len, data_len, *nums = BIN_REQ.unpack(hdr)
+            if magic != BIN_MAGIC:
+                return
+            self.read(token_len)
+            name = self.read(name_len)
+            data = self.read(data_len)
+
+            if op in BIN_OPS:
+                method, fields = BIN_OPS[op]
+                args = dict(zip(fields, nums))
+                args["name"] = name
+                args["data"] = data
+                status, body = call(self.server, method, args)
+            else:
+                status, body = errno.EINVAL, b""
+
+            self.wfile.write(BIN_RESP.pack(BIN_MAGIC, status, len(body), 0) + body)
+
+
+class BinaryServer(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    disable_nagle_algorithm = True
+
+    def do_GET(self):
+        path, _, query = self.path.partition("?")
+        method = METHODS.get(path.removeprefix("/api/"))
+        if method is None:
+            self.send_error(404)
+            return
+
+        status, payload = call(self.server, method, parse_query(query))
+        body = struct.pack("<q", status) + payload
+
+        self.send_response(200)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, fmt, *args):
+        if self.server.verbose:
+            super().log_message(fmt, *args)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--binary-port", type=int, default=8081)
+    parser.add_argument("--delay-ms", type=float, default=0,
+                        help="added latency per request")
+    parser.add_argument("-v", "--verbose", action="store_true")
+    opts = parser.parse_args()
+
+    tree = Tree()
+    binary = BinaryServer(("", opts.binary_port), BinaryHandler)
+    server = ThreadingHTTPServer(("", opts.port), Handler)
+    for srv in (binary, server):
+        srv.tree = tree
+        srv.delay = opts.delay_ms / 1000
+        srv.verbose = opts.verbose
+    threading.Thread(target=binary.serve_forever, daemon=True).start()
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -1,66 +1,139 @@
 #include "http.h"
 
+#include <linux/net.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/tcp.h>
+#include <linux/ktime.h>
+#include <net/sock.h>
+
 const char *SERVER_IP = "0.0.0.0";
 const int SERVER_PORT = 8080;
+const int SERVER_BIN_PORT = 8081;
+
+static char *append(char *pos, const char *s) {
+  size_t len = strlen(s);
+  memcpy(pos, s, len);
+  return pos + len;
+}
+
+// callee should call kfree on vec->iov_base
+int fill_request(struct kvec *vec, const char *host, const char *token,
+                 const char *method, bool keep_alive, size_t arg_size,
+                 va_list args) {
+  const char *connection =
+      keep_alive ? "\r\nConnection: keep-alive\r\n\r\n" : "\r\nConnection: close\r\n\r\n";
+  size_t length = strlen("GET /api/?token= HTTP/1.1\r\nHost:") + strlen(method) +
+                  strlen(token) + strlen(host) + strlen(connection) + 1;
+  va_list sizing;
+
+  va_copy(sizing, args);
+  for (int i = 0; i < arg_size; i++) {
+    length += strlen("&=") + strlen(va_arg(sizing, char *));
+    length += strlen(va_arg(sizing, char *));
+  }
+  va_end(sizing);
 
-// callee should call free_request on received buffer
-int fill_request(struct kvec *vec, const char *token, const char *method,
-                 size_t arg_size, va_list args) {
-  // 2048 bytes for URL and 64 bytes for anything else
-  char *request_buffer = kzalloc(2048 + 64, GFP_KERNEL);
+  char *request_buffer = kmalloc(length, GFP_KERNEL);
   if (request_buffer == 0) {
     return -ENOMEM;
   }
 
-  strcpy(request_buffer, "GET /api/");
-  strcat(request_buffer, method);
-
-  strcat(request_buffer, "?token=");
-  strcat(request_buffer, token);
+  char *pos = append(request_buffer, "GET /api/");
+  pos = append(pos, method);
+  pos = append(pos, "?token=");
+  pos = append(pos, token);
 
   for (int i = 0; i < arg_size; i++) {
-    strcat(request_buffer, "&");
-    strcat(request_buffer, va_arg(args, char *));
-    strcat(request_buffer, "=");
-    strcat(request_buffer, va_arg(args, char *));
+    pos = append(pos, "&");
+    pos = append(pos, va_arg(args, char *));
+    pos = append(pos, "=");
+    pos = append(pos, va_arg(args, char *));
   }
 
-  strcat(request_buffer, " HTTP/1.1\r\nHost:");
-  strcat(request_buffer, SERVER_IP);
-  strcat(request_buffer, "\r\nConnection: close\r\n\r\n");
+  pos = append(pos, " HTTP/1.1\r\nHost:");
+  pos = append(pos, host);
+  pos = append(pos, connection);
+  *pos = '\0';
 
   memset(vec, 0, sizeof(struct kvec));
   vec->iov_base = request_buffer;
-  vec->iov_len = strlen(request_buffer);
+  vec->iov_len = pos - request_buffer;
 
   return 0;
 }
 
-int receive_all(struct socket *sock, char *buffer, size_t buffer_size) {
+// Returns the value of a numeric header, or -1 if it is absent.
+static long find_header(const char *headers, size_t length, const char *name) {
+  const char *value = strnstr(headers, name, length);
+  long result = 0;
+
+  if (value == 0) {
+    return -1;
+  }
+  value += strlen(name);
+  while (*value == ' ') {
+    value++;
+  }
+  if (*value < '0' || *value > '9') {
+    return -1;
+  }
+  while (*value >= '0' && *value <= '9') {
+    result = result * 10 + (*value++ - '0');
+  }
+  return result;
+}
+
+// Reads exactly one response: headers, then Content-Length bytes of body.
+// Unlike reading until EOF this leaves the connection usable for the next
+// request. buffer must have room for a terminating '\0'.
+int receive_response(struct socket *sock, char *buffer, size_t buffer_size,
+                     bool *keep_alive) {
   struct msghdr hdr;
   struct kvec vec;
 
-  int read = 0;
+  size_t read = 0;
+  size_t expected = 0;
 
-  while (read < buffer_size) {
+  while (expected == 0 || read < expected) {
+    if (read + 1 >= buffer_size) {
+      return -ENOSPC;
+    }
     memset(&hdr, 0, sizeof(struct msghdr));
     memset(&vec, 0, sizeof(struct kvec));
     vec.iov_base = buffer + read;
-    vec.iov_len = buffer_size - read;
+    vec.iov_len = (expected ? expected : buffer_size - 1) - read;
     int ret = kernel_recvmsg(sock, &hdr, &vec, 1, vec.iov_len, 0);
-    if (ret == 0) {
-      break;
-    } else if (ret < 0) {
-      return -4;
+    if (ret <= 0) {
+      return -ECONNRESET;
     }
     read += ret;
+    buffer[read] = '\0';
+
+    if (expected == 0) {
+      char *end = strnstr(buffer, "\r\n\r\n", read);
+      if (end == 0) {
+        continue;
+      }
+      size_t header_size = end + 4 - buffer;
+      long length = find_header(buffer, header_size, "Content-Length:");
+      if (length < 0) {
+        return -EPROTO;
+      }
+      expected = header_size + length;
+      if (expected + 1 > buffer_size) {
+        return -ENOSPC;
+      }
+      *keep_alive = strnstr(buffer, "Connection: close", header_size) == 0;
+    }
   }
 
   return read;
 }
 
 int64_t parse_http_response(char *raw_response, size_t raw_response_size,
-                            char *response, size_t response_size) {
+                            char *response, size_t response_size,
+                            size_t *response_length) {
   char *buffer = raw_response;
 
   // Read Response Line
@@ -68,12 +141,12 @@ int64_t parse_http_response(char *raw_response, size_t raw_response_size,
     char *status_line = strsep(&buffer, "\r");
     strsep(&status_line, " ");
     if (status_line == 0) {
-      return -6;
+      return -EPROTO;
     }
     char *status_code = strsep(&status_line, " ");
-    printk(KERN_INFO "Received response with status code %s\n", status_code);
     if (strcmp(status_code, "200") != 0) {
-      return -5;
+      printk(KERN_INFO "Received response with status code %s\n", status_code);
+      return -EREMOTEIO;
     }
   }
 
@@ -81,7 +154,7 @@ int64_t parse_http_response(char *raw_response, size_t raw_response_size,
 
   while (true) {
     if (buffer == 0) {
-      return -6;
+      return -EPROTO;
     }
     char *header = strsep(&buffer, "\r");
     ++header; // skip \n
@@ -93,23 +166,22 @@ int64_t parse_http_response(char *raw_response, size_t raw_response_size,
     if (strncmp(header, "Content-Length: ", 16) == 0) {
       int error = kstrtoint(header + 16, 0, &length);
       if (error != 0) {
-        return -6;
+        return -EPROTO;
       }
-      printk(KERN_INFO "Received response with content length %d\n", length);
     }
   }
   ++buffer; // skip last '\n'
 
   if (length == -1) {
-    return -6;
+    return -EPROTO;
   }
 
   if (buffer + length > raw_response + raw_response_size) {
-    return -6;
+    return -EPROTO;
   }
 
   if (length < sizeof(int64_t)) {
-    return -7;
+    return -EPROTO;
   }
 
   length -= sizeof(int64_t);
@@ -123,42 +195,55 @@ int64_t parse_http_response(char *raw_response, size_t raw_response_size,
 
   buffer += sizeof(int64_t);
   memcpy(response, buffer, length);
+  if (response_length != 0) {
+    *response_length = length;
+  }
 
   return return_value;
 }
 
-int64_t vtfs_http_call(const char *token, const char *method,
-                            char *response_buffer, size_t buffer_size,
-                            size_t arg_size, ...) {
-  struct socket *sock;
-  int64_t error;
-
-  error = sock_create_kern(&init_net, AF_INET, SOCK_STREAM, IPPROTO_TCP, &sock);
+static int connect_socket(struct socket **sock, struct sockaddr_in *addr) {
+  int error = sock_create_kern(&init_net, AF_INET, SOCK_STREAM, IPPROTO_TCP, sock);
   if (error < 0) {
-    return -1;
+    return error;
   }
 
-  struct sockaddr_in s_addr = {.sin_family = AF_INET,
-                               .sin_addr = {.s_addr = in_aton(SERVER_IP)},
-                               .sin_port = htons(SERVER_PORT)};
-
-  error = kernel_connect(sock, (struct sockaddr *)&s_addr,
-                         sizeof(struct sockaddr_in), 0);
+  error = kernel_connect(*sock, (struct sockaddr *)addr, sizeof(struct sockaddr_in), 0);
   if (error != 0) {
+    sock_release(*sock);
+    *sock = 0;
+    return error;
+  }
 
-    sock_release(sock);
-    return -2;
+  // requests are small and strictly request/response
+  tcp_sock_set_nodelay((*sock)->sk);
+  return 0;
+}
+
+static void close_socket(struct socket **sock) {
+  if (*sock == 0) {
+    return;
   }
+  kernel_sock_shutdown(*sock, SHUT_RDWR);
+  sock_release(*sock);
+  *sock = 0;
+}
 
+// Sends one request on a connected socket and reads its response.
+// *keep_alive tells whether the socket may carry another request.
+static int64_t exchange(struct socket *sock, const char *host, const char *token,
+                        const char *method, char *response_buffer,
+                        size_t buffer_size, size_t *response_length,
+                        bool persistent, bool *keep_alive, size_t *sent,
+                        size_t arg_size, va_list args) {
   struct kvec kvec;
-  va_list args;
-  va_start(args, arg_size);
-  error = fill_request(&kvec, token, method, arg_size, args);
-  va_end(args);
+  int64_t error;
 
+  *keep_alive = false;
+  *sent = 0;
+
+  error = fill_request(&kvec, host, token, method, persistent, arg_size, args);
   if (error != 0) {
-    kernel_sock_shutdown(sock, SHUT_RDWR);
-    sock_release(sock);
     return error;
   }
 
@@ -169,46 +254,327 @@ int64_t vtfs_http_call(const char *token, const char *method,
   kfree(kvec.iov_base);
 
   if (error < 0) {
-    kernel_sock_shutdown(sock, SHUT_RDWR);
-    sock_release(sock);
-    return -3;
+    return -EPIPE;
   }
+  *sent = error;
 
   size_t raw_buffer_size = buffer_size + 1024; // add 1KB for HTTP headers
-  char *raw_response_buffer = kmalloc(raw_buffer_size, GFP_KERNEL);
+  char *raw_response_buffer = kvmalloc(raw_buffer_size, GFP_KERNEL);
   if (raw_response_buffer == 0) {
-    kernel_sock_shutdown(sock, SHUT_RDWR);
-    sock_release(sock);
     return -ENOMEM;
   }
-  int read_bytes = receive_all(sock, raw_response_buffer, raw_buffer_size);
-
-  kernel_sock_shutdown(sock, SHUT_RDWR);
-  sock_release(sock);
+  int read_bytes = receive_response(sock, raw_response_buffer, raw_buffer_size, keep_alive);
 
   if (read_bytes < 0) {
-    kfree(raw_response_buffer);
-    return -4;
+    *keep_alive = false;
+    kvfree(raw_response_buffer);
+    return read_bytes;
   }
 
   error = parse_http_response(raw_response_buffer, read_bytes, response_buffer,
-                              buffer_size);
+                              buffer_size, response_length);
 
-  kfree(raw_response_buffer);
+  kvfree(raw_response_buffer);
   return error;
 }
 
-void encode(const char *src, char *dst) {
-  while (*src != '\0') {
-    if ((*src >= '0' && *src <= '9') || (*src >= 'a' && *src <= 'z') ||
-        (*src >= 'A' && *src <= 'Z')) {
-      *dst = *src;
+int64_t vtfs_http_call(const char *token, const char *method,
+                            char *response_buffer, size_t buffer_size,
+                            size_t arg_size, ...) {
+  struct sockaddr_in s_addr = {.sin_family = AF_INET,
+                               .sin_addr = {.s_addr = in_aton(SERVER_IP)},
+                               .sin_port = htons(SERVER_PORT)};
+  struct socket *sock;
+  bool keep_alive;
+  size_t sent;
+  int64_t error;
+
+  error = connect_socket(&sock, &s_addr);
+  if (error != 0) {
+    return error;
+  }
+
+  va_list args;
+  va_start(args, arg_size);
+  error = exchange(sock, SERVER_IP, token, method, response_buffer, buffer_size,
+                   0, false, &keep_alive, &sent, arg_size, args);
+  va_end(args);
+
+  close_socket(&sock);
+  return error;
+}
+
+int vtfs_http_pool_init(struct vtfs_http_pool *pool, const char *ip, int port, int size) {
+  memset(pool, 0, sizeof(struct vtfs_http_pool));
+
+  pool->conns = kcalloc(size, sizeof(struct vtfs_http_conn), GFP_KERNEL);
+  if (pool->conns == 0) {
+    return -ENOMEM;
+  }
+
+  pool->addr.sin_family = AF_INET;
+  pool->addr.sin_addr.s_addr = in_aton(ip);
+  pool->addr.sin_port = htons(port);
+  strscpy(pool->host, ip, sizeof(pool->host));
+  pool->size = size;
+
+  sema_init(&pool->slots, size);
+  spin_lock_init(&pool->lock);
+  INIT_LIST_HEAD(&pool->idle);
+  for (int i = 0; i < size; i++) {
+    list_add_tail(&pool->conns[i].link, &pool->idle);
+  }
+
+  return 0;
+}
+
+void vtfs_http_pool_destroy(struct vtfs_http_pool *pool) {
+  if (pool->conns == 0) {
+    return;
+  }
+  for (int i = 0; i < pool->size; i++) {
+    close_socket(&pool->conns[i].sock);
+  }
+  kfree(pool->conns);
+  pool->conns = 0;
+}
+
+static struct vtfs_http_conn *pool_get(struct vtfs_http_pool *pool) {
+  struct vtfs_http_conn *conn;
+
+  if (down_killable(&pool->slots) != 0) {
+    return 0;
+  }
+
+  // connected sockets are kept at the head, so prefer those
+  spin_lock(&pool->lock);
+  conn = list_first_entry(&pool->idle, struct vtfs_http_conn, link);
+  list_del(&conn->link);
+  spin_unlock(&pool->lock);
+
+  return conn;
+}
+
+static void pool_put(struct vtfs_http_pool *pool, struct vtfs_http_conn *conn) {
+  spin_lock(&pool->lock);
+  if (conn->sock != 0) {
+    list_add(&conn->link, &pool->idle);
+  } else {
+    list_add_tail(&conn->link, &pool->idle);
+  }
+  spin_unlock(&pool->lock);
+  up(&pool->slots);
+}
+
+// Whether an idle pooled socket can still carry a request: the server may
+// have closed it since, which shows as a state other than established or
+// as something (its EOF) waiting to be read.
+static bool socket_usable(struct socket *sock) {
+  struct msghdr hdr;
+  struct kvec vec;
+  char byte;
+
+  if (READ_ONCE(sock->sk->sk_state) != TCP_ESTABLISHED) {
+    return false;
+  }
+  memset(&hdr, 0, sizeof(struct msghdr));
+  vec.iov_base = &byte;
+  vec.iov_len = 1;
+  return kernel_recvmsg(sock, &hdr, &vec, 1, 1, MSG_PEEK | MSG_DONTWAIT) == -EAGAIN;
+}
+
+// Whether a call may go out again once its request was sent: the server
+// may have carried out the first one before the connection broke.
+static bool may_resend(const char *method) {
+  return strcmp(method, "lookup") == 0 || strcmp(method, "list") == 0 ||
+         strcmp(method, "read") == 0;
+}
+
+int64_t vtfs_http_pool_call(struct vtfs_http_pool *pool, const char *token,
+                            const char *method, char *response_buffer,
+                            size_t buffer_size, size_t *response_length,
+                            size_t arg_size, ...) {
+  u64 start = ktime_get_ns();
+  struct vtfs_http_conn *conn;
+  size_t sent = 0, received = 0;
+  bool keep_alive;
+  int64_t error;
+
+  conn = pool_get(pool);
+  if (conn == 0) {
+    return -EINTR;
+  }
+
+  // A pooled connection the server closed while idle is replaced before
+  // the request goes out. If it breaks anyway, the call is retried once on
+  // a fresh connection, but only lookups and reads once the request is
+  // out.
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (conn->sock != 0 && !socket_usable(conn->sock)) {
+      close_socket(&conn->sock);
+    }
+    bool reused = conn->sock != 0;
+
+    if (!reused) {
+      error = connect_socket(&conn->sock, &pool->addr);
+      if (error != 0) {
+        break;
+      }
+    }
+
+    va_list args;
+    va_start(args, arg_size);
+    error = exchange(conn->sock, pool->host, token, method, response_buffer,
+                     buffer_size, &received, true, &keep_alive, &sent,
+                     arg_size, args);
+    va_end(args);
+
+    if (!keep_alive) {
+      close_socket(&conn->sock);
+    }
+    if (!reused || (error != -EPIPE &&
+                    (error != -ECONNRESET || !may_resend(method)))) {
+      break;
+    }
+  }
+
+  pool_put(pool, conn);
+  if (response_length != 0) {
+    *response_length = received;
+  }
+  if (pool->observe != 0) {
+    pool->observe(pool, method, sent, received, start, error);
+  }
+  return error;
+}
+
+// Reads exactly `length` bytes.
+static int receive_all(struct socket *sock, void *buffer, size_t length) {
+  struct msghdr hdr;
+  struct kvec vec;
+
+  memset(&hdr, 0, sizeof(struct msghdr));
+  while (length > 0) {
+    vec.iov_base = buffer;
+    vec.iov_len = length;
+    int ret = kernel_recvmsg(sock, &hdr, &vec, 1, length, MSG_WAITALL);
+    if (ret <= 0) {
+      return -ECONNRESET;
+    }
+    buffer += ret;
+    length -= ret;
+  }
+  return 0;
+}
+
+// Binary protocol exchange: the request goes out as one gathered send
+// straight from the caller's buffers, and the payload is received straight
+// into response_buffer.
+static int64_t bin_exchange(struct socket *sock, struct kvec *vec, size_t count,
+                            void *response_buffer, size_t buffer_size,
+                            size_t *response_length, bool *keep_alive,
+                            size_t *sent) {
+  struct vtfs_bin_resp resp;
+  struct msghdr msg;
+  size_t total = 0;
+
+  *keep_alive = false;
+  *sent = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    total += vec[i].iov_len;
+  }
+
+  memset(&msg, 0, sizeof(struct msghdr));
+  if (kernel_sendmsg(sock, &msg, vec, count, total) != total) {
+    return -EPIPE;
+  }
+  *sent = total;
+
+  if (receive_all(sock, &resp, sizeof(resp)) != 0) {
+    return -ECONNRESET;
+  }
+  if (le32_to_cpu(resp.magic) != VTFS_BIN_MAGIC) {
+    return -EPROTO;
+  }
+
+  size_t length = le32_to_cpu(resp.length);
+  if (length > buffer_size) {
+    return -ENOSPC; // the unread payload makes the socket unusable
+  }
+  if (receive_all(sock, response_buffer, length) != 0) {
+    return -ECONNRESET;
+  }
+
+  *keep_alive = true;
+  *response_length = length;
+  return le32_to_cpu(resp.status);
+}
+
+int64_t vtfs_bin_call(struct vtfs_http_pool *pool, const char *method,
+                      struct kvec *vec, size_t count, void *response_buffer,
+                      size_t buffer_size, size_t *response_length) {
+  u64 start = ktime_get_ns();
+  struct vtfs_http_conn *conn;
+  size_t sent = 0, received = 0;
+  bool keep_alive;
+  int64_t error;
+
+  conn = pool_get(pool);
+  if (conn == 0) {
+    return -EINTR;
+  }
+
+  // checked and retried on the same terms as in vtfs_http_pool_call
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (conn->sock != 0 && !socket_usable(conn->sock)) {
+      close_socket(&conn->sock);
+    }
+    bool reused = conn->sock != 0;
+
+    if (!reused) {
+      error = connect_socket(&conn->sock, &pool->addr);
+      if (error != 0) {
+        break;
+      }
+    }
+
+    error = bin_exchange(conn->sock, vec, count, response_buffer, buffer_size,
+                         &received, &keep_alive, &sent);
+
+    if (!keep_alive) {
+      close_socket(&conn->sock);
+    }
+    if (!reused || (error != -EPIPE &&
+                    (error != -ECONNRESET || !may_resend(method)))) {
+      break;
+    }
+  }
+
+  pool_put(pool, conn);
+  if (response_length != 0) {
+    *response_length = received;
+  }
+  if (pool->observe != 0) {
+    pool->observe(pool, method, sent, received, start, error);
+  }
+  return error;
+}
+
+void encode_bytes(const char *src, size_t length, char *dst) {
+  for (size_t i = 0; i < length; i++) {
+    if ((src[i] >= '0' && src[i] <= '9') || (src[i] >= 'a' && src[i] <= 'z') ||
+        (src[i] >= 'A' && src[i] <= 'Z')) {
+      *dst = src[i];
       dst++;
     } else {
-      sprintf(dst, "%%%02X", (unsigned char)*src);
+      sprintf(dst, "%%%02X", (unsigned char)src[i]);
       dst += 3;
     }
-    src++;
   }
   *dst = '\0';
 }
+
+void encode(const char *src, char *dst) {
+  encode_bytes(src, strlen(src), dst);
+}
@@ -2,11 +2,93 @@
 #define VTFS_HTTP_H
 
 #include <linux/inet.h>
+#include <linux/in.h>
+#include <linux/list.h>
+#include <linux/semaphore.h>
+#include <linux/spinlock.h>
+#include <linux/uio.h>
 
+// Returns the server's return value, or a negative errno: the connect
+// error, -EPIPE if the request could not be sent, -ECONNRESET if no whole
+// response came back after it was, -EREMOTEIO for an HTTP status other
+// than 200 and -EPROTO for a malformed response.
 int64_t vtfs_http_call(const char *token, const char *method,
                             char *response_buffer, size_t buffer_size,
                             size_t arg_size, ...);
 
+struct vtfs_http_conn {
+  struct list_head link;
+  struct socket *sock; // 0 until connected
+};
+
+// A fixed set of keep-alive connections to one server, speaking HTTP/1.1
+// or the binary protocol below. Callers block while all of them are busy;
+// broken connections are reopened.
+struct vtfs_http_pool {
+  struct sockaddr_in addr;
+  char host[INET_ADDRSTRLEN];
+  struct semaphore slots;
+  spinlock_t lock;
+  struct list_head idle;
+  struct vtfs_http_conn *conns;
+  int size;
+  // If set, called after every pooled call with its method, the bytes
+  // sent and received (payload only), its start time (ktime_get_ns) and
+  // result.
+  void (*observe)(struct vtfs_http_pool *pool, const char *method,
+                  size_t sent, size_t received, u64 start_ns, int64_t result);
+};
+
+int vtfs_http_pool_init(struct vtfs_http_pool *pool, const char *ip, int port, int size);
+void vtfs_http_pool_destroy(struct vtfs_http_pool *pool);
+
+// Same contract as vtfs_http_call; *response_length (if not 0) receives the
+// number of bytes stored in response_buffer. Pooled connections the server
+// closed while idle are reopened before use. A call that still fails on
+// one goes out again on a fresh one if it never got sent, or if it only
+// fetches (lookup, list, read).
+int64_t vtfs_http_pool_call(struct vtfs_http_pool *pool, const char *token,
+                            const char *method, char *response_buffer,
+                            size_t buffer_size, size_t *response_length,
+                            size_t arg_size, ...);
+
+#define VTFS_BIN_MAGIC 0x42465456 // "VTFB"
+
+// Binary protocol request: this header, then token_len bytes of token,
+// name_len bytes of name and data_len bytes of raw data. The meaning of
+// op, ino and arg is up to the caller.
+struct vtfs_bin_req {
+  __le32 magic;
+  __le16 op;
+  __le16 name_len;
+  __le32 token_len;
+  __le32 data_len;
+  __le64 ino;
+  __le64 arg[2];
+} __packed;
+
+// Binary protocol response: this header, then length bytes of payload.
+struct vtfs_bin_resp {
+  __le32 magic;
+  __le32 status; // 0, or a positive errno
+  __le32 length;
+  __le32 reserved;
+} __packed;
+
+// Sends vec[0..count) (a vtfs_bin_req and what follows it) on a pooled
+// connection. Returns the response status, or a negative error as
+// vtfs_http_pool_call does, and is resent on the same terms. method names
+// the call for that and for observe.
+int64_t vtfs_bin_call(struct vtfs_http_pool *pool, const char *method,
+                      struct kvec *vec, size_t count, void *response_buffer,
+                      size_t buffer_size, size_t *response_length);
+
+// Defaults for the server= and port= mount options.
+extern const char *SERVER_IP;
+extern const int SERVER_PORT;
+extern const int SERVER_BIN_PORT;
+
 void encode(const char *, char *);
+void encode_bytes(const char *src, size_t length, char *dst);
 
 #endif // VTFS_HTTP_H
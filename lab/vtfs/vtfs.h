@@ -5,37 +5,252 @@
 #include <linux/fs.h>
 #include <linux/mount.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/rcupdate.h>
 #include <linux/list.h>
 #include <linux/atomic.h>
+#include <linux/refcount.h>
+#include <linux/rhashtable.h>
+#include <linux/xarray.h>
+#include <linux/ktime.h>
+#include <linux/percpu_counter.h>
+#include <linux/inet.h>
+
+/* default chunk size; chunk_size= picks another per mount */
+#define VTFS_CHUNK_SHIFT PAGE_SHIFT
+#define VTFS_CHUNK_SIZE  (1UL << VTFS_CHUNK_SHIFT)
+#define VTFS_CHUNK_SHIFT_MAX 20
+
+#define VTFS_INLINE_DATA_LEN 256
+
+/* connections per remote mount, pool= */
+#define VTFS_POOL_DEFAULT 4
+#define VTFS_POOL_MAX     64
+
+struct vtfs_fs;
 
 struct vtfs_fileobj {
-	char *data;
-	size_t size;
-	atomic_t refcnt;
+	struct vtfs_fs *fs;	/* chunks are charged to its used_blocks */
+	struct mutex lock;	/* protects the data, size and inline_data */
+	union {
+		struct xarray chunks;	/* chunk index -> fs->chunk_shift buffer */
+		char idata[VTFS_INLINE_DATA_LEN];	/* while inline_data */
+	};
+	bool inline_data;
+	bool remote_pending;	/* remote mode: contents not fetched yet */
+	loff_t size;
+	loff_t image_off;	/* contents still in the image here, or 0 */
+	atomic_t refcnt;	/* names, in-core inodes, dirty and warm lists */
+	atomic_t nlink;		/* names only */
+
+	/* remote write-back: [dirty_start, dirty_end) is not on the server yet */
+	struct list_head dirty;
+	loff_t dirty_start, dirty_end;
+	ino_t remote_ino;
+	loff_t remote_size;	/* size the server reported since, or -1 */
+
+	/* the inode's page cache, which holds VTFS_CHUNK_CACHED chunks */
+	struct address_space *mapping;	/* NULL while there is no inode */
+
+	/* compress=: on the warm list while it has plain or cached chunks */
+	struct list_head warm;
+	unsigned long touched;	/* jiffies of the last read or write */
 };
 
+/*
+ * A chunk shared between fileobjs by clones or dedup; see vtfs_data.c.
+ * While hashed it is in fs->dedup's table under the hash of its bytes.
+ */
+struct vtfs_chunk_ref {
+	refcount_t users;	/* fileobjs whose xarray holds it */
+	void *data;		/* the bytes, or a vtfs_zchunk if compressed */
+	struct rhash_head node;
+	u64 hash;
+	bool hashed;
+	bool compressed;	/* data is a vtfs_zchunk */
+};
+
+#define VTFS_INLINE_NAME_LEN 32
+
+/* readdir positions 0 and 1 are "." and ".." */
+#define VTFS_FIRST_COOKIE 2
+
+/*
+ * Nodes come from three slab caches, each sized to what the node uses:
+ * directories carry the child index, the first name of a regular file
+ * carries its fileobj inline, and further hard links only point at that
+ * embedded fileobj (which then outlives its own node if need be).
+ */
 struct vtfs_node {
-	char *name;
+	const char *name;	/* iname, or a separate allocation if long */
 	umode_t mode;
 	ino_t ino;
 
 	struct vtfs_node *parent;
-	struct list_head children;
-	struct list_head siblings;
+	unsigned long cookie;	/* readdir position within parent */
+	struct rhash_head hnode;
 	struct vtfs_fileobj *f;
+	struct rcu_head rcu;
+	unsigned long seen_gen;	/* remote: last parent listing that had us */
+	struct vtfs_node *stale_next;	/* on the parent's stale list */
+	char iname[VTFS_INLINE_NAME_LEN];
+
+	union {
+		struct {	/* S_ISDIR */
+			struct xarray entries;		/* children by cookie, for readdir */
+			unsigned long next_cookie;
+			struct rhashtable index;	/* children by name */
+			struct rw_semaphore rwsem;	/* protects entries and index updates */
+			u64 locked_at;			/* ns, while rwsem is held for write */
+			struct vtfs_fs *fs;		/* charged for this inode */
+			atomic_t refcnt;		/* the parent's entry and the inode */
+			struct vtfs_node *stale;	/* dropped children, see vtfs_dir_unhash() */
+			/* remote: the last full listing, valid for actimeo */
+			bool listed;
+			unsigned long list_time;
+			atomic_long_t list_gen;
+		};
+		struct vtfs_fileobj file;	/* S_ISREG, first name only */
+	};
+};
+
+enum vtfs_mode {
+	VTFS_MODE_RAM,		/* local only */
+	VTFS_MODE_REMOTE,	/* mirrored to the server, written through */
+	VTFS_MODE_WRITEBACK,	/* mirrored, writes flushed in the background */
+};
+
+enum vtfs_compress_alg {
+	VTFS_COMPRESS_NONE,
+	VTFS_COMPRESS_LZ4,
+	VTFS_COMPRESS_ZSTD,
+};
+
+/* Mount options; see vtfs_fs_parameters for which remount may change. */
+struct vtfs_mount_opts {
+	const char *token;	/* the mount source in the remote modes */
+	enum vtfs_mode mode;
+	char server[INET_ADDRSTRLEN];
+	unsigned int port;	/* 0: the default for the protocol */
+	bool binary;		/* binary protocol instead of HTTP */
+	unsigned int pool;	/* connections to the server */
+	unsigned int chunk_shift;
+	unsigned int actimeo;	/* seconds a looked-up name and its attrs stay valid */
+	unsigned int negtimeo;	/* seconds an ENOENT result stays valid */
+	unsigned long long size;	/* bytes of file data, 0 for no limit */
+	unsigned long long nr_inodes;	/* 0 for no limit */
+	const char *image;	/* snapshot to load at mount and save at umount */
+	enum vtfs_compress_alg compress;
+	bool dedup;
+	unsigned int compress_age;	/* seconds a file stays untouched first */
 };
 
+/*
+ * There is no superblock-wide lock: each directory serialises its own
+ * updates with node->rwsem, lookups walk the index under RCU and removed
+ * nodes are freed after a grace period.  Pointers returned by the store
+ * stay valid for as long as the caller holds the VFS lock on the parent.
+ */
 struct vtfs_fs {
 	struct vtfs_node *root;
-	ino_t next_ino;
-	struct mutex lock;
+	atomic64_t next_ino;
+	struct vtfs_remote *remote;	/* NULL unless mounted in remote mode */
+	struct vtfs_compress *compress;	/* NULL unless compress= or dedup */
+	struct vtfs_dedup *dedup;	/* NULL unless dedup */
+	unsigned long attr_ttl;		/* remote mode, in jiffies */
+	unsigned long neg_ttl;
+	unsigned int chunk_shift;
+	struct vtfs_mount_opts opts;	/* as mounted, less the token */
+	struct vtfs_stats __percpu *stats;	/* NULL if unavailable */
+	struct dentry *debugfs;
+
+	/* size= and nr_inodes=, in chunks and inodes; 0 means no limit */
+	struct percpu_counter used_blocks;
+	struct percpu_counter used_inodes;
+	s64 max_blocks;
+	s64 max_inodes;
+
+	/* image=: where files not loaded yet read from, under image_sem */
+	struct file *image;
+	struct rw_semaphore image_sem;
+	struct path image_dir;	/* where saves create and rename the image */
+};
+
+/* Takes @n from a limited counter, or fails with -ENOSPC. */
+static inline int vtfs_charge(struct percpu_counter *used, s64 max, s64 n)
+{
+	if (!max) {
+		percpu_counter_add(used, n);
+		return 0;
+	}
+	return percpu_counter_limited_add(used, max, n) ? 0 : -ENOSPC;
+}
+
+struct vtfs_remote_attr {
+	ino_t ino;
+	umode_t mode;
+	loff_t size;
+};
+
+typedef int (*vtfs_remote_list_actor)(void *ctx, const char *name, size_t len,
+                                      const struct vtfs_remote_attr *attr);
+typedef void (*vtfs_fill_fn)(void *ctx, struct vtfs_node *child,
+                             const struct vtfs_remote_attr *attr);
+
+enum vtfs_stat_op {
+	VTFS_ST_LOOKUP,
+	VTFS_ST_CREATE,
+	VTFS_ST_UNLINK,
+	VTFS_ST_MKDIR,
+	VTFS_ST_RMDIR,
+	VTFS_ST_LINK,
+	VTFS_ST_ITERATE,
+	VTFS_ST_GETATTR,
+	VTFS_ST_SETATTR,
+	VTFS_ST_OPEN,
+	VTFS_ST_READ,
+	VTFS_ST_WRITE,
+	VTFS_ST_MMAP,
+	VTFS_ST_FSYNC,
+	VTFS_ST_FALLOCATE,
+	VTFS_ST_LLSEEK,
+	VTFS_ST_REMAP,		/* clones through remap_file_range */
+	VTFS_ST_COPY,		/* copy_file_range */
+	VTFS_ST_DIR_LOCK,	/* waiting for a directory's rwsem */
+	VTFS_ST_ALLOC,		/* node allocation */
+	VTFS_ST_REMOTE,		/* one server round trip */
+	VTFS_ST_NR
 };
 
+void vtfs_stats_module_init(void);
+void vtfs_stats_module_exit(void);
+void vtfs_stats_init(struct super_block *sb);
+void vtfs_stats_destroy(struct super_block *sb);
+u64 vtfs_stat_end_bytes(struct super_block *sb, enum vtfs_stat_op op,
+                        u64 start, u64 bytes);
+void vtfs_stat_remote_error(struct super_block *sb);
+
+static inline u64 vtfs_stat_start(void)
+{
+	return ktime_get_ns();
+}
+
+static inline u64 vtfs_stat_end(struct super_block *sb, enum vtfs_stat_op op,
+                                u64 start)
+{
+	return vtfs_stat_end_bytes(sb, op, start, 0);
+}
+
 static inline bool vtfs_is_dir(const struct vtfs_node *n)
 {
 	return S_ISDIR(n->mode);
 }
 
+int vtfs_store_cache_init(void);
+void vtfs_store_cache_destroy(void);
+void vtfs_store_fileobj_free(struct vtfs_fileobj *f);
+void vtfs_store_dir_put(struct vtfs_node *dir);
+
 int vtfs_store_init(struct super_block *sb);
 void vtfs_store_destroy(struct super_block *sb);
 
@@ -61,18 +276,154 @@ int vtfs_store_rmdir(struct super_block *sb,
 int vtfs_store_link(struct super_block *sb,
                     struct vtfs_node *parent,
                     const char *name,
-                    struct vtfs_node *target);
+                    struct vtfs_fileobj *f,
+                    ino_t ino);
+
+struct vtfs_node *vtfs_store_insert(struct super_block *sb,
+                                    struct vtfs_node *parent,
+                                    const char *name,
+                                    umode_t mode,
+                                    ino_t ino,
+                                    struct vtfs_fileobj *f);
+
+int vtfs_store_fill_dir(struct super_block *sb, struct vtfs_node *dir,
+                        vtfs_fill_fn fn, void *ctx);
+int vtfs_store_revalidate(struct super_block *sb,
+                          struct vtfs_node *parent,
+                          const char *name,
+                          ino_t ino,
+                          struct vtfs_remote_attr *attr);
+
+int vtfs_remote_init(struct super_block *sb,
+                     const struct vtfs_mount_opts *opts);
+void vtfs_remote_destroy(struct super_block *sb);
+int vtfs_remote_lookup(struct vtfs_fs *fs, ino_t parent, const char *name,
+                       struct vtfs_remote_attr *attr);
+int vtfs_remote_create(struct vtfs_fs *fs, ino_t parent, const char *name,
+                       umode_t mode, struct vtfs_remote_attr *attr);
+int vtfs_remote_unlink(struct vtfs_fs *fs, ino_t parent, const char *name);
+int vtfs_remote_rmdir(struct vtfs_fs *fs, ino_t parent, const char *name);
+int vtfs_remote_link(struct vtfs_fs *fs, ino_t ino, ino_t parent,
+                     const char *name);
+int vtfs_remote_list(struct vtfs_fs *fs, ino_t ino,
+                     vtfs_remote_list_actor actor, void *ctx);
+ssize_t vtfs_remote_read(struct vtfs_fs *fs, ino_t ino, loff_t pos,
+                         void *buf, size_t len);
+int vtfs_remote_write(struct vtfs_fs *fs, ino_t ino, loff_t pos,
+                      const void *buf, size_t len);
+int vtfs_remote_truncate(struct vtfs_fs *fs, ino_t ino, loff_t size);
+int vtfs_remote_commit(struct vtfs_fs *fs, ino_t ino, struct vtfs_fileobj *f,
+                       loff_t pos, const void *buf, size_t len);
+int vtfs_remote_sync(struct vtfs_fs *fs, struct vtfs_fileobj *f);
+int vtfs_remote_fetch(struct vtfs_fs *fs, ino_t ino, struct vtfs_fileobj *f);
+
+void vtfs_fileobj_init(struct vtfs_fileobj *f, struct vtfs_fs *fs);
+void vtfs_fileobj_put(struct vtfs_fileobj *f);
+int vtfs_fileobj_read(struct vtfs_fileobj *f, loff_t pos, void *buf, size_t len);
+int vtfs_fileobj_write(struct vtfs_fileobj *f, loff_t pos, const void *buf, size_t len);
+void vtfs_fileobj_set_mapping(struct vtfs_fileobj *f,
+                              struct address_space *mapping);
+int vtfs_fileobj_read_folios(struct vtfs_fileobj *f, struct folio **folios,
+                             unsigned int nr);
+int vtfs_fileobj_cache_folio(struct vtfs_fileobj *f, struct folio *folio,
+                             loff_t pos, size_t len);
+int vtfs_fileobj_write_folio(struct vtfs_fileobj *f, struct folio *folio,
+                             loff_t pos, const void *buf, size_t len);
+int vtfs_fileobj_writeback_folio(struct vtfs_fileobj *f, struct folio *folio,
+                                 gfp_t gfp);
+int vtfs_fileobj_truncate(struct vtfs_fileobj *f, loff_t size);
+int vtfs_fileobj_clone(struct vtfs_fileobj *dst, loff_t dpos,
+                       struct vtfs_fileobj *src, loff_t spos, loff_t len);
+int vtfs_fileobj_allocate(struct vtfs_fileobj *f, loff_t pos, loff_t len, bool keep_size);
+int vtfs_fileobj_punch(struct vtfs_fileobj *f, loff_t pos, loff_t len);
+loff_t vtfs_fileobj_seek(struct vtfs_fileobj *f, loff_t pos, int whence);
+void vtfs_fileobj_set_remote(struct vtfs_fileobj *f, loff_t size);
+void vtfs_fileobj_set_image(struct vtfs_fileobj *f, loff_t off, loff_t size);
+int vtfs_fileobj_load(struct vtfs_fileobj *f, struct file *image);
+int vtfs_fileobj_save(struct vtfs_fileobj *f, struct file *out, loff_t off);
+void vtfs_fileobj_move_image(struct vtfs_fileobj *f, loff_t off);
+
+/* compress=: a chunk's bytes, compressed, in place of the chunk */
+struct vtfs_zchunk {
+	struct vtfs_hot_chunk *hot;	/* decompressed copy, if cached */
+	unsigned int len;
+	u8 data[];
+};
+
+int vtfs_compress_init(struct super_block *sb,
+                       const struct vtfs_mount_opts *opts);
+void vtfs_compress_destroy(struct super_block *sb);
+void vtfs_compress_set_age(struct vtfs_fs *fs, unsigned int seconds);
+void vtfs_compress_track(struct vtfs_fileobj *f);
+void vtfs_compress_untrack(struct vtfs_fileobj *f);
+struct vtfs_zchunk *vtfs_compress_chunk(struct vtfs_fs *fs, const void *src,
+                                        size_t len);
+int vtfs_decompress_chunk(struct vtfs_fs *fs, const struct vtfs_zchunk *z,
+                          void *dst, size_t len);
+int vtfs_compress_read(struct vtfs_fs *fs, struct vtfs_zchunk *z, size_t off,
+                       void *dst, size_t len);
+void vtfs_zchunk_free(struct vtfs_fs *fs, struct vtfs_zchunk *z);
+unsigned long vtfs_compress_bytes(struct vtfs_fs *fs);
+void vtfs_fileobj_compact(struct vtfs_fileobj *f);
+
+int vtfs_dedup_init(struct super_block *sb);
+void vtfs_dedup_destroy(struct super_block *sb);
+struct vtfs_chunk_ref *vtfs_dedup_chunk(struct vtfs_fs *fs, void *chunk,
+                                        struct vtfs_zchunk *z, size_t len);
+bool vtfs_dedup_put(struct vtfs_fs *fs, struct vtfs_chunk_ref *ref);
+bool vtfs_dedup_take(struct vtfs_fs *fs, struct vtfs_chunk_ref *ref);
+
+/* image= file format; see vtfs_image.c */
+#define VTFS_IMAGE_MAGIC   0x31474d4953465456ULL	/* "VTFSIMG1" */
+#define VTFS_IMAGE_VERSION 1
+
+/* vtfs_image_node.flags: later records are hard links to this one */
+#define VTFS_IMAGE_LINKED 0x1
+
+struct vtfs_image_hdr {
+	__le64 magic;
+	__le32 version;
+	__le32 reserved;
+	__le64 next_ino;	/* above every ino in the image */
+	__le64 nr_nodes;	/* including the root, record 0 */
+	__le64 nodes_off;
+	__le64 names_off;
+	__le64 names_len;
+	__le64 data_off;
+} __packed;
+
+struct vtfs_image_node {
+	__le64 ino;
+	__le64 parent;		/* record of the parent directory */
+	__le64 link;		/* record that holds the contents, or this one */
+	__le64 size;
+	__le64 data;		/* image offset of the contents, 0 if none */
+	__le32 mode;
+	__le16 name_len;
+	__le16 flags;
+} __packed;
+
+/* ioctl on a vtfs directory: write the image= snapshot now */
+#define VTFS_IOC_SAVE _IO('v', 1)
+
+int vtfs_image_load(struct super_block *sb);
+int vtfs_image_save(struct super_block *sb);
+void vtfs_image_destroy(struct super_block *sb);
+int vtfs_image_fetch(struct vtfs_fs *fs, struct vtfs_fileobj *f);
+long vtfs_image_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 
 extern struct file_system_type vtfs_fs_type;
 extern const struct super_operations vtfs_super_ops;
 extern const struct inode_operations vtfs_dir_iops;
 extern const struct file_operations vtfs_dir_fops;
+extern const struct inode_operations vtfs_file_iops;
 extern const struct file_operations vtfs_file_fops;
+extern const struct address_space_operations vtfs_aops;
+extern const struct dentry_operations vtfs_dentry_ops;
 
 struct inode *vtfs_inode_from_node(struct super_block *sb,
                                    struct vtfs_node *node);
 
-int vtfs_fill_super(struct super_block *sb, void *data, int silent);
 
 struct dentry *vtfs_lookup(struct inode *dir,
                            struct dentry *dentry,
@@ -91,5 +442,23 @@ int vtfs_link(struct dentry *old_dentry,
               struct inode *dir,
               struct dentry *new_dentry);
 
+void vtfs_dentry_stamp(struct dentry *dentry);
+
+int vtfs_getattr(struct mnt_idmap *idmap,
+                 const struct path *path,
+                 struct kstat *stat,
+                 u32 request_mask,
+                 unsigned int query_flags);
+
+int vtfs_timed_getattr(struct mnt_idmap *idmap,
+                       const struct path *path,
+                       struct kstat *stat,
+                       u32 request_mask,
+                       unsigned int query_flags);
+
+void vtfs_file_refresh(struct inode *inode, loff_t size);
+void vtfs_file_evict(struct inode *inode);
+void vtfs_file_cool(struct vtfs_fileobj *f);
+
 struct vtfs_fs *vtfs_fs(struct super_block *sb);
 #endif
\ No newline at end of file
@@ -0,0 +1,465 @@
+#include "vtfs.h"
+#include <linux/crypto.h>
+#include <linux/debugfs.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+/*
+ * compress=lz4|zstd: chunks of files nobody has read or written for
+ * compress_age seconds are swapped for compressed copies, and go back to
+ * plain chunks when they are next written (vtfs_data.c).  Reads leave
+ * them compressed and go through a small per-mount LRU of decompressed
+ * chunks, the hot cache, so that a chunk read piecemeal is decompressed
+ * once and a sweep over cold files does not inflate them all.  Files
+ * with plain chunks sit on the warm list until the worker finds them
+ * cold.  The list holds no reference: the last put takes a file off it,
+ * so deleted files are freed right away.  Chunks that compress by less than a quarter
+ * stay as they are.
+ *
+ * Every CPU has its own tfm and output buffer, so compressing and
+ * inflating only contend when a task moves to another CPU mid-call.
+ *
+ * dedup runs off the same worker, on the compressed copies when there
+ * are any, so that the chunks in its table are compressed too.  A mount
+ * with dedup only has no tfm.
+ *
+ * With debugfs, "compression" next to "stats" shows what it saved.
+ */
+
+#define VTFS_COMPRESS_INTERVAL (5 * HZ)	/* or compress_age, if shorter */
+#define VTFS_HOT_BYTES SZ_4M		/* hot cache size, at least 4 chunks */
+
+/* crypto API names */
+static const char *const vtfs_compress_names[] = {
+	[VTFS_COMPRESS_LZ4]  = "lz4",
+	[VTFS_COMPRESS_ZSTD] = "zstd",
+};
+
+struct vtfs_compress_cpu {
+	struct mutex lock;		/* protects tfm and scratch */
+	struct crypto_comp *tfm;
+	void *scratch;			/* compressor output, two chunks */
+};
+
+/* A decompressed chunk in the hot cache, pinned by readers copying it. */
+struct vtfs_hot_chunk {
+	struct list_head lru;
+	struct vtfs_zchunk *z;
+	refcount_t users;
+	u8 data[];
+};
+
+struct vtfs_compress {
+	struct vtfs_fs *fs;
+	const char *alg;
+	struct vtfs_compress_cpu __percpu *cpus;	/* NULL with dedup only */
+	unsigned long age;		/* in jiffies */
+
+	spinlock_t warm_lock;		/* protects warm_list */
+	struct list_head warm_list;
+	struct workqueue_struct *wq;
+	struct delayed_work work;
+	struct dentry *debugfs;
+
+	spinlock_t hot_lock;		/* protects hot_lru, hot_nr, zchunk->hot */
+	struct list_head hot_lru;	/* most recently read first */
+	unsigned int hot_nr, hot_max;
+
+	atomic_long_t chunks;		/* compressed chunks now */
+	atomic_long_t bytes;		/* what they take */
+	atomic_long_t inflated;		/* decompressed back, ever */
+	atomic_long_t hot_hits;		/* reads the hot cache served, ever */
+	atomic_long_t rejected;		/* kept plain, ever */
+};
+
+static unsigned long vtfs_compress_interval(struct vtfs_compress *c)
+{
+	return clamp_t(unsigned long, READ_ONCE(c->age), HZ,
+	               VTFS_COMPRESS_INTERVAL);
+}
+
+/* Puts @f on the warm list, once; called when it gets a plain chunk. */
+void vtfs_compress_track(struct vtfs_fileobj *f)
+{
+	struct vtfs_compress *c = f->fs->compress;
+
+	if (!c || !list_empty_careful(&f->warm))
+		return;
+
+	spin_lock(&c->warm_lock);
+	if (list_empty(&f->warm))
+		list_add_tail(&f->warm, &c->warm_list);
+	spin_unlock(&c->warm_lock);
+}
+
+/* Takes @f off the warm list; called by the last put. */
+void vtfs_compress_untrack(struct vtfs_fileobj *f)
+{
+	struct vtfs_compress *c = f->fs->compress;
+
+	if (!c || list_empty_careful(&f->warm))
+		return;
+
+	spin_lock(&c->warm_lock);
+	list_del_init(&f->warm);
+	spin_unlock(&c->warm_lock);
+}
+
+/*
+ * Returns a compressed copy of the @len bytes at @src, or NULL if it
+ * would not save enough to be worth it.
+ */
+struct vtfs_zchunk *vtfs_compress_chunk(struct vtfs_fs *fs, const void *src,
+                                        size_t len)
+{
+	struct vtfs_compress *c = fs->compress;
+	struct vtfs_compress_cpu *cpu;
+	struct vtfs_zchunk *z = NULL;
+	unsigned int dlen = 2 * len;
+	int err;
+
+	if (!c || !c->cpus)
+		return NULL;
+
+	cpu = raw_cpu_ptr(c->cpus);
+	mutex_lock(&cpu->lock);
+	err = crypto_comp_compress(cpu->tfm, src, len, cpu->scratch, &dlen);
+	if (!err && dlen <= len - len / 4)
+		z = kmalloc(struct_size(z, data, dlen), GFP_KERNEL_ACCOUNT);
+	if (z) {
+		z->hot = NULL;
+		z->len = dlen;
+		memcpy(z->data, cpu->scratch, dlen);
+	}
+	mutex_unlock(&cpu->lock);
+
+	if (!z) {
+		atomic_long_inc(&c->rejected);
+		return NULL;
+	}
+	atomic_long_inc(&c->chunks);
+	atomic_long_add(dlen, &c->bytes);
+	return z;
+}
+
+/* Decompresses @z into the @len bytes at @dst. */
+int vtfs_decompress_chunk(struct vtfs_fs *fs, const struct vtfs_zchunk *z,
+                          void *dst, size_t len)
+{
+	struct vtfs_compress *c = fs->compress;
+	struct vtfs_compress_cpu *cpu = raw_cpu_ptr(c->cpus);
+	unsigned int dlen = len;
+	int err;
+
+	mutex_lock(&cpu->lock);
+	err = crypto_comp_decompress(cpu->tfm, z->data, z->len, dst, &dlen);
+	mutex_unlock(&cpu->lock);
+
+	if (!err && dlen != len)
+		err = -EIO;
+	if (err) {
+		pr_err_ratelimited("[vtfs] bad compressed chunk: %d\n", err);
+		return -EIO;
+	}
+	atomic_long_inc(&c->inflated);
+	return 0;
+}
+
+static void vtfs_hot_put(struct vtfs_hot_chunk *h)
+{
+	if (refcount_dec_and_test(&h->users))
+		kvfree(h);
+}
+
+/* Caller holds hot_lock.  Takes @h out of the hot cache. */
+static void vtfs_hot_unlink(struct vtfs_compress *c, struct vtfs_hot_chunk *h)
+{
+	h->z->hot = NULL;
+	list_del(&h->lru);
+	c->hot_nr--;
+}
+
+/*
+ * Copies @len bytes at @off of what @z decompresses to into @dst, through
+ * the hot cache.  @z stays as it is.
+ */
+int vtfs_compress_read(struct vtfs_fs *fs, struct vtfs_zchunk *z, size_t off,
+                       void *dst, size_t len)
+{
+	struct vtfs_compress *c = fs->compress;
+	size_t size = 1UL << fs->chunk_shift;
+	struct vtfs_hot_chunk *h, *old = NULL;
+	int err;
+
+	spin_lock(&c->hot_lock);
+	h = z->hot;
+	if (h) {
+		refcount_inc(&h->users);
+		list_move(&h->lru, &c->hot_lru);
+	}
+	spin_unlock(&c->hot_lock);
+
+	if (h) {
+		atomic_long_inc(&c->hot_hits);
+	} else {
+		h = kvmalloc(struct_size(h, data, size), GFP_KERNEL);
+		if (!h)
+			return -ENOMEM;
+		err = vtfs_decompress_chunk(fs, z, h->data, size);
+		if (err) {
+			kvfree(h);
+			return err;
+		}
+		h->z = z;
+
+		spin_lock(&c->hot_lock);
+		if (z->hot) {
+			/* another reader got there first; this copy is ours only */
+			refcount_set(&h->users, 1);
+		} else {
+			refcount_set(&h->users, 2);
+			z->hot = h;
+			list_add(&h->lru, &c->hot_lru);
+			if (++c->hot_nr > c->hot_max) {
+				old = list_last_entry(&c->hot_lru,
+				                      struct vtfs_hot_chunk, lru);
+				vtfs_hot_unlink(c, old);
+			}
+		}
+		spin_unlock(&c->hot_lock);
+		if (old)
+			vtfs_hot_put(old);
+	}
+
+	memcpy(dst, h->data + off, len);
+	vtfs_hot_put(h);
+	return 0;
+}
+
+void vtfs_zchunk_free(struct vtfs_fs *fs, struct vtfs_zchunk *z)
+{
+	struct vtfs_compress *c = fs->compress;
+	struct vtfs_hot_chunk *h;
+
+	if (c) {
+		spin_lock(&c->hot_lock);
+		h = z->hot;
+		if (h)
+			vtfs_hot_unlink(c, h);
+		spin_unlock(&c->hot_lock);
+		if (h)
+			vtfs_hot_put(h);
+
+		atomic_long_dec(&c->chunks);
+		atomic_long_sub(z->len, &c->bytes);
+	}
+	kfree(z);
+}
+
+/* What compressed chunks take now; 0 without compress=. */
+unsigned long vtfs_compress_bytes(struct vtfs_fs *fs)
+{
+	struct vtfs_compress *c = fs->compress;
+
+	return c ? atomic_long_read(&c->bytes) : 0;
+}
+
+/*
+ * Compresses the files on the warm list that have gone cold; the others
+ * go back on it for the next pass.
+ */
+static void vtfs_compress_work(struct work_struct *work)
+{
+	struct vtfs_compress *c = container_of(to_delayed_work(work),
+	                                       struct vtfs_compress, work);
+	unsigned long age = READ_ONCE(c->age);
+	struct vtfs_fileobj *f;
+	LIST_HEAD(batch);
+
+	spin_lock(&c->warm_lock);
+	list_splice_init(&c->warm_list, &batch);
+	spin_unlock(&c->warm_lock);
+
+	for (;;) {
+		/* the last put may take files off the batch meanwhile */
+		spin_lock(&c->warm_lock);
+		f = list_first_entry_or_null(&batch, struct vtfs_fileobj, warm);
+		if (!f) {
+			spin_unlock(&c->warm_lock);
+			break;
+		}
+		if (time_before(jiffies, READ_ONCE(f->touched) + age)) {
+			list_move_tail(&f->warm, &c->warm_list);
+			f = NULL;
+		} else {
+			list_del_init(&f->warm);
+			if (!atomic_inc_not_zero(&f->refcnt))
+				f = NULL;	/* being freed */
+		}
+		spin_unlock(&c->warm_lock);
+
+		if (f) {
+			vtfs_file_cool(f);
+			vtfs_fileobj_compact(f);
+			vtfs_fileobj_put(f);
+		}
+		cond_resched();
+	}
+
+	queue_delayed_work(c->wq, &c->work, vtfs_compress_interval(c));
+}
+
+static int vtfs_compression_show(struct seq_file *m, void *v)
+{
+	struct vtfs_compress *c = m->private;
+	long chunks = atomic_long_read(&c->chunks);
+
+	seq_printf(m, "algorithm %s\n", c->alg);
+	seq_printf(m, "chunks %ld\n", chunks);
+	seq_printf(m, "logical_bytes %llu\n",
+	           (unsigned long long)chunks << c->fs->chunk_shift);
+	seq_printf(m, "compressed_bytes %ld\n", atomic_long_read(&c->bytes));
+	seq_printf(m, "inflated %ld\n", atomic_long_read(&c->inflated));
+	seq_printf(m, "hot_hits %ld\n", atomic_long_read(&c->hot_hits));
+	seq_printf(m, "rejected %ld\n", atomic_long_read(&c->rejected));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vtfs_compression);
+
+static void vtfs_compress_free_cpus(struct vtfs_compress *c)
+{
+	struct vtfs_compress_cpu *cpu;
+	int i;
+
+	if (!c->cpus)
+		return;
+	for_each_possible_cpu(i) {
+		cpu = per_cpu_ptr(c->cpus, i);
+		kvfree(cpu->scratch);
+		if (!IS_ERR_OR_NULL(cpu->tfm))
+			crypto_free_comp(cpu->tfm);
+	}
+	free_percpu(c->cpus);
+	c->cpus = NULL;
+}
+
+/* One tfm and scratch buffer for every possible CPU, on its node. */
+static int vtfs_compress_alloc_cpus(struct vtfs_compress *c)
+{
+	struct vtfs_compress_cpu *cpu;
+	int i, err;
+
+	c->cpus = alloc_percpu(struct vtfs_compress_cpu);
+	if (!c->cpus)
+		return -ENOMEM;
+
+	for_each_possible_cpu(i) {
+		cpu = per_cpu_ptr(c->cpus, i);
+		mutex_init(&cpu->lock);
+		cpu->tfm = crypto_alloc_comp(c->alg, 0, 0);
+		if (IS_ERR(cpu->tfm)) {
+			err = PTR_ERR(cpu->tfm);
+			pr_err("[vtfs] compress=%s: %d\n", c->alg, err);
+			goto fail;
+		}
+		cpu->scratch = kvmalloc_node(2UL << c->fs->chunk_shift,
+		                             GFP_KERNEL, cpu_to_node(i));
+		if (!cpu->scratch) {
+			err = -ENOMEM;
+			goto fail;
+		}
+	}
+	return 0;
+
+fail:
+	vtfs_compress_free_cpus(c);
+	return err;
+}
+
+int vtfs_compress_init(struct super_block *sb,
+                       const struct vtfs_mount_opts *opts)
+{
+	struct vtfs_fs *fs = vtfs_fs(sb);
+	struct vtfs_compress *c;
+	int err;
+
+	c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		return -ENOMEM;
+	c->fs = fs;
+	c->age = opts->compress_age * HZ;
+	spin_lock_init(&c->warm_lock);
+	INIT_LIST_HEAD(&c->warm_list);
+	INIT_DELAYED_WORK(&c->work, vtfs_compress_work);
+	spin_lock_init(&c->hot_lock);
+	INIT_LIST_HEAD(&c->hot_lru);
+	c->hot_max = max(VTFS_HOT_BYTES >> fs->chunk_shift, 4);
+
+	if (opts->compress) {
+		c->alg = vtfs_compress_names[opts->compress];
+		err = vtfs_compress_alloc_cpus(c);
+		if (err)
+			goto err_free;
+	}
+	err = -ENOMEM;
+	c->wq = alloc_workqueue("vtfs-compress", WQ_UNBOUND, 1);
+	if (!c->wq)
+		goto err_cpus;
+
+	if (c->cpus && fs->debugfs)
+		c->debugfs = debugfs_create_file("compression", 0444, fs->debugfs,
+		                                 c, &vtfs_compression_fops);
+
+	fs->compress = c;
+	queue_delayed_work(c->wq, &c->work, vtfs_compress_interval(c));
+	return 0;
+
+err_cpus:
+	vtfs_compress_free_cpus(c);
+err_free:
+	kfree(c);
+	return err;
+}
+
+void vtfs_compress_set_age(struct vtfs_fs *fs, unsigned int seconds)
+{
+	struct vtfs_compress *c = fs->compress;
+
+	if (c) {
+		WRITE_ONCE(c->age, seconds * HZ);
+		mod_delayed_work(c->wq, &c->work, vtfs_compress_interval(c));
+	}
+}
+
+/* Chunks still compressed are left for vtfs_store_destroy() to free. */
+void vtfs_compress_destroy(struct super_block *sb)
+{
+	struct vtfs_fs *fs = vtfs_fs(sb);
+	struct vtfs_compress *c;
+	struct vtfs_fileobj *f, *tmp;
+	struct vtfs_hot_chunk *h, *htmp;
+
+	if (!fs || !fs->compress)
+		return;
+	c = fs->compress;
+
+	debugfs_remove(c->debugfs);
+	cancel_delayed_work_sync(&c->work);
+	destroy_workqueue(c->wq);
+	spin_lock(&c->warm_lock);
+	list_for_each_entry_safe(f, tmp, &c->warm_list, warm)
+		list_del_init(&f->warm);
+	spin_unlock(&c->warm_lock);
+
+	list_for_each_entry_safe(h, htmp, &c->hot_lru, lru) {
+		vtfs_hot_unlink(c, h);
+		vtfs_hot_put(h);
+	}
+
+	fs->compress = NULL;
+	vtfs_compress_free_cpus(c);
+	kfree(c);
+}
@@ -0,0 +1,1243 @@
+#include "vtfs.h"
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+/*
+ * File contents are kept as fixed-size chunks in an xarray indexed by
+ * offset >> fs->chunk_shift (chunk_size=, a page by default).  Missing
+ * chunks read as zeros, so writes and appends only touch the chunks they
+ * cover.
+ *
+ * Files start out with their bytes inline in the fileobj, in the space
+ * the xarray would otherwise occupy, and move to chunks the first time
+ * they need to grow past VTFS_INLINE_DATA_LEN.  Bytes past f->size in
+ * the inline buffer are always zero.
+ *
+ * Every chunk is charged to the mount's used_blocks, against size=, and
+ * to the memcg of whoever caused it to be allocated.
+ *
+ * Clones (FICLONE and friends) share chunks between fileobjs.  A shared
+ * chunk sits in each xarray as a tagged pointer to a vtfs_chunk_ref that
+ * counts its users, and is charged once; whoever writes to it first gets
+ * a private copy.  With dedup, cold files share chunks the same way
+ * with any other chunk that has the same bytes (vtfs_dedup.c).
+ *
+ * Files that come from an image (image=) keep their contents there,
+ * at f->image_off, until they are first opened; see vtfs_image.c.
+ *
+ * With compress=, chunks of files left alone for a while are replaced
+ * by a tagged pointer to a vtfs_zchunk (vtfs_compress.c), still charged
+ * as one chunk.  Reads go through the hot cache of decompressed chunks
+ * and leave it compressed; writes inflate it back in place first, so
+ * that a file being written keeps plain chunks.  Shared chunks from the
+ * dedup table, and clones of compressed chunks, may be compressed as
+ * well; they are read the same way, and written ones inflate into a
+ * private copy.
+ *
+ * Once a file has an inode, its page cache holds the bytes of the chunks
+ * it reads or writes: those are swapped for VTFS_CHUNK_CACHED, still
+ * charged as one chunk, and their pages are kept dirty so that reclaim
+ * leaves them alone, the way tmpfs keeps its own.  Pages of a cached
+ * chunk that are not there read as zeros.  Holes, shared and compressed
+ * chunks stay where they are, read into clean pages.  Files going cold
+ * and inodes being evicted put their cached chunks back into buffers
+ * (vtfs_file.c) before anything here needs them.
+ */
+
+void vtfs_fileobj_init(struct vtfs_fileobj *f, struct vtfs_fs *fs)
+{
+	f->fs = fs;
+	mutex_init(&f->lock);
+	memset(f->idata, 0, sizeof(f->idata));
+	f->inline_data = true;
+	INIT_LIST_HEAD(&f->dirty);
+	f->remote_size = -1;
+	INIT_LIST_HEAD(&f->warm);
+	atomic_set(&f->refcnt, 1);
+	atomic_set(&f->nlink, 1);
+}
+
+static inline unsigned int vtfs_chunk_shift(const struct vtfs_fileobj *f)
+{
+	return f->fs->chunk_shift;
+}
+
+static void *vtfs_chunk_alloc(struct vtfs_fileobj *f)
+{
+	void *chunk;
+	int err;
+
+	err = vtfs_charge(&f->fs->used_blocks, f->fs->max_blocks, 1);
+	if (err)
+		return ERR_PTR(err);
+
+	chunk = kvzalloc(1UL << vtfs_chunk_shift(f), GFP_KERNEL_ACCOUNT);
+	if (!chunk) {
+		percpu_counter_dec(&f->fs->used_blocks);
+		return ERR_PTR(-ENOMEM);
+	}
+	vtfs_compress_track(f);
+	return chunk;
+}
+
+/* tag 2 marks the xarray's own internal entries, so it is not ours */
+#define VTFS_CHUNK_SHARED 1	/* xa_pointer_tag() of a vtfs_chunk_ref */
+#define VTFS_CHUNK_COMPRESSED 3	/* xa_pointer_tag() of a vtfs_zchunk */
+
+/* The entry of a chunk whose bytes are in the page cache, f->mapping. */
+static unsigned long vtfs_chunk_cached;
+#define VTFS_CHUNK_CACHED ((void *)&vtfs_chunk_cached)
+
+static inline struct vtfs_chunk_ref *vtfs_chunk_ref(void *entry)
+{
+	if (xa_pointer_tag(entry) != VTFS_CHUNK_SHARED)
+		return NULL;
+	return xa_untag_pointer(entry);
+}
+
+static inline struct vtfs_zchunk *vtfs_chunk_z(void *entry)
+{
+	if (xa_pointer_tag(entry) != VTFS_CHUNK_COMPRESSED)
+		return NULL;
+	return xa_untag_pointer(entry);
+}
+
+/* The vtfs_zchunk behind an xarray entry, shared or not, if compressed. */
+static inline struct vtfs_zchunk *vtfs_chunk_zdata(void *entry)
+{
+	struct vtfs_chunk_ref *ref = vtfs_chunk_ref(entry);
+
+	if (ref)
+		return ref->compressed ? ref->data : NULL;
+	return vtfs_chunk_z(entry);
+}
+
+/* The bytes behind an xarray entry, shared or not; never a compressed one. */
+static inline void *vtfs_chunk_data(void *entry)
+{
+	struct vtfs_chunk_ref *ref = vtfs_chunk_ref(entry);
+
+	return ref ? ref->data : entry;
+}
+
+/* Drops an xarray entry; a shared chunk is only freed by its last user. */
+static void vtfs_chunk_free(struct vtfs_fileobj *f, void *entry)
+{
+	struct vtfs_chunk_ref *ref = vtfs_chunk_ref(entry);
+	struct vtfs_zchunk *z = vtfs_chunk_z(entry);
+
+	if (!entry)
+		return;
+	if (entry == VTFS_CHUNK_CACHED)
+		goto uncharge;
+	if (ref) {
+		if (!vtfs_dedup_put(f->fs, ref))
+			return;
+		entry = ref->data;
+		if (ref->compressed)
+			z = entry;
+		kfree(ref);
+	}
+	if (z)
+		vtfs_zchunk_free(f->fs, z);
+	else
+		kvfree(entry);
+uncharge:
+	percpu_counter_dec(&f->fs->used_blocks);
+}
+
+/*
+ * Caller holds f->lock.  Copies [pos, pos + len) of a cached chunk from
+ * the page cache; pages that are not there, or not read in, are zeros.
+ */
+static void vtfs_cache_read(struct vtfs_fileobj *f, loff_t pos, void *buf,
+                            size_t len)
+{
+	struct folio *folio;
+	size_t off, n;
+	void *kaddr;
+
+	while (len) {
+		off = offset_in_page(pos);
+		n = min_t(size_t, len, PAGE_SIZE - off);
+
+		folio = f->mapping ? filemap_get_folio(f->mapping, pos >> PAGE_SHIFT)
+		                   : ERR_PTR(-ENOENT);
+		if (!IS_ERR(folio) && folio_test_uptodate(folio)) {
+			kaddr = kmap_local_folio(folio, offset_in_folio(folio, pos));
+			memcpy(buf, kaddr, n);
+			kunmap_local(kaddr);
+		} else {
+			memset(buf, 0, n);
+		}
+		if (!IS_ERR(folio))
+			folio_put(folio);
+
+		buf += n;
+		pos += n;
+		len -= n;
+	}
+}
+
+/*
+ * Caller holds f->lock.  Gives chunk @idx, cached, a buffer again, filled
+ * from the page cache with memory from @gfp, and returns it or an
+ * ERR_PTR.  The pages themselves are left alone.
+ */
+static void *vtfs_chunk_uncache(struct vtfs_fileobj *f, pgoff_t idx, gfp_t gfp)
+{
+	size_t size = 1UL << vtfs_chunk_shift(f);
+	loff_t start = (loff_t)idx << vtfs_chunk_shift(f);
+	void *chunk;
+	size_t n;
+
+	chunk = kvmalloc(size, gfp);
+	if (!chunk)
+		return ERR_PTR(-ENOMEM);
+	/* pages past EOF may still hold bytes from before a truncate */
+	n = clamp_t(loff_t, f->size - start, 0, size);
+	vtfs_cache_read(f, start, chunk, n);
+	memset(chunk + n, 0, size - n);
+
+	/* keeps the charge; replaces a present entry, so this cannot fail */
+	xa_store(&f->chunks, idx, chunk, GFP_KERNEL_ACCOUNT);
+	return chunk;
+}
+
+/*
+ * Caller holds f->lock and the locks of the @nr_held consecutive folios
+ * at @held, in chunk @idx.  Hands @chunk, plain and private to @f, over
+ * to the page cache: its pages below EOF are filled from it, unless they
+ * are uptodate already, and dirtied, and @chunk is freed for
+ * VTFS_CHUNK_CACHED with the same charge.  All or nothing: returns false,
+ * with the chunk left as it was, if another of those pages is locked or
+ * cannot be added.
+ */
+static bool vtfs_chunk_cache(struct vtfs_fileobj *f, pgoff_t idx, void *chunk,
+                             struct folio **held, unsigned int nr_held)
+{
+	unsigned int shift = vtfs_chunk_shift(f);
+	struct address_space *mapping = f->mapping;
+	pgoff_t first = idx << (shift - PAGE_SHIFT);
+	pgoff_t held_first = held[0]->index;
+	pgoff_t held_last = held[nr_held - 1]->index;
+	loff_t start = (loff_t)idx << shift;
+	struct folio **folios, *one, *folio;
+	unsigned long nr, i;
+	bool cached;
+	void *kaddr;
+
+	if (!mapping)
+		return false;
+
+	nr = f->size > start ? DIV_ROUND_UP_ULL(f->size - start, PAGE_SIZE) : 0;
+	nr = min(nr, 1UL << (shift - PAGE_SHIFT));
+	nr = max(nr, held_last - first + 1);
+	folios = nr > 1 ? kmalloc_array(nr, sizeof(*folios), GFP_KERNEL) : &one;
+	if (!folios)
+		return false;
+
+	for (i = 0; i < nr; i++) {
+		if (first + i >= held_first && first + i <= held_last) {
+			folios[i] = held[first + i - held_first];
+			continue;
+		}
+		/* page locks come before f->lock, so never wait for one here */
+		folios[i] = __filemap_get_folio(mapping, first + i,
+		                                FGP_LOCK | FGP_CREAT | FGP_NOWAIT,
+		                                mapping_gfp_mask(mapping));
+		if (IS_ERR(folios[i]))
+			break;
+	}
+	cached = i == nr;
+
+	for (nr = i, i = 0; i < nr; i++) {
+		folio = folios[i];
+		if (cached && !folio_test_uptodate(folio)) {
+			kaddr = kmap_local_folio(folio, 0);
+			memcpy(kaddr, chunk + (i << PAGE_SHIFT), PAGE_SIZE);
+			kunmap_local(kaddr);
+			flush_dcache_folio(folio);
+			folio_mark_uptodate(folio);
+		}
+		if (cached)
+			folio_mark_dirty(folio);
+		if (folio->index < held_first || folio->index > held_last) {
+			folio_unlock(folio);
+			folio_put(folio);
+		}
+	}
+	if (folios != &one)
+		kfree(folios);
+	if (!cached)
+		return false;
+
+	/* replaces a present entry, so this cannot fail */
+	xa_store(&f->chunks, idx, VTFS_CHUNK_CACHED, GFP_KERNEL_ACCOUNT);
+	kvfree(chunk);
+	return true;
+}
+
+/* Decompresses @z into a new, uncharged buffer, or returns an ERR_PTR. */
+static void *vtfs_chunk_decompress(struct vtfs_fileobj *f, struct vtfs_zchunk *z)
+{
+	size_t size = 1UL << vtfs_chunk_shift(f);
+	void *chunk;
+	int err;
+
+	chunk = kvmalloc(size, GFP_KERNEL_ACCOUNT);
+	if (!chunk)
+		return ERR_PTR(-ENOMEM);
+	err = vtfs_decompress_chunk(f->fs, z, chunk, size);
+	if (err) {
+		kvfree(chunk);
+		return ERR_PTR(err);
+	}
+	return chunk;
+}
+
+/*
+ * Caller holds f->lock.  Decompresses chunk @idx, present as @entry and
+ * compressed by @f, back into a plain chunk in its place, which takes
+ * over its charge, and returns the new entry or an ERR_PTR.  Other
+ * entries are returned as they are.
+ */
+static void *vtfs_chunk_inflate(struct vtfs_fileobj *f, pgoff_t idx, void *entry)
+{
+	struct vtfs_zchunk *z = vtfs_chunk_z(entry);
+	void *chunk;
+
+	if (!z)
+		return entry;
+
+	chunk = vtfs_chunk_decompress(f, z);
+	if (IS_ERR(chunk))
+		return chunk;
+	/* replaces a present entry, so this cannot fail */
+	xa_store(&f->chunks, idx, chunk, GFP_KERNEL_ACCOUNT);
+	vtfs_zchunk_free(f->fs, z);
+	vtfs_compress_track(f);
+	return chunk;
+}
+
+/*
+ * Caller holds f->lock.  Turns chunk @idx of @f into a shared one if it
+ * is not yet and returns a new reference to it, for another fileobj's
+ * xarray.
+ */
+static void *vtfs_chunk_share(struct vtfs_fileobj *f, pgoff_t idx, void *entry)
+{
+	struct vtfs_chunk_ref *ref = vtfs_chunk_ref(entry);
+
+	if (!ref) {
+		ref = kmalloc(sizeof(*ref), GFP_KERNEL_ACCOUNT);
+		if (!ref)
+			return ERR_PTR(-ENOMEM);
+		refcount_set(&ref->users, 1);
+		ref->data = vtfs_chunk_z(entry) ?: entry;
+		ref->hashed = false;
+		ref->compressed = vtfs_chunk_z(entry);
+		entry = xa_tag_pointer(ref, VTFS_CHUNK_SHARED);
+		/* replaces a present entry, so this cannot fail */
+		xa_store(&f->chunks, idx, entry, GFP_KERNEL_ACCOUNT);
+	}
+	refcount_inc(&ref->users);
+	return entry;
+}
+
+/*
+ * Caller holds f->lock.  Makes chunk @idx, present as @entry, private to
+ * @f before it is written to and returns its bytes or an ERR_PTR.  The
+ * last user of a shared chunk just takes it over, charge and all; the
+ * others pay for a copy of their own.
+ */
+static void *vtfs_chunk_unshare(struct vtfs_fileobj *f, pgoff_t idx, void *entry)
+{
+	struct vtfs_chunk_ref *ref;
+	void *chunk;
+	int err;
+
+	if (entry == VTFS_CHUNK_CACHED)
+		return vtfs_chunk_uncache(f, idx, GFP_KERNEL_ACCOUNT);
+	entry = vtfs_chunk_inflate(f, idx, entry);
+	if (IS_ERR(entry))
+		return entry;
+	ref = vtfs_chunk_ref(entry);
+	if (!ref)
+		return entry;
+
+	if (vtfs_dedup_take(f->fs, ref)) {
+		if (ref->compressed) {
+			chunk = vtfs_chunk_decompress(f, ref->data);
+			if (IS_ERR(chunk))
+				return chunk;
+			vtfs_zchunk_free(f->fs, ref->data);
+			vtfs_compress_track(f);
+		} else {
+			chunk = ref->data;
+		}
+		kfree(ref);
+	} else {
+		chunk = vtfs_chunk_alloc(f);
+		if (IS_ERR(chunk))
+			return chunk;
+		err = 0;
+		if (ref->compressed)
+			err = vtfs_compress_read(f->fs, ref->data, 0, chunk,
+						 1UL << vtfs_chunk_shift(f));
+		else
+			memcpy(chunk, ref->data, 1UL << vtfs_chunk_shift(f));
+		if (err) {
+			vtfs_chunk_free(f, chunk);
+			return ERR_PTR(err);
+		}
+		vtfs_chunk_free(f, entry);
+	}
+	xa_store(&f->chunks, idx, chunk, GFP_KERNEL_ACCOUNT);
+	return chunk;
+}
+
+/* Caller holds f->lock. Drops every chunk at index >= @first. */
+static void vtfs_fileobj_drop_chunks(struct vtfs_fileobj *f, pgoff_t first)
+{
+	unsigned long idx;
+	void *chunk;
+
+	xa_for_each_start(&f->chunks, idx, chunk, first) {
+		xa_erase(&f->chunks, idx);
+		vtfs_chunk_free(f, chunk);
+	}
+}
+
+void vtfs_fileobj_put(struct vtfs_fileobj *f)
+{
+	if (!f || !atomic_dec_and_test(&f->refcnt))
+		return;
+
+	vtfs_compress_untrack(f);
+	if (!f->inline_data) {
+		vtfs_fileobj_drop_chunks(f, 0);
+		xa_destroy(&f->chunks);
+	}
+	vtfs_store_fileobj_free(f);
+}
+
+/* Caller holds f->lock. Moves inline bytes into chunk 0. */
+static int vtfs_fileobj_uninline(struct vtfs_fileobj *f)
+{
+	void *chunk = NULL;
+
+	if (!f->inline_data)
+		return 0;
+
+	if (f->size) {
+		chunk = vtfs_chunk_alloc(f);
+		if (IS_ERR(chunk))
+			return PTR_ERR(chunk);
+		memcpy(chunk, f->idata, f->size);
+	}
+
+	xa_init(&f->chunks);
+	f->inline_data = false;
+
+	/* a lone entry at index 0 lives in xa_head, so this cannot fail */
+	if (chunk)
+		xa_store(&f->chunks, 0, chunk, GFP_KERNEL_ACCOUNT);
+
+	return 0;
+}
+
+/* Caller holds f->lock. Empties the file and goes back to inline. */
+static void vtfs_fileobj_reinline(struct vtfs_fileobj *f)
+{
+	if (!f->inline_data) {
+		vtfs_fileobj_drop_chunks(f, 0);
+		xa_destroy(&f->chunks);
+		f->inline_data = true;
+	}
+	memset(f->idata, 0, sizeof(f->idata));
+}
+
+/* Marks @f as a @size-byte file whose contents are still on the server. */
+void vtfs_fileobj_set_remote(struct vtfs_fileobj *f, loff_t size)
+{
+	mutex_lock(&f->lock);
+	vtfs_fileobj_reinline(f);
+	if (size > VTFS_INLINE_DATA_LEN)
+		vtfs_fileobj_uninline(f);	/* empty, so nothing to allocate */
+	f->size = size;
+	f->remote_pending = true;
+	mutex_unlock(&f->lock);
+}
+
+/* Marks @f as a @size-byte file whose contents are still in the image. */
+void vtfs_fileobj_set_image(struct vtfs_fileobj *f, loff_t off, loff_t size)
+{
+	mutex_lock(&f->lock);
+	vtfs_fileobj_reinline(f);
+	if (size > VTFS_INLINE_DATA_LEN)
+		vtfs_fileobj_uninline(f);	/* empty, so nothing to allocate */
+	f->size = size;
+	f->image_off = off;
+	mutex_unlock(&f->lock);
+}
+
+/*
+ * Reads the contents of an image-backed file from @image, chunk by chunk
+ * straight into the buffers that keep them.  All-zero chunks stay holes,
+ * and so does anything past the end of @image.  On failure the file is
+ * left as it was, still waiting for its contents.
+ */
+int vtfs_fileobj_load(struct vtfs_fileobj *f, struct file *image)
+{
+	unsigned int shift = vtfs_chunk_shift(f);
+	loff_t start, pos;
+	pgoff_t idx;
+	void *chunk, *old;
+	ssize_t ret = 0;
+
+	mutex_lock(&f->lock);
+	if (!f->image_off)
+		goto out;
+
+	if (f->inline_data) {
+		pos = f->image_off;
+		ret = kernel_read(image, f->idata, f->size, &pos);
+		if (ret < 0)
+			memset(f->idata, 0, sizeof(f->idata));
+		goto done;
+	}
+
+	for (idx = 0; (start = (loff_t)idx << shift) < f->size; idx++) {
+		chunk = vtfs_chunk_alloc(f);
+		if (IS_ERR(chunk)) {
+			ret = PTR_ERR(chunk);
+			break;
+		}
+
+		pos = f->image_off + start;
+		ret = kernel_read(image, chunk,
+		                  min_t(loff_t, f->size - start, 1UL << shift), &pos);
+		if (ret <= 0 || !memchr_inv(chunk, 0, ret)) {
+			vtfs_chunk_free(f, chunk);
+			if (ret < 0)
+				break;
+			continue;
+		}
+
+		old = xa_store(&f->chunks, idx, chunk, GFP_KERNEL_ACCOUNT);
+		if (xa_is_err(old)) {
+			vtfs_chunk_free(f, chunk);
+			ret = xa_err(old);
+			break;
+		}
+	}
+	if (ret < 0)
+		vtfs_fileobj_drop_chunks(f, 0);
+
+done:
+	if (ret >= 0)
+		f->image_off = 0;
+out:
+	mutex_unlock(&f->lock);
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Writes the contents of @f to @out at @off, skipping holes so that the
+ * image stays sparse.  The file must not be waiting for them itself.
+ */
+int vtfs_fileobj_save(struct vtfs_fileobj *f, struct file *out, loff_t off)
+{
+	unsigned int shift = vtfs_chunk_shift(f);
+	unsigned long idx;
+	loff_t start, pos;
+	size_t n;
+	void *chunk, *data, *bounce = NULL;
+	struct vtfs_chunk_ref *ref;
+	struct vtfs_zchunk *z;
+	ssize_t ret;
+	int err = 0;
+
+	mutex_lock(&f->lock);
+	if (f->inline_data) {
+		pos = off;
+		ret = kernel_write(out, f->idata, f->size, &pos);
+		if (ret != f->size)
+			err = ret < 0 ? ret : -EIO;
+		goto out;
+	}
+
+	xa_for_each(&f->chunks, idx, chunk) {
+		start = (loff_t)idx << shift;
+		if (start >= f->size)
+			break;
+		n = min_t(loff_t, f->size - start, 1UL << shift);
+
+		/* a compressed chunk is written out without inflating it */
+		z = vtfs_chunk_z(chunk);
+		ref = vtfs_chunk_ref(chunk);
+		if (ref && ref->compressed)
+			z = ref->data;
+		if (z) {
+			if (!bounce)
+				bounce = kvmalloc(1UL << shift, GFP_KERNEL);
+			err = bounce ? vtfs_decompress_chunk(f->fs, z, bounce,
+			                                     1UL << shift) : -ENOMEM;
+			if (err)
+				break;
+			data = bounce;
+		} else if (chunk == VTFS_CHUNK_CACHED) {
+			if (!bounce)
+				bounce = kvmalloc(1UL << shift, GFP_KERNEL);
+			if (!bounce) {
+				err = -ENOMEM;
+				break;
+			}
+			vtfs_cache_read(f, start, bounce, n);
+			data = bounce;
+		} else {
+			data = vtfs_chunk_data(chunk);
+		}
+
+		pos = off + start;
+		ret = kernel_write(out, data, n, &pos);
+		if (ret != n) {
+			err = ret < 0 ? ret : -EIO;
+			break;
+		}
+	}
+out:
+	mutex_unlock(&f->lock);
+	kvfree(bounce);
+	return err;
+}
+
+/* After a save: contents @f has not loaded yet now live at @off instead. */
+void vtfs_fileobj_move_image(struct vtfs_fileobj *f, loff_t off)
+{
+	mutex_lock(&f->lock);
+	if (f->image_off)
+		f->image_off = off;
+	mutex_unlock(&f->lock);
+}
+
+/*
+ * For a file gone cold: with compress=, swaps the chunks only @f uses
+ * for compressed copies, and with dedup, shares them, compressed or not,
+ * with any that have the same bytes.  A big file lets go of its lock now
+ * and then for readers waiting on it.
+ */
+void vtfs_fileobj_compact(struct vtfs_fileobj *f)
+{
+	size_t size = 1UL << vtfs_chunk_shift(f);
+	struct vtfs_chunk_ref *ref;
+	struct vtfs_zchunk *z;
+	unsigned long idx;
+	void *chunk, *entry;
+
+	mutex_lock(&f->lock);
+	if (f->inline_data)
+		goto out;
+
+	xa_for_each(&f->chunks, idx, chunk) {
+		if (xa_pointer_tag(chunk) || chunk == VTFS_CHUNK_CACHED)
+			continue;	/* shared, compressed already, or in use */
+
+		entry = NULL;
+		z = vtfs_compress_chunk(f->fs, chunk, size);
+		ref = f->fs->dedup ? vtfs_dedup_chunk(f->fs, chunk, z, size) : NULL;
+		if (ref) {
+			entry = xa_tag_pointer(ref, VTFS_CHUNK_SHARED);
+			if (ref->data != (z ?: chunk)) {
+				/* charged once, by whoever put it in the table */
+				if (z)
+					vtfs_zchunk_free(f->fs, z);
+				percpu_counter_dec(&f->fs->used_blocks);
+			}
+			if (ref->data != chunk)
+				kvfree(chunk);
+		} else if (z) {
+			entry = xa_tag_pointer(z, VTFS_CHUNK_COMPRESSED);
+			kvfree(chunk);
+		}
+		/* replaces a present entry, so this cannot fail */
+		if (entry)
+			xa_store(&f->chunks, idx, entry, GFP_KERNEL_ACCOUNT);
+
+		if (need_resched()) {
+			mutex_unlock(&f->lock);
+			cond_resched();
+			mutex_lock(&f->lock);
+			if (f->inline_data)
+				break;	/* emptied meanwhile */
+		}
+	}
+out:
+	mutex_unlock(&f->lock);
+}
+
+/* Caller holds f->lock.  Returns the xarray entry or an ERR_PTR. */
+static void *vtfs_fileobj_get_chunk(struct vtfs_fileobj *f, pgoff_t idx)
+{
+	void *chunk, *old;
+
+	chunk = xa_load(&f->chunks, idx);
+	if (chunk)
+		return chunk;
+
+	chunk = vtfs_chunk_alloc(f);
+	if (IS_ERR(chunk))
+		return chunk;
+
+	old = xa_store(&f->chunks, idx, chunk, GFP_KERNEL_ACCOUNT);
+	if (xa_is_err(old)) {
+		vtfs_chunk_free(f, chunk);
+		return ERR_PTR(xa_err(old));
+	}
+
+	return chunk;
+}
+
+/* Caller holds f->lock.  On failure the rest of @buf is zeroed. */
+static int vtfs_fileobj_do_read(struct vtfs_fileobj *f, loff_t pos, void *buf,
+                                size_t len)
+{
+	unsigned int shift = vtfs_chunk_shift(f);
+	struct vtfs_zchunk *z;
+	size_t off, n;
+	void *chunk;
+	int err = 0;
+
+	WRITE_ONCE(f->touched, jiffies);
+	if (f->inline_data) {
+		n = pos < f->size ? min_t(size_t, len, f->size - pos) : 0;
+		memcpy(buf, f->idata + pos, n);
+		memset(buf + n, 0, len - n);
+		len = 0;
+	}
+
+	while (len) {
+		off = pos & ((1UL << shift) - 1);
+		n = min_t(size_t, len, (1UL << shift) - off);
+
+		chunk = pos < f->size ? xa_load(&f->chunks, pos >> shift) : NULL;
+		/* compressed chunks stay compressed, shared ones too */
+		z = vtfs_chunk_zdata(chunk);
+		if (z)
+			err = vtfs_compress_read(f->fs, z, off, buf, n);
+		else if (chunk == VTFS_CHUNK_CACHED)
+			vtfs_cache_read(f, pos, buf, n);
+		else if (chunk)
+			memcpy(buf, vtfs_chunk_data(chunk) + off, n);
+		else
+			memset(buf, 0, n);
+		if (err) {
+			memset(buf, 0, len);
+			return err;
+		}
+
+		buf += n;
+		pos += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+int vtfs_fileobj_read(struct vtfs_fileobj *f, loff_t pos, void *buf, size_t len)
+{
+	int err;
+
+	mutex_lock(&f->lock);
+	err = vtfs_fileobj_do_read(f, pos, buf, len);
+	mutex_unlock(&f->lock);
+
+	return err;
+}
+
+/* Caller holds f->lock. */
+static int vtfs_fileobj_do_write(struct vtfs_fileobj *f, loff_t pos,
+                                 const void *buf, size_t len)
+{
+	unsigned int shift = vtfs_chunk_shift(f);
+	size_t off, n;
+	void *chunk;
+	int err = 0;
+
+	WRITE_ONCE(f->touched, jiffies);
+	if (f->inline_data && pos + len <= VTFS_INLINE_DATA_LEN) {
+		memcpy(f->idata + pos, buf, len);
+		f->size = max_t(loff_t, f->size, pos + len);
+		len = 0;
+	} else {
+		err = vtfs_fileobj_uninline(f);
+		if (err)
+			len = 0;
+	}
+
+	while (len) {
+		off = pos & ((1UL << shift) - 1);
+		n = min_t(size_t, len, (1UL << shift) - off);
+
+		chunk = vtfs_fileobj_get_chunk(f, pos >> shift);
+		if (!IS_ERR(chunk))
+			chunk = vtfs_chunk_unshare(f, pos >> shift, chunk);
+		if (IS_ERR(chunk)) {
+			err = PTR_ERR(chunk);
+			break;
+		}
+		memcpy(chunk + off, buf, n);
+
+		buf += n;
+		pos += n;
+		len -= n;
+
+		if (pos > f->size)
+			f->size = pos;
+	}
+
+	return err;
+}
+
+int vtfs_fileobj_write(struct vtfs_fileobj *f, loff_t pos, const void *buf, size_t len)
+{
+	int err;
+
+	mutex_lock(&f->lock);
+	err = vtfs_fileobj_do_write(f, pos, buf, len);
+	mutex_unlock(&f->lock);
+
+	return err;
+}
+
+/*
+ * Caller holds f->lock.  @mapping is the page cache of @f's inode, or
+ * NULL once it is gone, written back first: chunks still cached then had
+ * no dirty pages, so they were never written and become holes again.
+ */
+void vtfs_fileobj_set_mapping(struct vtfs_fileobj *f, struct address_space *mapping)
+{
+	unsigned long idx;
+	void *chunk;
+
+	if (!mapping && !f->inline_data) {
+		xa_for_each(&f->chunks, idx, chunk) {
+			if (chunk != VTFS_CHUNK_CACHED)
+				continue;
+			xa_erase(&f->chunks, idx);
+			vtfs_chunk_free(f, chunk);
+		}
+	}
+	f->mapping = mapping;
+}
+
+/*
+ * read_folio and readahead: fills the @nr locked @folios, consecutive
+ * pages of one chunk, and marks them uptodate.  A plain chunk private to
+ * @f goes over to the page cache on the way, so that its bytes are not
+ * kept twice.
+ */
+int vtfs_fileobj_read_folios(struct vtfs_fileobj *f, struct folio **folios,
+                             unsigned int nr)
+{
+	pgoff_t idx = folio_pos(folios[0]) >> vtfs_chunk_shift(f);
+	void *entry, *kaddr;
+	unsigned int i;
+	int err = 0;
+
+	mutex_lock(&f->lock);
+	WRITE_ONCE(f->touched, jiffies);
+	entry = f->inline_data || folio_pos(folios[0]) >= f->size ? NULL :
+	        xa_load(&f->chunks, idx);
+	if (entry && !xa_pointer_tag(entry) && entry != VTFS_CHUNK_CACHED &&
+	    vtfs_chunk_cache(f, idx, entry, folios, nr))
+		goto out;
+
+	for (i = 0; !err && i < nr; i++) {
+		kaddr = kmap_local_folio(folios[i], 0);
+		err = vtfs_fileobj_do_read(f, folio_pos(folios[i]), kaddr,
+		                           folio_size(folios[i]));
+		kunmap_local(kaddr);
+		flush_dcache_folio(folios[i]);
+		if (!err)
+			folio_mark_uptodate(folios[i]);
+	}
+out:
+	mutex_unlock(&f->lock);
+	return err;
+}
+
+/*
+ * write_begin and page_mkwrite: [pos, pos + len) of the locked @folio is
+ * about to be written, so its chunk goes over to the page cache, a hole
+ * being charged for first.  The folio is read in unless all of it is to
+ * be written.  Returns 1 if the chunk has to stay where it is, inline or
+ * because another of its pages is busy; vtfs_fileobj_write_folio() then
+ * copies the write into it as well.
+ */
+int vtfs_fileobj_cache_folio(struct vtfs_fileobj *f, struct folio *folio,
+                             loff_t pos, size_t len)
+{
+	pgoff_t idx = pos >> vtfs_chunk_shift(f);
+	void *entry, *old, *kaddr;
+	int ret = 0, err;
+
+	mutex_lock(&f->lock);
+	WRITE_ONCE(f->touched, jiffies);
+	if (f->inline_data && pos + len <= VTFS_INLINE_DATA_LEN) {
+		ret = 1;
+		goto fill;
+	}
+	ret = vtfs_fileobj_uninline(f);
+	if (ret)
+		goto out;
+
+	entry = xa_load(&f->chunks, idx);
+	if (!entry) {
+		ret = vtfs_charge(&f->fs->used_blocks, f->fs->max_blocks, 1);
+		if (ret)
+			goto out;
+		old = xa_store(&f->chunks, idx, VTFS_CHUNK_CACHED, GFP_KERNEL_ACCOUNT);
+		if (xa_is_err(old)) {
+			percpu_counter_dec(&f->fs->used_blocks);
+			ret = xa_err(old);
+			goto out;
+		}
+		vtfs_compress_track(f);
+	} else if (entry != VTFS_CHUNK_CACHED) {
+		entry = vtfs_chunk_unshare(f, idx, entry);
+		if (IS_ERR(entry)) {
+			ret = PTR_ERR(entry);
+			goto out;
+		}
+		ret = !vtfs_chunk_cache(f, idx, entry, &folio, 1);
+	}
+
+fill:
+	if (!folio_test_uptodate(folio) && len != folio_size(folio)) {
+		kaddr = kmap_local_folio(folio, 0);
+		err = vtfs_fileobj_do_read(f, folio_pos(folio), kaddr,
+		                           folio_size(folio));
+		kunmap_local(kaddr);
+		flush_dcache_folio(folio);
+		if (err)
+			ret = err;
+		else
+			folio_mark_uptodate(folio);
+	}
+out:
+	mutex_unlock(&f->lock);
+	return ret;
+}
+
+/*
+ * write_end: [pos, pos + len) of the locked @folio now holds @buf.  The
+ * folio is dirtied if its chunk is cached, and otherwise @buf is copied
+ * into the chunk.
+ */
+int vtfs_fileobj_write_folio(struct vtfs_fileobj *f, struct folio *folio,
+                             loff_t pos, const void *buf, size_t len)
+{
+	int err = 0;
+
+	mutex_lock(&f->lock);
+	if (!f->inline_data && xa_load(&f->chunks, pos >> vtfs_chunk_shift(f)) ==
+	                       VTFS_CHUNK_CACHED) {
+		WRITE_ONCE(f->touched, jiffies);
+		folio_mark_dirty(folio);
+		f->size = max_t(loff_t, f->size, pos + len);
+	} else {
+		err = vtfs_fileobj_do_write(f, pos, buf, len);
+	}
+	mutex_unlock(&f->lock);
+
+	return err;
+}
+
+/*
+ * Writeback of the locked @folio, just marked clean: puts its bytes back
+ * into @f's chunks.  A cached chunk gets its buffer back, from @gfp and
+ * filled from all of its pages; after that, the chunk's other dirty
+ * pages only copy themselves in.
+ */
+int vtfs_fileobj_writeback_folio(struct vtfs_fileobj *f, struct folio *folio,
+                                 gfp_t gfp)
+{
+	loff_t pos = folio_pos(folio);
+	void *entry, *kaddr;
+	int err = 0;
+
+	mutex_lock(&f->lock);
+	if (pos >= f->size)
+		goto out;	/* truncated meanwhile */
+
+	entry = f->inline_data ? NULL :
+	        xa_load(&f->chunks, pos >> vtfs_chunk_shift(f));
+	if (entry == VTFS_CHUNK_CACHED) {
+		entry = vtfs_chunk_uncache(f, pos >> vtfs_chunk_shift(f), gfp);
+		err = PTR_ERR_OR_ZERO(entry);
+	} else {
+		kaddr = kmap_local_folio(folio, 0);
+		err = vtfs_fileobj_do_write(f, pos, kaddr,
+		                            min_t(loff_t, folio_size(folio),
+		                                  f->size - pos));
+		kunmap_local(kaddr);
+	}
+out:
+	mutex_unlock(&f->lock);
+	return err;
+}
+
+/* Caller holds f->lock. */
+static int vtfs_fileobj_do_punch(struct vtfs_fileobj *f, loff_t pos, loff_t len)
+{
+	unsigned int shift = vtfs_chunk_shift(f);
+	loff_t end = pos + len;
+	size_t off, n;
+	void *chunk;
+	int err = 0;
+
+	if (f->inline_data) {
+		if (pos < VTFS_INLINE_DATA_LEN)
+			memset(f->idata + pos, 0,
+			       min_t(loff_t, end, VTFS_INLINE_DATA_LEN) - pos);
+		pos = end;
+	}
+
+	while (pos < end) {
+		off = pos & ((1UL << shift) - 1);
+		n = min_t(loff_t, end - pos, (1UL << shift) - off);
+
+		if (n == 1UL << shift) {
+			chunk = xa_erase(&f->chunks, pos >> shift);
+			vtfs_chunk_free(f, chunk);
+		} else {
+			chunk = xa_load(&f->chunks, pos >> shift);
+			/* cached pages are zeroed along with the page cache */
+			if (chunk == VTFS_CHUNK_CACHED)
+				chunk = NULL;
+			if (chunk)
+				chunk = vtfs_chunk_unshare(f, pos >> shift, chunk);
+			if (IS_ERR(chunk)) {
+				err = PTR_ERR(chunk);
+				break;
+			}
+			if (chunk)
+				memset(chunk + off, 0, n);
+		}
+
+		pos += n;
+	}
+
+	return err;
+}
+
+/*
+ * Copies [spos, spos + len) of @src to @dpos in @dst.  Whole chunks at
+ * the same alignment on both sides are shared rather than copied, the
+ * rest is copied straight from chunk to chunk, and holes stay holes.
+ * The ranges may not overlap.
+ */
+int vtfs_fileobj_clone(struct vtfs_fileobj *dst, loff_t dpos,
+                       struct vtfs_fileobj *src, loff_t spos, loff_t len)
+{
+	unsigned int shift = vtfs_chunk_shift(src);
+	size_t mask = (1UL << shift) - 1;
+	void *entry, *old, *data, *bounce = NULL;
+	struct vtfs_zchunk *z;
+	size_t n;
+	int err = 0;
+
+	/* two fileobjs are locked in address order */
+	mutex_lock(src < dst ? &src->lock : &dst->lock);
+	if (src != dst)
+		mutex_lock_nested(src < dst ? &dst->lock : &src->lock,
+		                  SINGLE_DEPTH_NESTING);
+
+	/* writing to a file may move the very bytes being copied */
+	if (src == dst) {
+		bounce = kvmalloc(mask + 1, GFP_KERNEL);
+		if (!bounce)
+			err = -ENOMEM;
+	}
+	if (!err && dpos + len > VTFS_INLINE_DATA_LEN)
+		err = vtfs_fileobj_uninline(dst);
+
+	while (!err && len) {
+		n = min_t(loff_t, len, mask + 1 - (spos & mask));
+		z = NULL;
+		if (src->inline_data) {
+			entry = NULL;
+			data = src->idata + spos;
+		} else {
+			entry = xa_load(&src->chunks, spos >> shift);
+			/* callers write back the source range first */
+			if (entry == VTFS_CHUNK_CACHED)
+				entry = vtfs_chunk_uncache(src, spos >> shift,
+				                           GFP_KERNEL_ACCOUNT);
+			if (IS_ERR(entry)) {
+				err = PTR_ERR(entry);
+				break;
+			}
+			/* compressed chunks are shared as they are */
+			z = vtfs_chunk_zdata(entry);
+			data = entry && !z ? vtfs_chunk_data(entry) + (spos & mask) :
+			       NULL;
+		}
+
+		if (entry && n == mask + 1 && !(dpos & mask)) {
+			entry = vtfs_chunk_share(src, spos >> shift, entry);
+			if (IS_ERR(entry)) {
+				err = PTR_ERR(entry);
+				break;
+			}
+			old = xa_store(&dst->chunks, dpos >> shift, entry,
+			               GFP_KERNEL_ACCOUNT);
+			if (xa_is_err(old)) {
+				vtfs_chunk_free(dst, entry);
+				err = xa_err(old);
+				break;
+			}
+			vtfs_chunk_free(dst, old);
+		} else if (z) {
+			if (!bounce)
+				bounce = kvmalloc(mask + 1, GFP_KERNEL);
+			err = bounce ? vtfs_compress_read(src->fs, z, spos & mask,
+			                                  bounce, n) : -ENOMEM;
+			if (!err)
+				err = vtfs_fileobj_do_write(dst, dpos, bounce, n);
+		} else if (data) {
+			if (src == dst)
+				data = memcpy(bounce, data, n);
+			err = vtfs_fileobj_do_write(dst, dpos, data, n);
+		} else {
+			err = vtfs_fileobj_do_punch(dst, dpos, n);
+		}
+		if (err)
+			break;
+
+		spos += n;
+		dpos += n;
+		len -= n;
+		if (dpos > dst->size)
+			dst->size = dpos;
+	}
+
+	kvfree(bounce);
+	mutex_unlock(&src->lock);
+	if (src != dst)
+		mutex_unlock(&dst->lock);
+
+	return err;
+}
+
+int vtfs_fileobj_truncate(struct vtfs_fileobj *f, loff_t size)
+{
+	unsigned int shift = vtfs_chunk_shift(f);
+	size_t off = size & ((1UL << shift) - 1);
+	void *chunk;
+	int err = 0;
+
+	mutex_lock(&f->lock);
+	if (!size) {
+		vtfs_fileobj_reinline(f);
+		f->image_off = 0;
+	} else if (f->inline_data) {
+		if (size < f->size)
+			memset(f->idata + size, 0, f->size - size);
+		else if (size > VTFS_INLINE_DATA_LEN)
+			err = vtfs_fileobj_uninline(f);
+	} else if (size < f->size) {
+		/* the tail of a partial last chunk must read as zeros if regrown */
+		chunk = off ? xa_load(&f->chunks, size >> shift) : NULL;
+		/* cached pages are cut along with the page cache */
+		if (chunk == VTFS_CHUNK_CACHED)
+			chunk = NULL;
+		if (chunk)
+			chunk = vtfs_chunk_unshare(f, size >> shift, chunk);
+		if (IS_ERR(chunk)) {
+			err = PTR_ERR(chunk);
+		} else {
+			if (chunk)
+				memset(chunk + off, 0, (1UL << shift) - off);
+			vtfs_fileobj_drop_chunks(f, DIV_ROUND_UP(size, 1UL << shift));
+		}
+	}
+	if (!err)
+		f->size = size;
+	mutex_unlock(&f->lock);
+
+	return err;
+}
+
+/* Allocates zeroed chunks over [pos, pos + len), i.e. fallocate mode 0. */
+int vtfs_fileobj_allocate(struct vtfs_fileobj *f, loff_t pos, loff_t len, bool keep_size)
+{
+	pgoff_t idx = pos >> vtfs_chunk_shift(f);
+	pgoff_t last = (pos + len - 1) >> vtfs_chunk_shift(f);
+	int err = 0;
+
+	mutex_lock(&f->lock);
+	if (f->inline_data && pos + len <= VTFS_INLINE_DATA_LEN)
+		idx = last + 1;
+	else
+		err = vtfs_fileobj_uninline(f);
+
+	for (; !err && idx <= last; idx++)
+		err = PTR_ERR_OR_ZERO(vtfs_fileobj_get_chunk(f, idx));
+	if (!err && !keep_size && pos + len > f->size)
+		f->size = pos + len;
+	mutex_unlock(&f->lock);
+
+	return err;
+}
+
+/* Frees whole chunks inside [pos, pos + len) and zeroes partial ones. */
+int vtfs_fileobj_punch(struct vtfs_fileobj *f, loff_t pos, loff_t len)
+{
+	int err;
+
+	mutex_lock(&f->lock);
+	err = vtfs_fileobj_do_punch(f, pos, len);
+	mutex_unlock(&f->lock);
+
+	return err;
+}
+
+/* SEEK_DATA / SEEK_HOLE over the chunk map; every present chunk is data. */
+loff_t vtfs_fileobj_seek(struct vtfs_fileobj *f, loff_t pos, int whence)
+{
+	unsigned int shift = vtfs_chunk_shift(f);
+	unsigned long idx = pos >> shift;
+	loff_t ret;
+
+	mutex_lock(&f->lock);
+	if (pos >= f->size) {
+		ret = -ENXIO;
+	} else if (f->inline_data) {
+		ret = whence == SEEK_DATA ? pos : f->size;
+	} else if (whence == SEEK_DATA) {
+		if (xa_find(&f->chunks, &idx, ULONG_MAX, XA_PRESENT))
+			ret = max_t(loff_t, pos, (loff_t)idx << shift);
+		else
+			ret = f->size;
+		ret = ret < f->size ? ret : -ENXIO;
+	} else {
+		XA_STATE(xas, &f->chunks, idx);
+
+		/* f->lock keeps the map still: walk the run of chunks at @idx */
+		rcu_read_lock();
+		while (xas_next(&xas))
+			;
+		rcu_read_unlock();
+		idx = xas.xa_index;
+		ret = max_t(loff_t, pos, (loff_t)idx << shift);
+		ret = min_t(loff_t, ret, f->size);
+	}
+	mutex_unlock(&f->lock);
+
+	return ret;
+}
@@ -0,0 +1,216 @@
+#include "vtfs.h"
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/xxhash.h>
+
+/*
+ * dedup: cold files (see vtfs_compress.c) have their chunks looked up by
+ * the xxh64 of their bytes in a per-mount table of shared chunks.  A
+ * chunk with the same bytes as one already there is dropped for another
+ * reference to that one; any other goes in the table itself.  Hashes
+ * only pick the candidate: the bytes are compared before sharing.
+ *
+ * Table chunks are ordinary shared chunks (vtfs_data.c), copied when
+ * written to, except that references are only gained and the last one
+ * only dropped under d->lock, so that lookups never find a chunk that is
+ * about to change or go away.  With compress= they are kept compressed
+ * when that saves enough, and compared in that form: the compressor
+ * turns the same bytes into the same output.
+ *
+ * With debugfs, "dedup" next to "stats" shows what it saved.
+ */
+
+struct vtfs_dedup {
+	struct vtfs_fs *fs;
+	struct mutex lock;		/* protects table and chunk users */
+	struct rhashtable table;	/* vtfs_chunk_refs by hash */
+	struct dentry *debugfs;
+
+	atomic_long_t blocks;		/* chunks in the table */
+	atomic_long_t merged;		/* chunks dropped for one there, ever */
+};
+
+static const struct rhashtable_params vtfs_dedup_params = {
+	.key_len             = sizeof(u64),
+	.key_offset          = offsetof(struct vtfs_chunk_ref, hash),
+	.head_offset         = offsetof(struct vtfs_chunk_ref, node),
+	.automatic_shrinking = true,
+};
+
+static bool vtfs_dedup_same(const struct vtfs_chunk_ref *ref, const void *chunk,
+                            const struct vtfs_zchunk *z, size_t len)
+{
+	const struct vtfs_zchunk *rz = ref->data;
+
+	if (!ref->compressed)
+		return !memcmp(ref->data, chunk, len);
+	return z && z->len == rz->len && !memcmp(z->data, rz->data, z->len);
+}
+
+/*
+ * Caller holds the lock of the fileobj that has @chunk, a private chunk
+ * of @len bytes, and @z, its compressed copy if it has one.  Returns a
+ * shared chunk with its bytes for that fileobj to hold instead: one
+ * already in the table, with a new user, or a new one around @z or else
+ * @chunk itself.  NULL leaves both as they are.
+ */
+struct vtfs_chunk_ref *vtfs_dedup_chunk(struct vtfs_fs *fs, void *chunk,
+                                        struct vtfs_zchunk *z, size_t len)
+{
+	struct vtfs_dedup *d = fs->dedup;
+	u64 hash = xxh64(chunk, len, 0);
+	struct vtfs_chunk_ref *ref;
+
+	mutex_lock(&d->lock);
+	ref = rhashtable_lookup_fast(&d->table, &hash, vtfs_dedup_params);
+	if (ref) {
+		if (!vtfs_dedup_same(ref, chunk, z, len)) {
+			ref = NULL;	/* same hash, other bytes */
+		} else {
+			refcount_inc(&ref->users);
+			atomic_long_inc(&d->merged);
+		}
+		goto out;
+	}
+
+	ref = kmalloc(sizeof(*ref), GFP_KERNEL_ACCOUNT);
+	if (!ref)
+		goto out;
+	refcount_set(&ref->users, 1);
+	ref->data = z ?: chunk;
+	ref->hash = hash;
+	ref->hashed = true;
+	ref->compressed = z;
+	if (rhashtable_insert_fast(&d->table, &ref->node, vtfs_dedup_params)) {
+		kfree(ref);
+		ref = NULL;
+		goto out;
+	}
+	atomic_long_inc(&d->blocks);
+out:
+	mutex_unlock(&d->lock);
+	return ref;
+}
+
+/* Caller holds d->lock. */
+static void vtfs_dedup_unhash(struct vtfs_dedup *d, struct vtfs_chunk_ref *ref)
+{
+	rhashtable_remove_fast(&d->table, &ref->node, vtfs_dedup_params);
+	ref->hashed = false;
+	atomic_long_dec(&d->blocks);
+}
+
+/* Drops a user of @ref; returns true if it was the last one. */
+bool vtfs_dedup_put(struct vtfs_fs *fs, struct vtfs_chunk_ref *ref)
+{
+	struct vtfs_dedup *d = fs->dedup;
+	bool last;
+
+	if (!ref->hashed || !d)
+		return refcount_dec_and_test(&ref->users);
+
+	mutex_lock(&d->lock);
+	last = refcount_dec_and_test(&ref->users);
+	if (last)
+		vtfs_dedup_unhash(d, ref);
+	mutex_unlock(&d->lock);
+	return last;
+}
+
+/*
+ * Caller holds the lock of a fileobj using @ref.  Returns true if that
+ * is its only user, which may then change its bytes.
+ */
+bool vtfs_dedup_take(struct vtfs_fs *fs, struct vtfs_chunk_ref *ref)
+{
+	struct vtfs_dedup *d = fs->dedup;
+	bool sole;
+
+	if (!ref->hashed || !d)
+		return refcount_read(&ref->users) == 1;
+
+	mutex_lock(&d->lock);
+	sole = refcount_read(&ref->users) == 1;
+	if (sole)
+		vtfs_dedup_unhash(d, ref);
+	mutex_unlock(&d->lock);
+	return sole;
+}
+
+static int vtfs_dedup_show(struct seq_file *m, void *v)
+{
+	struct vtfs_dedup *d = m->private;
+	unsigned int shift = d->fs->chunk_shift;
+	struct rhashtable_iter iter;
+	struct vtfs_chunk_ref *ref;
+	unsigned long long refs = 0;
+	long blocks;
+
+	/* users also count clones of table chunks, which share them too */
+	mutex_lock(&d->lock);
+	blocks = atomic_long_read(&d->blocks);
+	rhashtable_walk_enter(&d->table, &iter);
+	rhashtable_walk_start(&iter);
+	while ((ref = rhashtable_walk_next(&iter))) {
+		if (!IS_ERR(ref))
+			refs += refcount_read(&ref->users);
+	}
+	rhashtable_walk_stop(&iter);
+	rhashtable_walk_exit(&iter);
+	mutex_unlock(&d->lock);
+
+	seq_printf(m, "blocks %ld\n", blocks);
+	seq_printf(m, "references %llu\n", refs);
+	seq_printf(m, "ratio %llu.%02llu\n", blocks ? refs / blocks : 0,
+	           blocks ? refs * 100 / blocks % 100 : 0);
+	seq_printf(m, "saved_bytes %llu\n", (refs - blocks) << shift);
+	seq_printf(m, "table_bytes %llu\n",
+	           (unsigned long long)blocks * sizeof(struct vtfs_chunk_ref));
+	seq_printf(m, "merged %ld\n", atomic_long_read(&d->merged));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vtfs_dedup);
+
+int vtfs_dedup_init(struct super_block *sb)
+{
+	struct vtfs_fs *fs = vtfs_fs(sb);
+	struct vtfs_dedup *d;
+	int err;
+
+	d = kzalloc(sizeof(*d), GFP_KERNEL);
+	if (!d)
+		return -ENOMEM;
+	d->fs = fs;
+	mutex_init(&d->lock);
+	err = rhashtable_init(&d->table, &vtfs_dedup_params);
+	if (err) {
+		kfree(d);
+		return err;
+	}
+
+	if (fs->debugfs)
+		d->debugfs = debugfs_create_file("dedup", 0444, fs->debugfs, d,
+		                                 &vtfs_dedup_fops);
+	fs->dedup = d;
+	return 0;
+}
+
+/*
+ * Goes once nothing can dedup any more.  The chunks stay shared between
+ * their users, who free them as ordinary shared chunks.
+ */
+void vtfs_dedup_destroy(struct super_block *sb)
+{
+	struct vtfs_fs *fs = vtfs_fs(sb);
+	struct vtfs_dedup *d;
+
+	if (!fs || !fs->dedup)
+		return;
+	d = fs->dedup;
+
+	debugfs_remove(d->debugfs);
+	fs->dedup = NULL;
+	rhashtable_destroy(&d->table);
+	kfree(d);
+}
@@ -1,6 +1,18 @@
 #include "vtfs.h"
 #include <linux/string.h>
 #include <linux/errno.h>
+#include <linux/slab.h>
+#include "vtfs_trace.h"
+
+void vtfs_dentry_stamp(struct dentry *dentry)
+{
+	WRITE_ONCE(dentry->d_time, jiffies);
+}
+
+static bool vtfs_dentry_fresh(struct dentry *dentry, unsigned long ttl)
+{
+	return time_before(jiffies, READ_ONCE(dentry->d_time) + ttl);
+}
 
 struct dentry *vtfs_lookup(struct inode *dir_inode,
                                   struct dentry *dentry,
@@ -9,7 +21,7 @@ struct dentry *vtfs_lookup(struct inode *dir_inode,
 	struct super_block *sb = dir_inode->i_sb;
 	struct vtfs_node *dir = dir_inode->i_private;
 	struct vtfs_node *child;
-	struct inode *inode;
+	struct inode *inode = NULL;
 
 	(void)flags;
 
@@ -17,55 +29,179 @@ struct dentry *vtfs_lookup(struct inode *dir_inode,
 		return NULL;
 
 	child = vtfs_store_lookup(sb, dir, dentry->d_name.name);
-	if (!child)
-		return NULL;
+	if (IS_ERR(child))
+		return ERR_CAST(child);
 
-	inode = vtfs_inode_from_node(sb, child);
-	if (!inode)
-		return ERR_PTR(-ENOMEM);
+	if (child) {
+		inode = vtfs_inode_from_node(sb, child);
+		if (!inode)
+			return ERR_PTR(-ENOMEM);
+	}
+
+	/* misses are cached as negative dentries too */
+	vtfs_dentry_stamp(dentry);
+	return d_splice_alias(inode, dentry);
+}
+
+/*
+ * Remote mode: re-checks a positive @dentry against the server, updating
+ * the inode from what it reports.  Returns 1 if @dentry is still good, 0
+ * if it has to be looked up again, or an error.
+ */
+static int vtfs_dentry_refresh(struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+	struct dentry *parent = dget_parent(dentry);
+	struct vtfs_remote_attr attr;
+	int ret;
+
+	ret = vtfs_store_revalidate(dentry->d_sb, d_inode(parent)->i_private,
+	                            dentry->d_name.name, inode->i_ino, &attr);
+	dput(parent);
+
+	if (ret == 0) {
+		if (S_ISDIR(inode->i_mode))
+			clear_nlink(inode);
+		else
+			drop_nlink(inode);
+	} else if (ret > 0) {
+		if (S_ISREG(inode->i_mode))
+			vtfs_file_refresh(inode, attr.size);
+		vtfs_dentry_stamp(dentry);
+	}
+
+	return ret;
+}
+
+/*
+ * Remote mode trusts a dentry, and its inode's attributes, for actimeo
+ * seconds after the server last vouched for it, and a negative dentry
+ * for negtimeo seconds.  Only then does it cost a round trip.
+ */
+static int vtfs_d_revalidate(struct dentry *dentry, unsigned int flags)
+{
+	struct vtfs_fs *fs = vtfs_fs(dentry->d_sb);
+
+	if (d_really_is_negative(dentry))
+		return vtfs_dentry_fresh(dentry, fs->neg_ttl);
 
-	d_add(dentry, inode);
-	return NULL;
+	if (IS_ROOT(dentry) || vtfs_dentry_fresh(dentry, fs->attr_ttl))
+		return 1;
+
+	if (flags & LOOKUP_RCU)
+		return -ECHILD;
+
+	return vtfs_dentry_refresh(dentry);
+}
+
+const struct dentry_operations vtfs_dentry_ops = {
+	.d_revalidate = vtfs_d_revalidate,
+};
+
+int vtfs_getattr(struct mnt_idmap *idmap,
+                 const struct path *path,
+                 struct kstat *stat,
+                 u32 request_mask,
+                 unsigned int query_flags)
+{
+	struct dentry *dentry = path->dentry;
+	struct inode *inode = d_inode(dentry);
+	struct vtfs_fs *fs = vtfs_fs(inode->i_sb);
+	int err;
+
+	if (fs->remote && !IS_ROOT(dentry) &&
+	    !(query_flags & AT_STATX_DONT_SYNC) &&
+	    !vtfs_dentry_fresh(dentry, fs->attr_ttl)) {
+		err = vtfs_dentry_refresh(dentry);
+		if (err < 0)
+			return err;
+	}
+
+	return simple_getattr(idmap, path, stat, request_mask, query_flags);
 }
 
+/*
+ * Called for every child a directory listing returned: dentries already
+ * in the dcache take the listed attributes and count as freshly checked,
+ * so that the stats following a readdir stay local.
+ */
+static void vtfs_prime_dcache(void *ctx, struct vtfs_node *child,
+                              const struct vtfs_remote_attr *attr)
+{
+	struct dentry *parent = ctx;
+	struct qstr name = QSTR_INIT(child->name, strlen(child->name));
+	struct dentry *dentry;
+	struct inode *inode;
 
+	dentry = d_hash_and_lookup(parent, &name);
+	if (IS_ERR_OR_NULL(dentry))
+		return;
+
+	inode = d_inode(dentry);
+	if (!inode) {
+		d_invalidate(dentry);	/* stale miss */
+	} else if (inode->i_ino == child->ino) {
+		if (S_ISREG(inode->i_mode))
+			vtfs_file_refresh(inode, attr->size);
+		vtfs_dentry_stamp(dentry);
+	}
+	dput(dentry);
+}
+
+/*
+ * ctx->pos is the cookie of the next entry to return.  Each entry is
+ * found with one xarray search under RCU, copied out, and emitted with
+ * no lock held; entries added or removed meanwhile never shift the
+ * positions of the others.
+ */
 static int vtfs_iterate(struct file *file, struct dir_context *ctx)
 {
 	struct inode *inode = file_inode(file);
-	struct super_block *sb = inode->i_sb;
-	struct vtfs_fs *fs = vtfs_fs(sb);
 	struct vtfs_node *dir = inode->i_private;
 	struct vtfs_node *child;
+	unsigned long idx;
+	unsigned char type;
+	size_t len;
+	ino_t ino;
+	char *name;
+	int err;
 
-	loff_t idx = 0;
-	loff_t want;
-
-	if (!fs || !dir || !vtfs_is_dir(dir))
+	if (!dir || !vtfs_is_dir(dir))
 		return 0;
 
+	/* remote mode: pull in the server's entries at the start of a pass */
+	if (ctx->pos == 0) {
+		err = vtfs_store_fill_dir(inode->i_sb, dir, vtfs_prime_dcache,
+		                          file->f_path.dentry);
+		if (err)
+			return err;
+	}
+
 	if (!dir_emit_dots(file, ctx))
 		return 0;
 
-	want = ctx->pos - 2;
-
-	mutex_lock(&fs->lock);
+	name = kmalloc(NAME_MAX + 1, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
 
-	list_for_each_entry(child, &dir->children, siblings) {
-		if (idx++ < want)
-			continue;
+	for (;;) {
+		idx = ctx->pos;
 
-		if (!dir_emit(ctx,
-		              child->name,
-		              strlen(child->name),
-		              child->ino,
-		              vtfs_is_dir(child) ? DT_DIR : DT_REG)) {
-			mutex_unlock(&fs->lock);
-			return 0;
+		rcu_read_lock();
+		child = xa_find(&dir->entries, &idx, ULONG_MAX, XA_PRESENT);
+		if (child) {
+			len = strscpy(name, child->name, NAME_MAX + 1);
+			ino = child->ino;
+			type = vtfs_is_dir(child) ? DT_DIR : DT_REG;
 		}
-		ctx->pos++; 
+		rcu_read_unlock();
+
+		if (!child || !dir_emit(ctx, name, len, ino, type))
+			break;
+		ctx->pos = idx + 1;
 	}
 
-	mutex_unlock(&fs->lock);
+	kfree(name);
 	return 0;
 }
 
@@ -90,14 +226,15 @@ int vtfs_create(struct mnt_idmap *idmap,
 	mode = S_IFREG | 0777;
 
 	node = vtfs_store_create(sb, dir, dentry->d_name.name, mode);
-	if (!node)
-		return -EEXIST;
+	if (IS_ERR(node))
+		return PTR_ERR(node);
 
 	inode = vtfs_inode_from_node(sb, node);
 	if (!inode)
 		return -ENOMEM;
 
-	d_add(dentry, inode);
+	d_instantiate(dentry, inode);
+	vtfs_dentry_stamp(dentry);
 	return 0;
 }
 
@@ -105,11 +242,16 @@ int vtfs_unlink(struct inode *dir_inode, struct dentry *dentry)
 {
 	struct super_block *sb = dir_inode->i_sb;
 	struct vtfs_node *dir = dir_inode->i_private;
+	int ret;
 
 	if (!dir || !vtfs_is_dir(dir))
 		return -ENOTDIR;
 
-	return vtfs_store_unlink(sb, dir, dentry->d_name.name);
+	ret = vtfs_store_unlink(sb, dir, dentry->d_name.name);
+	if (ret == 0)
+		drop_nlink(d_inode(dentry));
+
+	return ret;
 }
 
 static int vtfs_mkdir(struct mnt_idmap *idmap,
@@ -130,8 +272,8 @@ static int vtfs_mkdir(struct mnt_idmap *idmap,
 	mode = S_IFDIR | 0777;
 
 	node = vtfs_store_create(sb, dir, dentry->d_name.name, mode);
-	if (!node)
-		return -EEXIST;
+	if (IS_ERR(node))
+		return PTR_ERR(node);
 
 	inode = vtfs_inode_from_node(sb, node);
 	if (!inode)
@@ -139,7 +281,8 @@ static int vtfs_mkdir(struct mnt_idmap *idmap,
 
 	inode_inc_link_count(dir_inode);
 
-	d_add(dentry, inode);
+	d_instantiate(dentry, inode);
+	vtfs_dentry_stamp(dentry);
 	return 0;
 }
 
@@ -153,23 +296,115 @@ static int vtfs_rmdir(struct inode *dir_inode, struct dentry *dentry)
 		return -ENOTDIR;
 
 	ret = vtfs_store_rmdir(sb, dir, dentry->d_name.name);
-	if (ret == 0)
+	if (ret == 0) {
+		clear_nlink(d_inode(dentry));
 		inode_dec_link_count(dir_inode);
+	}
+
+	return ret;
+}
+
+/* Timed entry points for the per-mount statistics. */
+
+static struct dentry *vtfs_timed_lookup(struct inode *dir,
+                                        struct dentry *dentry,
+                                        unsigned int flags)
+{
+	u64 start = vtfs_stat_start();
+	struct dentry *ret = vtfs_lookup(dir, dentry, flags);
+	u64 ns = vtfs_stat_end(dir->i_sb, VTFS_ST_LOOKUP, start);
+
+	trace_vtfs_lookup(dir, dentry, PTR_ERR_OR_ZERO(ret), ns);
+	return ret;
+}
+
+static int vtfs_timed_create(struct mnt_idmap *idmap, struct inode *dir,
+                             struct dentry *dentry, umode_t mode, bool excl)
+{
+	u64 start = vtfs_stat_start();
+	int ret = vtfs_create(idmap, dir, dentry, mode, excl);
+	u64 ns = vtfs_stat_end(dir->i_sb, VTFS_ST_CREATE, start);
+
+	trace_vtfs_create(dir, dentry, ret, ns);
+	return ret;
+}
+
+static int vtfs_timed_unlink(struct inode *dir, struct dentry *dentry)
+{
+	u64 start = vtfs_stat_start();
+	int ret = vtfs_unlink(dir, dentry);
+	u64 ns = vtfs_stat_end(dir->i_sb, VTFS_ST_UNLINK, start);
+
+	trace_vtfs_unlink(dir, dentry, ret, ns);
+	return ret;
+}
+
+static int vtfs_timed_mkdir(struct mnt_idmap *idmap, struct inode *dir,
+                            struct dentry *dentry, umode_t mode)
+{
+	u64 start = vtfs_stat_start();
+	int ret = vtfs_mkdir(idmap, dir, dentry, mode);
+
+	vtfs_stat_end(dir->i_sb, VTFS_ST_MKDIR, start);
+	return ret;
+}
+
+static int vtfs_timed_rmdir(struct inode *dir, struct dentry *dentry)
+{
+	u64 start = vtfs_stat_start();
+	int ret = vtfs_rmdir(dir, dentry);
+
+	vtfs_stat_end(dir->i_sb, VTFS_ST_RMDIR, start);
+	return ret;
+}
+
+static int vtfs_timed_link(struct dentry *old_dentry, struct inode *dir,
+                           struct dentry *new_dentry)
+{
+	u64 start = vtfs_stat_start();
+	int ret = vtfs_link(old_dentry, dir, new_dentry);
+
+	vtfs_stat_end(dir->i_sb, VTFS_ST_LINK, start);
+	return ret;
+}
+
+int vtfs_timed_getattr(struct mnt_idmap *idmap, const struct path *path,
+                       struct kstat *stat, u32 request_mask,
+                       unsigned int query_flags)
+{
+	u64 start = vtfs_stat_start();
+	int ret = vtfs_getattr(idmap, path, stat, request_mask, query_flags);
+
+	vtfs_stat_end(path->dentry->d_sb, VTFS_ST_GETATTR, start);
+	return ret;
+}
+
+static int vtfs_timed_iterate(struct file *file, struct dir_context *ctx)
+{
+	struct inode *dir = file_inode(file);
+	loff_t from = ctx->pos;
+	u64 start = vtfs_stat_start();
+	int ret = vtfs_iterate(file, ctx);
+	u64 ns = vtfs_stat_end(dir->i_sb, VTFS_ST_ITERATE, start);
 
+	trace_vtfs_iterate(dir, from, ctx->pos, ret, ns);
 	return ret;
 }
 
 const struct inode_operations vtfs_dir_iops = {
-	.lookup = vtfs_lookup,
-	.create = vtfs_create,
-	.unlink = vtfs_unlink,
-	.mkdir  = vtfs_mkdir,
-	.rmdir  = vtfs_rmdir,
-	.link   = vtfs_link,
+	.lookup = vtfs_timed_lookup,
+	.getattr = vtfs_timed_getattr,
+	.create = vtfs_timed_create,
+	.unlink = vtfs_timed_unlink,
+	.mkdir  = vtfs_timed_mkdir,
+	.rmdir  = vtfs_timed_rmdir,
+	.link   = vtfs_timed_link,
 };
 
 const struct file_operations vtfs_dir_fops = {
 	.owner = THIS_MODULE,
-	.iterate_shared = vtfs_iterate,
+	.iterate_shared = vtfs_timed_iterate,
 	.llseek = generic_file_llseek,
+	.unlocked_ioctl = vtfs_image_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 };
\ No newline at end of file
@@ -1,74 +1,758 @@
 #include "vtfs.h"
-#include <linux/uaccess.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/writeback.h>
+#include <linux/rmap.h>
 #include <linux/slab.h>
+#include <linux/falloc.h>
+#include <linux/splice.h>
+#include "vtfs_trace.h"
 
-static ssize_t vtfs_read(struct file *file, char __user *buf,
-                         size_t len, loff_t *ppos)
+/*
+ * Regular file data lives in the page cache, as with tmpfs: the chunks a
+ * file reads or writes are handed over to its folios (vtfs_data.c), so
+ * read(), write(), mmap and splice all work on the one copy there, and
+ * dirty folios are simply kept; there is no device to write them to.
+ * vtfs_file_writeback() only moves them back into the fileobj when
+ * something needs its chunks: clones, eviction and the compress worker.
+ * In remote mode write() also commits to the server as it goes, directly
+ * or through the write-back queue, and folios written through mmap are
+ * pushed at fsync and eviction.
+ */
+
+static int vtfs_read_folio(struct file *file, struct folio *folio)
 {
-	struct inode *inode = file_inode(file);
+	int err;
+
+	err = vtfs_fileobj_read_folios(folio->mapping->host->i_private,
+	                               &folio, 1);
+	folio_unlock(folio);
+	return err;
+}
+
+/* Reads a chunk's worth of folios at a time, so that it can be cached. */
+static void vtfs_readahead(struct readahead_control *rac)
+{
+	struct inode *inode = rac->mapping->host;
+	unsigned int per_chunk = 1U << (vtfs_fs(inode->i_sb)->chunk_shift -
+	                                PAGE_SHIFT);
+	struct folio **folios, *one;
+	unsigned int max, nr, i;
+
+	max = min(readahead_count(rac), per_chunk);
+	folios = max > 1 ? kmalloc_array(max, sizeof(*folios), GFP_KERNEL) : NULL;
+	if (!folios) {
+		folios = &one;
+		max = 1;
+	}
+
+	while (readahead_count(rac)) {
+		nr = 0;
+		do {
+			folios[nr++] = readahead_folio(rac);
+		} while (nr < max && readahead_count(rac) &&
+		         readahead_index(rac) & (per_chunk - 1));
+
+		/* folios that fail stay !uptodate and are read again */
+		vtfs_fileobj_read_folios(inode->i_private, folios, nr);
+		for (i = 0; i < nr; i++)
+			folio_unlock(folios[i]);
+	}
+
+	if (folios != &one)
+		kfree(folios);
+}
+
+static int vtfs_write_begin(struct file *file, struct address_space *mapping,
+                            loff_t pos, unsigned int len,
+                            struct page **pagep, void **fsdata)
+{
+	struct folio *folio;
+	int err;
+
+	folio = __filemap_get_folio(mapping, pos >> PAGE_SHIFT, FGP_WRITEBEGIN,
+	                            mapping_gfp_mask(mapping));
+	if (IS_ERR(folio))
+		return PTR_ERR(folio);
+
+	err = vtfs_fileobj_cache_folio(mapping->host->i_private, folio, pos, len);
+	if (err < 0) {
+		folio_unlock(folio);
+		folio_put(folio);
+		return err;
+	}
+
+	*pagep = &folio->page;
+	return 0;
+}
+
+static int vtfs_write_end(struct file *file, struct address_space *mapping,
+                          loff_t pos, unsigned int len, unsigned int copied,
+                          struct page *page, void *fsdata)
+{
+	struct folio *folio = page_folio(page);
+	struct inode *inode = mapping->host;
 	struct vtfs_fileobj *f = inode->i_private;
-	size_t available;
+	void *kaddr;
+	int err;
+
+	if (!folio_test_uptodate(folio)) {
+		/* whole-folio write that came up short: nothing usable */
+		if (copied < len) {
+			copied = 0;
+			goto out;
+		}
+		folio_mark_uptodate(folio);
+	}
+
+	kaddr = kmap_local_folio(folio, offset_in_folio(folio, pos));
+	err = vtfs_fileobj_write_folio(f, folio, pos, kaddr, copied);
+	if (err) {
+		kunmap_local(kaddr);
+		folio_clear_uptodate(folio);
+		copied = err;
+		goto out;
+	}
+
+	if (pos + copied > inode->i_size)
+		i_size_write(inode, pos + copied);
+
+	/* the folio holds the write either way, so it stays uptodate */
+	if (vtfs_fs(inode->i_sb)->remote) {
+		err = vtfs_remote_commit(vtfs_fs(inode->i_sb), inode->i_ino, f,
+		                         pos, kaddr, copied);
+		if (err)
+			copied = err;
+	}
+	kunmap_local(kaddr);
+
+out:
+	folio_unlock(folio);
+	folio_put(folio);
+	return copied;
+}
+
+const struct address_space_operations vtfs_aops = {
+	.read_folio    = vtfs_read_folio,
+	.readahead     = vtfs_readahead,
+	.write_begin   = vtfs_write_begin,
+	.write_end     = vtfs_write_end,
+	.dirty_folio   = noop_dirty_folio,
+	.migrate_folio = filemap_migrate_folio,
+};
+
+/*
+ * A shared mapping is about to write to @vmf's folio: like write_begin,
+ * its chunk goes over to the page cache first.  In remote mode the folio
+ * is marked checked until vtfs_file_writeback() pushes it to the server.
+ */
+static vm_fault_t vtfs_page_mkwrite(struct vm_fault *vmf)
+{
+	struct folio *folio = page_folio(vmf->page);
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	vm_fault_t ret = VM_FAULT_LOCKED;
+	int err;
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vmf->vma->vm_file);
+	filemap_invalidate_lock_shared(inode->i_mapping);
+
+	folio_lock(folio);
+	if (folio->mapping != inode->i_mapping ||
+	    folio_pos(folio) >= i_size_read(inode)) {
+		folio_unlock(folio);
+		ret = VM_FAULT_NOPAGE;
+		goto out;
+	}
+
+	err = vtfs_fileobj_cache_folio(inode->i_private, folio, folio_pos(folio),
+	                               folio_size(folio));
+	if (err) {
+		folio_unlock(folio);
+		/* another page of the chunk is busy: fault again */
+		ret = err > 0 ? VM_FAULT_NOPAGE : vmf_error(err);
+		goto out;
+	}
+
+	if (vtfs_fs(inode->i_sb)->remote)
+		folio_set_checked(folio);
+	folio_mark_dirty(folio);
+	folio_wait_stable(folio);
+
+out:
+	filemap_invalidate_unlock_shared(inode->i_mapping);
+	sb_end_pagefault(inode->i_sb);
+	return ret;
+}
+
+static const struct vm_operations_struct vtfs_file_vm_ops = {
+	.fault        = filemap_fault,
+	.map_pages    = filemap_map_pages,
+	.page_mkwrite = vtfs_page_mkwrite,
+};
 
-	if (!f || !f->data)
+static int vtfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &vtfs_file_vm_ops;
+	return 0;
+}
+
+/* Remote mode: sends the server a folio written through mmap. */
+static int vtfs_file_push(struct inode *inode, struct folio *folio)
+{
+	loff_t pos = folio_pos(folio);
+	loff_t size = i_size_read(inode);
+	void *kaddr;
+	int err;
+
+	/* further writes fault again, and mark it again */
+	folio_mkclean(folio);
+	folio_clear_checked(folio);
+	if (pos >= size)
 		return 0;
 
-	if (*ppos >= f->size)
+	kaddr = kmap_local_folio(folio, 0);
+	err = vtfs_remote_commit(vtfs_fs(inode->i_sb), inode->i_ino,
+	                         inode->i_private, pos, kaddr,
+	                         min_t(loff_t, folio_size(folio), size - pos));
+	kunmap_local(kaddr);
+	if (err)
+		folio_set_checked(folio);
+	return err;
+}
+
+/*
+ * Walks the folios of the whole chunks over [start, end].  In remote
+ * mode, those written through mmap since they were last pushed go to the
+ * server.  With @to_chunks, dirty ones are also put back into the
+ * fileobj, a cached chunk getting its buffer back from @gfp, and end up
+ * clean.  Carries on past errors and returns the first.
+ */
+static int vtfs_file_writeback(struct inode *inode, loff_t start, loff_t end,
+                               bool to_chunks, gfp_t gfp)
+{
+	struct address_space *mapping = inode->i_mapping;
+	pgoff_t mask = (1UL << (vtfs_fs(inode->i_sb)->chunk_shift -
+	                        PAGE_SHIFT)) - 1;
+	pgoff_t index = (start >> PAGE_SHIFT) & ~mask;
+	pgoff_t last = (end >> PAGE_SHIFT) | mask;
+	struct folio_batch fbatch;
+	struct folio *folio;
+	unsigned int i;
+	int ret = 0, err;
+
+	folio_batch_init(&fbatch);
+	while (filemap_get_folios(mapping, &index, last, &fbatch)) {
+		for (i = 0; i < folio_batch_count(&fbatch); i++) {
+			folio = fbatch.folios[i];
+			folio_lock(folio);
+			if (folio->mapping != mapping)
+				goto next;	/* truncated meanwhile */
+
+			err = folio_test_checked(folio) ?
+			      vtfs_file_push(inode, folio) : 0;
+			if (!err && to_chunks && folio_test_dirty(folio)) {
+				/* noop_dirty_folio does not write-protect it */
+				folio_mkclean(folio);
+				folio_clear_dirty_for_io(folio);
+				err = vtfs_fileobj_writeback_folio(inode->i_private,
+				                                   folio, gfp);
+				if (err)
+					folio_mark_dirty(folio);
+			}
+			if (err && !ret)
+				ret = err;
+next:
+			folio_unlock(folio);
+		}
+		folio_batch_release(&fbatch);
+		cond_resched();
+	}
+
+	return ret;
+}
+
+/*
+ * From evict_inode: the page cache is about to go, so the chunks it
+ * holds get their buffers back, unless the file is gone anyway.
+ */
+void vtfs_file_evict(struct inode *inode)
+{
+	struct vtfs_fileobj *f = inode->i_private;
+
+	if (inode->i_nlink)
+		vtfs_file_writeback(inode, 0, LLONG_MAX, true,
+		                    GFP_KERNEL_ACCOUNT | __GFP_NOFAIL);
+	truncate_inode_pages_final(&inode->i_data);
+
+	mutex_lock(&f->lock);
+	vtfs_fileobj_set_mapping(f, NULL);
+	mutex_unlock(&f->lock);
+}
+
+/*
+ * For the compress worker, before it compacts a file gone cold: puts the
+ * chunks held by its page cache back into buffers and lets go of the
+ * clean folios.
+ */
+void vtfs_file_cool(struct vtfs_fileobj *f)
+{
+	struct inode *inode = NULL;
+
+	mutex_lock(&f->lock);
+	if (f->mapping)
+		inode = igrab(f->mapping->host);
+	mutex_unlock(&f->lock);
+	if (!inode)
+		return;
+
+	if (!vtfs_file_writeback(inode, 0, LLONG_MAX, true, GFP_KERNEL_ACCOUNT))
+		invalidate_mapping_pages(inode->i_mapping, 0, -1);
+	iput(inode);
+}
+
+/*
+ * Remote mode: the server reported @size for this file.  stat sees it
+ * right away; the contents are reloaded on the next open, as with NFS
+ * close-to-open consistency.  Sizes of files with queued writes are ours.
+ */
+void vtfs_file_refresh(struct inode *inode, loff_t size)
+{
+	struct vtfs_fileobj *f = inode->i_private;
+
+	if (size == i_size_read(inode) || !list_empty_careful(&f->dirty))
+		return;
+
+	WRITE_ONCE(f->remote_size, size);
+	i_size_write(inode, size);
+}
+
+/*
+ * Remote mode fetches a file's contents the first time it is opened,
+ * and again after vtfs_file_refresh() saw the server's copy change.
+ */
+static int vtfs_file_open(struct inode *inode, struct file *file)
+{
+	struct vtfs_fs *fs = vtfs_fs(inode->i_sb);
+	struct vtfs_fileobj *f = inode->i_private;
+	loff_t size;
+	int err = 0;
+
+	if (READ_ONCE(f->image_off)) {
+		err = vtfs_image_fetch(fs, f);
+		if (err)
+			return err;
+	}
+
+	if (!fs->remote ||
+	    (!READ_ONCE(f->remote_pending) && READ_ONCE(f->remote_size) < 0))
 		return 0;
 
-	available = f->size - *ppos;
-	if (len > available)
-		len = available;
+	inode_lock(inode);
+	size = f->remote_size;
+	if (size >= 0) {
+		f->remote_size = -1;
+		vtfs_file_writeback(inode, 0, LLONG_MAX, false, GFP_KERNEL);
+		truncate_pagecache(inode, 0);
+		vtfs_fileobj_set_remote(f, size);
+		i_size_write(inode, size);
+	}
+	if (f->remote_pending)
+		err = vtfs_remote_fetch(fs, inode->i_ino, f);
+	inode_unlock(inode);
+
+	return err;
+}
 
-	if (copy_to_user(buf, f->data + *ppos, len))
-		return -EFAULT;
+static int vtfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct inode *inode = file_inode(file);
+	int err;
 
-	*ppos += len;
-	return len;
+	/* locally, the page cache is as stable as it gets */
+	if (vtfs_fs(inode->i_sb)->remote) {
+		err = vtfs_file_writeback(inode, start, end, false, GFP_KERNEL);
+		if (err)
+			return err;
+	}
+
+	return vtfs_remote_sync(vtfs_fs(inode->i_sb), inode->i_private);
 }
 
-static ssize_t vtfs_write(struct file *file, const char __user *buf,
-                          size_t len, loff_t *ppos)
+static long vtfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
 {
 	struct inode *inode = file_inode(file);
 	struct vtfs_fileobj *f = inode->i_private;
-	size_t new_size;
-	char *new_data;
+	loff_t end = offset + len;
+	int err = 0;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+		return -EOPNOTSUPP;
+	if (vtfs_fs(inode->i_sb)->remote)
+		return -EOPNOTSUPP;
+
+	inode_lock(inode);
+
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		filemap_invalidate_lock(inode->i_mapping);
+		truncate_pagecache_range(inode, offset, end - 1);
+		err = vtfs_fileobj_punch(f, offset, len);
+		filemap_invalidate_unlock(inode->i_mapping);
+	} else {
+		if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+			err = inode_newsize_ok(inode, end);
+			if (err)
+				goto out;
+		}
+
+		err = vtfs_fileobj_allocate(f, offset, len, mode & FALLOC_FL_KEEP_SIZE);
+		if (err)
+			goto out;
+
+		if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode))
+			i_size_write(inode, end);
+	}
+
+	inode_set_mtime_to_ts(inode, inode_set_ctime_current(inode));
+
+out:
+	inode_unlock(inode);
+	return err;
+}
+
+static loff_t vtfs_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file_inode(file);
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE)
+		return generic_file_llseek(file, offset, whence);
+
+	if (offset < 0)
+		return -ENXIO;
+
+	inode_lock_shared(inode);
+	offset = vtfs_fileobj_seek(inode->i_private, offset, whence);
+	if (offset >= 0)
+		offset = vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+	inode_unlock_shared(inode);
+
+	return offset;
+}
+
+static int vtfs_setattr(struct mnt_idmap *idmap,
+                        struct dentry *dentry,
+                        struct iattr *iattr)
+{
+	struct inode *inode = d_inode(dentry);
+	struct vtfs_fileobj *f = inode->i_private;
+	struct vtfs_fs *fs = vtfs_fs(inode->i_sb);
+	int err;
 
-	if (!f)
+	err = setattr_prepare(idmap, dentry, iattr);
+	if (err)
+		return err;
+
+	if ((iattr->ia_valid & ATTR_SIZE) && iattr->ia_size != i_size_read(inode)) {
+		if (READ_ONCE(f->image_off) && iattr->ia_size) {
+			err = vtfs_image_fetch(fs, f);
+			if (err)
+				return err;
+		}
+		if (fs->remote) {
+			/* the kept prefix must be local before the server drops it */
+			if (f->remote_pending && iattr->ia_size) {
+				err = vtfs_remote_fetch(fs, inode->i_ino, f);
+				if (err)
+					return err;
+			}
+			/* queued writes past the new size must not land after it */
+			err = vtfs_remote_sync(fs, f);
+			if (err)
+				return err;
+		}
+		/*
+		 * The fileobj may fail to unshare a partial last chunk, so it
+		 * goes first: on failure nothing else has changed yet.
+		 * vtfs_file_writeback() skips folios past its new size.
+		 */
+		err = vtfs_fileobj_truncate(f, iattr->ia_size);
+		if (err)
+			return err;
+		truncate_setsize(inode, iattr->ia_size);
+		if (fs->remote) {
+			err = vtfs_remote_truncate(fs, inode->i_ino, iattr->ia_size);
+			if (err)
+				return err;
+			f->remote_pending = false;
+		}
+	}
+
+	setattr_copy(idmap, inode, iattr);
+	return 0;
+}
+
+/*
+ * Caller holds both inode and invalidate locks and has written back both
+ * ranges.  Copies between the fileobjs, sharing whole chunks where it can,
+ * and drops the destination's stale folios.
+ */
+static int vtfs_clone_range(struct inode *src, loff_t pos_in,
+                            struct inode *dst, loff_t pos_out, loff_t len)
+{
+	int err;
+
+	/* written back already, so these folios are all clean */
+	invalidate_inode_pages2_range(dst->i_mapping, pos_out >> PAGE_SHIFT,
+	                              (pos_out + len - 1) >> PAGE_SHIFT);
+
+	err = vtfs_fileobj_clone(dst->i_private, pos_out, src->i_private, pos_in,
+	                         len);
+	if (err)
+		return err;
+
+	if (pos_out + len > i_size_read(dst))
+		i_size_write(dst, pos_out + len);
+	return 0;
+}
+
+/*
+ * FICLONE, FICLONERANGE and FIDEDUPERANGE: the destination shares the
+ * source's chunks until either side writes to them.  Ranges start on a
+ * chunk boundary; a partial last chunk is copied.  With CAN_SHORTEN, as
+ * FIDEDUPERANGE passes, the prep may trim the range, and the length
+ * actually shared is returned.
+ */
+static loff_t vtfs_remap_file_range(struct file *file_in, loff_t pos_in,
+                                    struct file *file_out, loff_t pos_out,
+                                    loff_t len, unsigned int remap_flags)
+{
+	struct inode *src = file_inode(file_in);
+	struct inode *dst = file_inode(file_out);
+	struct vtfs_fs *fs = vtfs_fs(dst->i_sb);
+	loff_t mask = (1LL << fs->chunk_shift) - 1;
+	loff_t ret;
+
+	if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_CAN_SHORTEN))
+		return -EINVAL;
+	if (fs->remote)
+		return -EOPNOTSUPP;	/* the server has no clones */
+	if ((pos_in | pos_out) & mask)
 		return -EINVAL;
 
-	if (file->f_flags & O_APPEND)
-		*ppos = f->size;
+	lock_two_nondirectories(src, dst);
+	filemap_invalidate_lock_two(src->i_mapping, dst->i_mapping);
+
+	ret = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out,
+	                                    &len, remap_flags);
+	if (ret < 0 || !len)
+		goto out;
+
+	ret = vtfs_file_writeback(src, pos_in, pos_in + len - 1, true,
+	                          GFP_KERNEL_ACCOUNT);
+	if (!ret)
+		ret = vtfs_file_writeback(dst, pos_out, pos_out + len - 1, true,
+		                          GFP_KERNEL_ACCOUNT);
+	if (!ret)
+		ret = vtfs_clone_range(src, pos_in, dst, pos_out, len);
+	if (!ret)
+		ret = len;
+
+out:
+	filemap_invalidate_unlock_two(src->i_mapping, dst->i_mapping);
+	unlock_two_nondirectories(src, dst);
+	return ret;
+}
+
+/*
+ * copy_file_range between two files of one local mount goes straight
+ * from fileobj to fileobj at any offsets, sharing the whole chunks that
+ * line up.  Everything else (another mount, remote mode) is spliced
+ * through the page cache.
+ */
+static ssize_t vtfs_copy_file_range(struct file *file_in, loff_t pos_in,
+                                    struct file *file_out, loff_t pos_out,
+                                    size_t len, unsigned int flags)
+{
+	struct inode *src = file_inode(file_in);
+	struct inode *dst = file_inode(file_out);
+	loff_t size;
+	ssize_t ret;
+
+	if (src->i_sb != dst->i_sb || vtfs_fs(dst->i_sb)->remote)
+		return splice_copy_file_range(file_in, pos_in, file_out, pos_out,
+		                              len);
 
-	if (*ppos == 0) {
-		kfree(f->data);
-		f->data = NULL;
-		f->size = 0;
+	lock_two_nondirectories(src, dst);
+	filemap_invalidate_lock_two(src->i_mapping, dst->i_mapping);
+
+	size = i_size_read(src);
+	len = pos_in < size ? min_t(loff_t, len, size - pos_in) : 0;
+	if (!len) {
+		ret = 0;
+		goto out;
 	}
 
-	new_size = *ppos + len;
+	ret = file_modified(file_out);
+	if (!ret)
+		ret = vtfs_file_writeback(src, pos_in, pos_in + len - 1, true,
+		                          GFP_KERNEL_ACCOUNT);
+	if (!ret)
+		ret = vtfs_file_writeback(dst, pos_out, pos_out + len - 1, true,
+		                          GFP_KERNEL_ACCOUNT);
+	if (!ret)
+		ret = vtfs_clone_range(src, pos_in, dst, pos_out, len);
+	if (!ret)
+		ret = len;
+
+out:
+	filemap_invalidate_unlock_two(src->i_mapping, dst->i_mapping);
+	unlock_two_nondirectories(src, dst);
+	return ret;
+}
+
+/* Timed entry points for the per-mount statistics. */
+
+static int vtfs_timed_setattr(struct mnt_idmap *idmap, struct dentry *dentry,
+                              struct iattr *iattr)
+{
+	u64 start = vtfs_stat_start();
+	int ret = vtfs_setattr(idmap, dentry, iattr);
+
+	vtfs_stat_end(dentry->d_sb, VTFS_ST_SETATTR, start);
+	return ret;
+}
+
+static int vtfs_timed_open(struct inode *inode, struct file *file)
+{
+	u64 start = vtfs_stat_start();
+	int ret = vtfs_file_open(inode, file);
+
+	vtfs_stat_end(inode->i_sb, VTFS_ST_OPEN, start);
+	return ret;
+}
+
+static ssize_t vtfs_timed_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	loff_t pos = iocb->ki_pos;
+	u64 start = vtfs_stat_start();
+	ssize_t ret = generic_file_read_iter(iocb, to);
+	u64 ns = vtfs_stat_end_bytes(inode->i_sb, VTFS_ST_READ, start,
+	                             ret > 0 ? ret : 0);
+
+	trace_vtfs_read(inode, pos, ret, ns);
+	return ret;
+}
+
+static ssize_t vtfs_timed_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	u64 start = vtfs_stat_start();
+	ssize_t ret = generic_file_write_iter(iocb, from);
+	u64 ns = vtfs_stat_end_bytes(inode->i_sb, VTFS_ST_WRITE, start,
+	                             ret > 0 ? ret : 0);
+
+	/* O_APPEND only picks the offset inside, so report where it went */
+	trace_vtfs_write(inode, iocb->ki_pos - (ret > 0 ? ret : 0), ret, ns);
+	return ret;
+}
+
+static int vtfs_timed_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	u64 start = vtfs_stat_start();
+	int ret = vtfs_file_mmap(file, vma);
 
-	new_data = krealloc(f->data, new_size, GFP_KERNEL);
-	if (!new_data)
-		return -ENOMEM;
+	vtfs_stat_end(file_inode(file)->i_sb, VTFS_ST_MMAP, start);
+	return ret;
+}
 
-	f->data = new_data;
+static int vtfs_timed_fsync(struct file *file, loff_t start_pos, loff_t end,
+                            int datasync)
+{
+	u64 start = vtfs_stat_start();
+	int ret = vtfs_fsync(file, start_pos, end, datasync);
 
-	if (copy_from_user(f->data + *ppos, buf, len))
-		return -EFAULT;
+	vtfs_stat_end(file_inode(file)->i_sb, VTFS_ST_FSYNC, start);
+	return ret;
+}
 
-	*ppos += len;
-	f->size = max(f->size, new_size);
+static long vtfs_timed_fallocate(struct file *file, int mode, loff_t offset,
+                                 loff_t len)
+{
+	u64 start = vtfs_stat_start();
+	long ret = vtfs_fallocate(file, mode, offset, len);
 
-	inode_set_ctime_current(inode);
-	inode->i_size = f->size;
+	vtfs_stat_end(file_inode(file)->i_sb, VTFS_ST_FALLOCATE, start);
+	return ret;
+}
 
-	return len;
+static loff_t vtfs_timed_llseek(struct file *file, loff_t offset, int whence)
+{
+	u64 start = vtfs_stat_start();
+	loff_t ret = vtfs_llseek(file, offset, whence);
+
+	vtfs_stat_end(file_inode(file)->i_sb, VTFS_ST_LLSEEK, start);
+	return ret;
 }
 
+static ssize_t vtfs_timed_splice_read(struct file *in, loff_t *ppos,
+                                      struct pipe_inode_info *pipe,
+                                      size_t len, unsigned int flags)
+{
+	struct inode *inode = file_inode(in);
+	loff_t pos = *ppos;
+	u64 start = vtfs_stat_start();
+	ssize_t ret = filemap_splice_read(in, ppos, pipe, len, flags);
+	u64 ns = vtfs_stat_end_bytes(inode->i_sb, VTFS_ST_READ, start,
+	                             ret > 0 ? ret : 0);
+
+	trace_vtfs_read(inode, pos, ret, ns);
+	return ret;
+}
+
+static ssize_t vtfs_timed_copy_file_range(struct file *file_in, loff_t pos_in,
+                                          struct file *file_out, loff_t pos_out,
+                                          size_t len, unsigned int flags)
+{
+	u64 start = vtfs_stat_start();
+	ssize_t ret = vtfs_copy_file_range(file_in, pos_in, file_out, pos_out,
+	                                   len, flags);
+
+	vtfs_stat_end_bytes(file_inode(file_out)->i_sb, VTFS_ST_COPY, start,
+	                    ret > 0 ? ret : 0);
+	return ret;
+}
+
+static loff_t vtfs_timed_remap_file_range(struct file *file_in, loff_t pos_in,
+                                          struct file *file_out, loff_t pos_out,
+                                          loff_t len, unsigned int remap_flags)
+{
+	u64 start = vtfs_stat_start();
+	loff_t ret = vtfs_remap_file_range(file_in, pos_in, file_out, pos_out,
+	                                   len, remap_flags);
+
+	vtfs_stat_end_bytes(file_inode(file_out)->i_sb, VTFS_ST_REMAP, start,
+	                    ret > 0 ? ret : 0);
+	return ret;
+}
+
+const struct inode_operations vtfs_file_iops = {
+	.setattr = vtfs_timed_setattr,
+	.getattr = vtfs_timed_getattr,
+};
+
 const struct file_operations vtfs_file_fops = {
-	.owner = THIS_MODULE,
-	.read  = vtfs_read,
-	.write = vtfs_write,
-	.llseek = default_llseek,
-};
\ No newline at end of file
+	.owner            = THIS_MODULE,
+	.open             = vtfs_timed_open,
+	.read_iter        = vtfs_timed_read_iter,
+	.write_iter       = vtfs_timed_write_iter,
+	.mmap             = vtfs_timed_mmap,
+	.fsync            = vtfs_timed_fsync,
+	.fallocate        = vtfs_timed_fallocate,
+	.llseek           = vtfs_timed_llseek,
+	.splice_read      = vtfs_timed_splice_read,
+	.splice_write     = iter_file_splice_write,
+	.copy_file_range  = vtfs_timed_copy_file_range,
+	.remap_file_range = vtfs_timed_remap_file_range,
+};
@@ -0,0 +1,763 @@
+#include "vtfs.h"
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/namei.h>
+#include <linux/mount.h>
+#include <linux/capability.h>
+
+/*
+ * Snapshot images (image=<absolute path>, mode=ram only).  The tree is
+ * loaded from the image at mount and written back at umount, or when
+ * VTFS_IOC_SAVE asks for it.  All fields are little endian:
+ *
+ *   struct vtfs_image_hdr
+ *   nr_nodes x struct vtfs_image_node, parents before their children
+ *   the names, back to back in the order of the nodes
+ *   file contents, each extent page aligned, holes left as holes
+ *
+ * Mounting only builds the tree; a file reads its extent the first time
+ * it is opened or truncated, so a large image mounts in the time it
+ * takes to read the node table.  The image file stays open for that
+ * until umount.
+ *
+ * An image is written next to the old one as <path>.tmp and renamed
+ * over it once complete, so a failed save leaves the old one intact.
+ * Its directory is looked up once, at mount, in the mounter's namespace:
+ * saves at umount may run in any task, and only ever create and rename
+ * within that directory, without following symlinks.
+ */
+
+/* reads and writes go through a buffer of this size */
+#define VTFS_IMAGE_BUF (64 * 1024)
+
+struct vtfs_image_io {
+	struct file *file;
+	loff_t pos;		/* of buf[0] */
+	char *buf;
+	size_t len;		/* valid bytes in buf */
+	size_t off;		/* reading: next byte of buf */
+};
+
+static int vtfs_image_io_init(struct vtfs_image_io *io, struct file *file,
+                              loff_t pos)
+{
+	io->file = file;
+	io->pos = pos;
+	io->len = 0;
+	io->off = 0;
+	io->buf = kvmalloc(VTFS_IMAGE_BUF, GFP_KERNEL);
+	return io->buf ? 0 : -ENOMEM;
+}
+
+static int vtfs_image_flush(struct vtfs_image_io *io)
+{
+	ssize_t ret;
+
+	if (!io->len)
+		return 0;
+	ret = kernel_write(io->file, io->buf, io->len, &io->pos);
+	if (ret != io->len)
+		return ret < 0 ? ret : -EIO;
+	io->len = 0;
+	return 0;
+}
+
+static int vtfs_image_put(struct vtfs_image_io *io, const void *data,
+                          size_t len)
+{
+	size_t n;
+	int err;
+
+	while (len) {
+		if (io->len == VTFS_IMAGE_BUF) {
+			err = vtfs_image_flush(io);
+			if (err)
+				return err;
+		}
+		n = min(len, VTFS_IMAGE_BUF - io->len);
+		memcpy(io->buf + io->len, data, n);
+		io->len += n;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int vtfs_image_get(struct vtfs_image_io *io, void *data, size_t len)
+{
+	loff_t pos;
+	ssize_t ret;
+	size_t n;
+
+	while (len) {
+		if (io->off == io->len) {
+			io->pos += io->len;
+			io->off = 0;
+			io->len = 0;
+			pos = io->pos;
+			ret = kernel_read(io->file, io->buf, VTFS_IMAGE_BUF, &pos);
+			if (ret < 0)
+				return ret;
+			if (!ret)
+				return -EINVAL;	/* truncated image */
+			io->len = ret;
+		}
+		n = min(len, io->len - io->off);
+		memcpy(data, io->buf + io->off, n);
+		io->off += n;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Takes @file for an image, unless it is no regular file or lives on @sb. */
+static struct file *vtfs_image_check(struct super_block *sb, struct file *file)
+{
+	if (IS_ERR(file))
+		return file;
+	if (!S_ISREG(file_inode(file)->i_mode) || file_inode(file)->i_sb == sb) {
+		fput(file);
+		return ERR_PTR(-EINVAL);
+	}
+	return file;
+}
+
+/* Pins the directory of the image= file, where saves go. */
+static int vtfs_image_pin_dir(struct vtfs_fs *fs)
+{
+	const char *path = fs->opts.image;
+	char *dir;
+	int err;
+
+	dir = kstrndup(path, kbasename(path) - path, GFP_KERNEL);
+	if (!dir)
+		return -ENOMEM;
+	err = kern_path(dir, LOOKUP_FOLLOW | LOOKUP_DIRECTORY, &fs->image_dir);
+	kfree(dir);
+	return err;
+}
+
+/* ---- load ---------------------------------------------------------------- */
+
+static int vtfs_image_bad(const char *path, const char *why)
+{
+	pr_err("[vtfs] image %s: %s\n", path, why);
+	return -EINVAL;
+}
+
+/*
+ * Inode numbers go straight to iget_locked(), so two nodes must never
+ * share one, except for the names of a hard-linked file.  @inos holds
+ * those seen so far.
+ */
+static int vtfs_image_check_ino(struct xarray *inos, u64 next_ino, u64 ino,
+                                const char *path)
+{
+	int err;
+
+	if (!ino || ino >= next_ino || ino > ULONG_MAX)
+		return vtfs_image_bad(path, "bad inode number");
+	err = xa_insert(inos, ino, xa_mk_value(0), GFP_KERNEL);
+	if (err == -EBUSY)
+		return vtfs_image_bad(path, "duplicate inode number");
+	return err;
+}
+
+static int vtfs_image_load_node(struct super_block *sb, struct xarray *nodes,
+                                struct xarray *inos, u64 next_ino, u64 i,
+                                const struct vtfs_image_node *rec,
+                                const char *name, const char *path)
+{
+	umode_t mode = le32_to_cpu(rec->mode);
+	u64 ino = le64_to_cpu(rec->ino);
+	u64 parent_idx = le64_to_cpu(rec->parent);
+	u64 link = le64_to_cpu(rec->link);
+	u64 size = le64_to_cpu(rec->size);
+	u64 data = le64_to_cpu(rec->data);
+	struct vtfs_node *parent, *owner, *n;
+	struct vtfs_fileobj *f = NULL;
+	int err;
+
+	parent = parent_idx < i ? xa_load(nodes, parent_idx) : NULL;
+	if (!parent || !vtfs_is_dir(parent))
+		return vtfs_image_bad(path, "bad parent");
+
+	if ((le32_to_cpu(rec->mode) & ~(S_IFMT | S_IALLUGO)) ||
+	    (!S_ISREG(mode) && !S_ISDIR(mode)))
+		return vtfs_image_bad(path, "bad mode");
+
+	if (S_ISREG(mode) && link != i) {
+		owner = link < i ? xa_load(nodes, link) : NULL;
+		if (!owner || vtfs_is_dir(owner) || owner->ino != ino)
+			return vtfs_image_bad(path, "bad hard link");
+		f = owner->f;
+	} else {
+		err = vtfs_image_check_ino(inos, next_ino, ino, path);
+		if (err)
+			return err;
+	}
+
+	n = vtfs_store_insert(sb, parent, name, mode, ino, f);
+	if (IS_ERR(n)) {
+		if (PTR_ERR(n) == -EEXIST)
+			return vtfs_image_bad(path, "duplicate name");
+		return PTR_ERR(n);
+	}
+
+	if (S_ISREG(mode) && !f && size) {
+		if (!data || !PAGE_ALIGNED(data) || size > MAX_LFS_FILESIZE)
+			return vtfs_image_bad(path, "bad extent");
+		vtfs_fileobj_set_image(n->f, data, size);
+	}
+
+	if (vtfs_is_dir(n) || (le16_to_cpu(rec->flags) & VTFS_IMAGE_LINKED))
+		return xa_err(xa_store(nodes, i, n, GFP_KERNEL));
+	return 0;
+}
+
+/*
+ * Builds the tree from the image= file, if it exists yet.  Directories
+ * and the files that later records link to are remembered by record
+ * number until the end.
+ */
+int vtfs_image_load(struct super_block *sb)
+{
+	struct vtfs_fs *fs = vtfs_fs(sb);
+	const char *path = fs->opts.image;
+	struct vtfs_image_io nio, sio;
+	struct vtfs_image_node rec;
+	struct vtfs_image_hdr hdr;
+	struct xarray nodes, inos;
+	char name[NAME_MAX + 1];
+	size_t len;
+	u64 i, nr, next_ino;
+	struct file *file;
+	loff_t pos = 0;
+	ssize_t ret;
+	int err;
+
+	err = vtfs_image_pin_dir(fs);
+	if (err)
+		return err;
+
+	file = vtfs_image_check(sb, filp_open(path, O_RDONLY | O_LARGEFILE, 0));
+	if (PTR_ERR(file) == -ENOENT)
+		return 0;	/* created at the first save */
+	if (IS_ERR(file)) {
+		err = PTR_ERR(file);
+		goto unpin;
+	}
+
+	ret = kernel_read(file, &hdr, sizeof(hdr), &pos);
+	if (ret != sizeof(hdr) || le64_to_cpu(hdr.magic) != VTFS_IMAGE_MAGIC ||
+	    le32_to_cpu(hdr.version) != VTFS_IMAGE_VERSION ||
+	    !le64_to_cpu(hdr.nr_nodes)) {
+		err = ret < 0 ? ret : vtfs_image_bad(path, "not a vtfs image");
+		goto put;
+	}
+	nr = le64_to_cpu(hdr.nr_nodes);
+	next_ino = le64_to_cpu(hdr.next_ino);
+
+	err = vtfs_image_io_init(&nio, file, le64_to_cpu(hdr.nodes_off));
+	if (err)
+		goto put;
+	err = vtfs_image_io_init(&sio, file, le64_to_cpu(hdr.names_off));
+	if (err)
+		goto free_nio;
+
+	xa_init(&nodes);
+	xa_init(&inos);
+	for (i = 0; i < nr; i++) {
+		err = vtfs_image_get(&nio, &rec, sizeof(rec));
+		if (err)
+			break;
+
+		if (!i) {
+			if (!S_ISDIR(le32_to_cpu(rec.mode)) || rec.name_len) {
+				err = vtfs_image_bad(path, "bad root");
+				break;
+			}
+			err = vtfs_image_check_ino(&inos, next_ino,
+			                           le64_to_cpu(rec.ino), path);
+			if (err)
+				break;
+			fs->root->ino = le64_to_cpu(rec.ino);
+			fs->root->mode = le32_to_cpu(rec.mode);
+			err = xa_err(xa_store(&nodes, 0, fs->root, GFP_KERNEL));
+			if (err)
+				break;
+			continue;
+		}
+
+		len = le16_to_cpu(rec.name_len);
+		if (!len || len > NAME_MAX) {
+			err = vtfs_image_bad(path, "bad name");
+			break;
+		}
+		err = vtfs_image_get(&sio, name, len);
+		if (err)
+			break;
+		name[len] = '\0';
+		if (strnlen(name, len) != len || memchr(name, '/', len) ||
+		    !strcmp(name, ".") || !strcmp(name, "..")) {
+			err = vtfs_image_bad(path, "bad name");
+			break;
+		}
+
+		err = vtfs_image_load_node(sb, &nodes, &inos, next_ino, i, &rec,
+		                           name, path);
+		if (err)
+			break;
+	}
+	xa_destroy(&inos);
+	xa_destroy(&nodes);
+
+	if (!err) {
+		/* the counter holds the last ino handed out */
+		atomic64_set(&fs->next_ino, next_ino - 1);
+		fs->image = file;
+		file = NULL;
+	}
+
+	kvfree(sio.buf);
+free_nio:
+	kvfree(nio.buf);
+put:
+	if (file)
+		fput(file);
+unpin:
+	if (err) {
+		path_put(&fs->image_dir);
+		fs->image_dir = (struct path){};
+	}
+	return err;
+}
+
+/* Reads the contents of @f from the image, if they are still there. */
+int vtfs_image_fetch(struct vtfs_fs *fs, struct vtfs_fileobj *f)
+{
+	int err;
+
+	down_read(&fs->image_sem);
+	err = vtfs_fileobj_load(f, fs->image);
+	up_read(&fs->image_sem);
+	return err;
+}
+
+/* ---- save ---------------------------------------------------------------- */
+
+struct vtfs_image_dir {
+	struct vtfs_node *dir;
+	u64 index;		/* its record */
+};
+
+/* a file whose contents were copied over from the previous image */
+struct vtfs_image_moved {
+	struct vtfs_fileobj *f;
+	loff_t off;
+};
+
+struct vtfs_image_save {
+	struct vtfs_fs *fs;
+	struct file *out;
+	struct vtfs_image_dir *dirs;	/* breadth first, root first */
+	size_t nr_dirs, dirs_cap;
+	struct vtfs_image_moved *moved;
+	size_t nr_moved, moved_cap;
+	struct xarray owners;		/* ino -> record, for hard links */
+	u64 nr_nodes;
+	u64 names_len;
+	loff_t data;			/* where the next extent goes */
+};
+
+/* Makes room for one more element of @size in *@arr. */
+static int vtfs_image_grow(void **arr, size_t nr, size_t *cap, size_t size)
+{
+	size_t new_cap = *cap ? *cap * 2 : 64;
+	void *p;
+
+	if (nr < *cap)
+		return 0;
+	p = kvmalloc_array(new_cap, size, GFP_KERNEL);
+	if (!p)
+		return -ENOMEM;
+	if (*arr)
+		memcpy(p, *arr, nr * size);
+	kvfree(*arr);
+	*arr = p;
+	*cap = new_cap;
+	return 0;
+}
+
+/* First pass: lists the directories and sizes the node and name tables. */
+static int vtfs_image_scan(struct vtfs_image_save *s)
+{
+	struct vtfs_node *child;
+	unsigned long idx;
+	size_t i;
+	int err;
+
+	err = vtfs_image_grow((void **)&s->dirs, 0, &s->dirs_cap,
+	                      sizeof(*s->dirs));
+	if (err)
+		return err;
+	s->dirs[0].dir = s->fs->root;
+	s->dirs[0].index = 0;
+	s->nr_dirs = 1;
+	s->nr_nodes = 1;
+
+	for (i = 0; i < s->nr_dirs; i++) {
+		xa_for_each(&s->dirs[i].dir->entries, idx, child) {
+			s->nr_nodes++;
+			s->names_len += strlen(child->name);
+			if (!vtfs_is_dir(child))
+				continue;
+
+			err = vtfs_image_grow((void **)&s->dirs, s->nr_dirs,
+			                      &s->dirs_cap, sizeof(*s->dirs));
+			if (err)
+				return err;
+			s->dirs[s->nr_dirs++].dir = child;
+		}
+	}
+	return 0;
+}
+
+/* Copies an extent the previous image still holds into the new one. */
+static int vtfs_image_copy(struct file *in, loff_t in_off, struct file *out,
+                           loff_t out_off, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = vfs_copy_file_range(in, in_off, out, out_off, len, 0);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			break;	/* a hole up to the end of the old image */
+		in_off += ret;
+		out_off += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int vtfs_image_save_data(struct vtfs_image_save *s,
+                                struct vtfs_fileobj *f, loff_t off)
+{
+	struct vtfs_image_moved *m;
+	loff_t old = READ_ONCE(f->image_off);
+	int err;
+
+	if (!old)
+		return vtfs_fileobj_save(f, s->out, off);
+
+	err = vtfs_image_copy(s->fs->image, old, s->out, off, f->size);
+	if (err)
+		return err;
+	err = vtfs_image_grow((void **)&s->moved, s->nr_moved, &s->moved_cap,
+	                      sizeof(*s->moved));
+	if (err)
+		return err;
+	m = &s->moved[s->nr_moved++];
+	m->f = f;
+	m->off = off;
+	return 0;
+}
+
+static int vtfs_image_save_node(struct vtfs_image_save *s,
+                                struct vtfs_image_io *nio,
+                                struct vtfs_image_io *sio,
+                                struct vtfs_node *n, u64 index, u64 parent)
+{
+	struct vtfs_image_node rec = {};
+	struct vtfs_fileobj *f = n->f;
+	size_t len = strlen(n->name);
+	u64 link = index;
+	void *owner;
+	int err;
+
+	rec.ino = cpu_to_le64(n->ino);
+	rec.parent = cpu_to_le64(parent);
+	rec.mode = cpu_to_le32(n->mode);
+	rec.name_len = cpu_to_le16(len);
+
+	if (f && atomic_read(&f->nlink) > 1) {
+		owner = xa_load(&s->owners, n->ino);
+		if (owner) {
+			link = xa_to_value(owner);
+		} else {
+			err = xa_err(xa_store(&s->owners, n->ino,
+			                      xa_mk_value(index), GFP_KERNEL));
+			if (err)
+				return err;
+			rec.flags = cpu_to_le16(VTFS_IMAGE_LINKED);
+		}
+	}
+	rec.link = cpu_to_le64(link);
+
+	if (f && link == index && f->size) {
+		rec.size = cpu_to_le64(f->size);
+		rec.data = cpu_to_le64(s->data);
+		err = vtfs_image_save_data(s, f, s->data);
+		if (err)
+			return err;
+		s->data += round_up(f->size, PAGE_SIZE);
+	}
+
+	err = vtfs_image_put(nio, &rec, sizeof(rec));
+	if (err)
+		return err;
+	return vtfs_image_put(sio, n->name, len);
+}
+
+/* Second pass: writes the records, names and contents in the same order. */
+static int vtfs_image_write(struct vtfs_image_save *s)
+{
+	struct vtfs_image_hdr hdr = {};
+	struct vtfs_image_io nio, sio;
+	struct vtfs_node *child;
+	unsigned long idx;
+	size_t i, next_dir = 1;
+	u64 index = 1;
+	loff_t pos = 0;
+	ssize_t ret;
+	int err;
+
+	hdr.magic = cpu_to_le64(VTFS_IMAGE_MAGIC);
+	hdr.version = cpu_to_le32(VTFS_IMAGE_VERSION);
+	hdr.next_ino = cpu_to_le64(atomic64_read(&s->fs->next_ino) + 1);
+	hdr.nr_nodes = cpu_to_le64(s->nr_nodes);
+	hdr.nodes_off = cpu_to_le64(sizeof(hdr));
+	hdr.names_off = cpu_to_le64(sizeof(hdr) +
+	                            s->nr_nodes * sizeof(struct vtfs_image_node));
+	hdr.names_len = cpu_to_le64(s->names_len);
+	s->data = round_up(le64_to_cpu(hdr.names_off) + s->names_len, PAGE_SIZE);
+	hdr.data_off = cpu_to_le64(s->data);
+
+	err = vtfs_image_io_init(&nio, s->out, le64_to_cpu(hdr.nodes_off));
+	if (err)
+		return err;
+	err = vtfs_image_io_init(&sio, s->out, le64_to_cpu(hdr.names_off));
+	if (err)
+		goto free_nio;
+
+	err = vtfs_image_save_node(s, &nio, &sio, s->fs->root, 0, 0);
+	for (i = 0; !err && i < s->nr_dirs; i++) {
+		xa_for_each(&s->dirs[i].dir->entries, idx, child) {
+			if (vtfs_is_dir(child))
+				s->dirs[next_dir++].index = index;
+			err = vtfs_image_save_node(s, &nio, &sio, child, index++,
+			                           s->dirs[i].index);
+			if (err)
+				break;
+		}
+	}
+	if (!err)
+		err = vtfs_image_flush(&nio);
+	if (!err)
+		err = vtfs_image_flush(&sio);
+	if (!err) {
+		ret = kernel_write(s->out, &hdr, sizeof(hdr), &pos);
+		if (ret != sizeof(hdr))
+			err = ret < 0 ? ret : -EIO;
+	}
+
+	kvfree(sio.buf);
+free_nio:
+	kvfree(nio.buf);
+	return err;
+}
+
+/*
+ * Removes @name, left in @dir by a save that failed, unless it is a
+ * directory.
+ */
+static int vtfs_image_unlink(const struct path *dir, const char *name)
+{
+	struct inode *inode = d_inode(dir->dentry);
+	struct dentry *dentry;
+	int err;
+
+	err = mnt_want_write(dir->mnt);
+	if (err)
+		return err;
+
+	inode_lock_nested(inode, I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, dir->dentry, strlen(name));
+	err = PTR_ERR_OR_ZERO(dentry);
+	if (!err) {
+		if (d_is_dir(dentry))
+			err = -EISDIR;
+		else if (d_is_positive(dentry))
+			err = vfs_unlink(mnt_idmap(dir->mnt), inode, dentry, NULL);
+		dput(dentry);
+	}
+	inode_unlock(inode);
+
+	mnt_drop_write(dir->mnt);
+	return err;
+}
+
+/*
+ * Creates @name afresh in the image's directory, for a save to write.
+ * Whatever is there already, a symlink included, is removed rather than
+ * opened.
+ */
+static struct file *vtfs_image_create(struct super_block *sb, const char *name)
+{
+	const struct path *dir = &vtfs_fs(sb)->image_dir;
+	int flags = O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_LARGEFILE;
+	struct file *file;
+	int err;
+
+	file = file_open_root(dir, name, flags, 0600);
+	if (PTR_ERR(file) == -EEXIST) {
+		err = vtfs_image_unlink(dir, name);
+		file = err ? ERR_PTR(err) : file_open_root(dir, name, flags, 0600);
+	}
+	return vtfs_image_check(sb, file);
+}
+
+/* Renames @file, created in @dir, over @name there. */
+static int vtfs_image_replace(const struct path *dir, struct file *file,
+                              const char *name)
+{
+	struct dentry *dentry = file->f_path.dentry;
+	struct renamedata rd = {};
+	struct dentry *trap, *target;
+	int err;
+
+	err = mnt_want_write(dir->mnt);
+	if (err)
+		return err;
+
+	trap = lock_rename(dir->dentry, dir->dentry);
+	if (IS_ERR(trap)) {
+		err = PTR_ERR(trap);
+		goto out;
+	}
+	if (dentry->d_parent != dir->dentry) {
+		err = -EBUSY;	/* moved away meanwhile */
+		goto unlock;
+	}
+
+	target = lookup_one_len(name, dir->dentry, strlen(name));
+	if (IS_ERR(target)) {
+		err = PTR_ERR(target);
+		goto unlock;
+	}
+
+	rd.old_mnt_idmap = mnt_idmap(dir->mnt);
+	rd.old_dir = d_inode(dir->dentry);
+	rd.old_dentry = dentry;
+	rd.new_mnt_idmap = rd.old_mnt_idmap;
+	rd.new_dir = d_inode(dir->dentry);
+	rd.new_dentry = target;
+	err = vfs_rename(&rd);
+	dput(target);
+
+unlock:
+	unlock_rename(dir->dentry, dir->dentry);
+out:
+	mnt_drop_write(dir->mnt);
+	return err;
+}
+
+/*
+ * Writes the whole tree to the image= file.  Nothing may change the tree
+ * meanwhile: the caller holds it frozen, or it is being unmounted.
+ */
+int vtfs_image_save(struct super_block *sb)
+{
+	struct vtfs_fs *fs = vtfs_fs(sb);
+	const char *path = fs->opts.image;
+	struct vtfs_image_save s = { .fs = fs };
+	struct file *old;
+	char *tmp;
+	size_t i;
+	int err;
+
+	if (!path)
+		return -EINVAL;
+
+	tmp = kasprintf(GFP_KERNEL, "%s.tmp", kbasename(path));
+	if (!tmp)
+		return -ENOMEM;
+	s.out = vtfs_image_create(sb, tmp);
+	if (IS_ERR(s.out)) {
+		err = PTR_ERR(s.out);
+		goto free_tmp;
+	}
+	xa_init(&s.owners);
+
+	err = vtfs_image_scan(&s);
+	if (!err)
+		err = vtfs_image_write(&s);
+	if (!err)
+		err = vfs_fsync(s.out, 0);
+	if (!err)
+		err = vtfs_image_replace(&fs->image_dir, s.out, kbasename(path));
+
+	/* files not loaded yet now read from the new image */
+	if (!err && fs->image) {
+		down_write(&fs->image_sem);
+		for (i = 0; i < s.nr_moved; i++)
+			vtfs_fileobj_move_image(s.moved[i].f, s.moved[i].off);
+		old = fs->image;
+		fs->image = s.out;
+		s.out = old;
+		up_write(&fs->image_sem);
+	}
+
+	xa_destroy(&s.owners);
+	kvfree(s.moved);
+	kvfree(s.dirs);
+	fput(s.out);
+free_tmp:
+	kfree(tmp);
+	if (err)
+		pr_err("[vtfs] saving image %s failed: %d\n", path, err);
+	return err;
+}
+
+/* umount: saves the tree one last time and lets go of the image. */
+void vtfs_image_destroy(struct super_block *sb)
+{
+	struct vtfs_fs *fs = vtfs_fs(sb);
+
+	if (!fs || !fs->opts.image)
+		return;
+
+	if (fs->root)
+		vtfs_image_save(sb);
+	if (fs->image)
+		fput(fs->image);
+	fs->image = NULL;
+	path_put(&fs->image_dir);
+	fs->image_dir = (struct path){};
+	kfree(fs->opts.image);
+	fs->opts.image = NULL;
+}
+
+/* VTFS_IOC_SAVE: a snapshot of the mount as it is now. */
+long vtfs_image_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	int err;
+
+	if (cmd != VTFS_IOC_SAVE)
+		return -ENOTTY;
+	if (!ns_capable(sb->s_user_ns, CAP_SYS_ADMIN))
+		return -EPERM;
+	if (!vtfs_fs(sb)->opts.image)
+		return -EINVAL;
+
+	err = freeze_super(sb, FREEZE_HOLDER_KERNEL);
+	if (err)
+		return err;
+	err = vtfs_image_save(sb);
+	thaw_super(sb, FREEZE_HOLDER_KERNEL);
+	return err;
+}
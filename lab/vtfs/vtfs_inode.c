@@ -14,68 +14,70 @@ struct inode *vtfs_inode_from_node(struct super_block *sb, struct vtfs_node *nod
 	if (!node)
 		return NULL;
 
-	inode = new_inode(sb);
+	inode = iget_locked(sb, node->ino);
 	if (!inode)
 		return NULL;
 
+	if (!(inode->i_state & I_NEW))
+		return inode;
+
 	mode = vtfs_force_mode(node->mode);
 	node->mode = mode;
 
 	inode_init_owner(&nop_mnt_idmap, inode, NULL, mode);
 	inode->i_mode = mode;
 
-	inode->i_ino = node->ino;
 	inode_set_ctime_current(inode);
 
 	if (S_ISDIR(mode)) {
+		/* the inode keeps the node alive until eviction */
+		atomic_inc(&node->refcnt);
 		inode->i_private = node;
 		inode->i_op  = &vtfs_dir_iops;
 		inode->i_fop = &vtfs_dir_fops;
 		set_nlink(inode, 2);
 	} else {
-		inode->i_private = node->f;     
-		inode->i_fop = &vtfs_file_fops;
-		set_nlink(inode, 1);
-	}
-
-
-	if (S_ISDIR(mode)) {
-		inode->i_op  = &vtfs_dir_iops;
-		inode->i_fop = &vtfs_dir_fops;
-		set_nlink(inode, 2);
-	} else {
+		/* the inode keeps the fileobj alive until eviction */
+		atomic_inc(&node->f->refcnt);
+		inode->i_private = node->f;
+		inode->i_op  = &vtfs_file_iops;
 		inode->i_fop = &vtfs_file_fops;
-		set_nlink(inode, 1);
+		inode->i_mapping->a_ops = &vtfs_aops;
+		mutex_lock(&node->f->lock);
+		vtfs_fileobj_set_mapping(node->f, inode->i_mapping);
+		mutex_unlock(&node->f->lock);
+		inode->i_size = node->f->size;
+		set_nlink(inode, atomic_read(&node->f->nlink));
 	}
 
+	unlock_new_inode(inode);
 	return inode;
 }
+
 int vtfs_link(struct dentry *old_dentry,
               struct inode *parent_dir,
               struct dentry *new_dentry)
 {
     struct super_block *sb = parent_dir->i_sb;
     struct vtfs_node *parent = parent_dir->i_private;
-    struct vtfs_node *target;
+    struct inode *inode = d_inode(old_dentry);
     int ret;
 
     if (!parent)
         return -EINVAL;
 
-    target = vtfs_store_lookup(sb, parent, old_dentry->d_name.name);
-    if (!target)
-        return -ENOENT;
-
-    if (!S_ISREG(target->mode))
+    if (!S_ISREG(inode->i_mode))
         return -EPERM;
 
-    ret = vtfs_store_link(sb, parent, new_dentry->d_name.name, target);
+    ret = vtfs_store_link(sb, parent, new_dentry->d_name.name,
+                          inode->i_private, inode->i_ino);
     if (ret)
         return ret;
 
-    inc_nlink(d_inode(old_dentry));
-    ihold(d_inode(old_dentry));
-    d_add(new_dentry, d_inode(old_dentry));
+    inc_nlink(inode);
+    ihold(inode);
+    d_instantiate(new_dentry, inode);
+    vtfs_dentry_stamp(new_dentry);
 
     return 0;
 }
\ No newline at end of file
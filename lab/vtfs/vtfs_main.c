@@ -1,13 +1,23 @@
 #include "vtfs.h"
 #include <linux/printk.h>
+#include <linux/rcupdate.h>
 
 static int __init vtfs_init(void)
 {
 	int ret;
 
 	pr_info("[vtfs] init\n");
+	ret = vtfs_store_cache_init();
+	if (ret)
+		return ret;
+	vtfs_stats_module_init();
+
 	ret = register_filesystem(&vtfs_fs_type);
 	pr_info("[vtfs] register_filesystem ret=%d\n", ret);
+	if (ret) {
+		vtfs_stats_module_exit();
+		vtfs_store_cache_destroy();
+	}
 	return ret;
 }
 
@@ -16,6 +26,9 @@ static void __exit vtfs_exit(void)
 	int ret;
 
 	ret = unregister_filesystem(&vtfs_fs_type);
+	rcu_barrier();
+	vtfs_stats_module_exit();
+	vtfs_store_cache_destroy();
 	pr_info("[vtfs] exit unregister_filesystem ret=%d\n", ret);
 }
 
@@ -0,0 +1,677 @@
+#include "vtfs.h"
+#include "source/http.h"
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/errno.h>
+#include <linux/workqueue.h>
+#include <linux/spinlock.h>
+#include "vtfs_trace.h"
+
+/*
+ * Remote mode mirrors the tree to the vtfs server.  The in-RAM store
+ * stays the working copy: names are created and removed on the server
+ * first, lookups that miss locally ask the server, and file contents
+ * are fetched on first open and written through as they change.
+ *
+ * Every request goes over the superblock's keep-alive connection pool,
+ * either as an HTTP GET with percent-encoded arguments or, with the
+ * "binary" mount option, as a vtfs_bin_req frame carrying the name and
+ * raw file data.  HTTP responses carry an int64 status (0, or a positive
+ * errno), binary ones a vtfs_bin_resp; both are followed by the
+ * little-endian payloads described below.
+ *
+ * With write-back on, file writes only extend the fileobj's dirty range
+ * and queue it on the superblock's dirty list.  A per-superblock worker
+ * flushes the list once VTFS_WB_DIRTY_MAX bytes were written or
+ * VTFS_WB_INTERVAL after the first write, whichever comes first; fsync
+ * flushes one file and umount flushes everything.  Each queued fileobj
+ * holds a reference, so unlinked files still get flushed (and the
+ * server's ENOENT is then ignored).
+ */
+
+#define VTFS_REMOTE_IO_MAX	(64 * 1024)
+#define VTFS_REMOTE_WRITE_MAX	(16 * 1024)	/* before percent-encoding */
+#define VTFS_REMOTE_LIST_MIN	(64 * 1024)
+#define VTFS_REMOTE_LIST_MAX	(16 * 1024 * 1024)
+
+#define VTFS_WB_DIRTY_MAX	(4 * 1024 * 1024)
+#define VTFS_WB_INTERVAL	(HZ / 2)
+
+struct vtfs_wire_attr {
+	__le64 ino;
+	__le32 mode;
+	__le32 reserved;
+	__le64 size;
+} __packed;
+
+/* binary protocol ops; ino and arg[] as noted */
+enum vtfs_bin_op {
+	VTFS_OP_LOOKUP = 1,	/* parent, name */
+	VTFS_OP_CREATE,		/* parent, name */
+	VTFS_OP_MKDIR,		/* parent, name */
+	VTFS_OP_UNLINK,		/* parent, name */
+	VTFS_OP_RMDIR,		/* parent, name */
+	VTFS_OP_LINK,		/* ino, arg[0] = parent, name */
+	VTFS_OP_LIST,		/* ino */
+	VTFS_OP_READ,		/* ino, arg[0] = offset, arg[1] = length */
+	VTFS_OP_WRITE,		/* ino, arg[0] = offset, data */
+	VTFS_OP_TRUNCATE,	/* ino, arg[0] = size */
+};
+
+static const char *const vtfs_bin_op_names[] = {
+	[VTFS_OP_LOOKUP]   = "lookup",
+	[VTFS_OP_CREATE]   = "create",
+	[VTFS_OP_MKDIR]    = "mkdir",
+	[VTFS_OP_UNLINK]   = "unlink",
+	[VTFS_OP_RMDIR]    = "rmdir",
+	[VTFS_OP_LINK]     = "link",
+	[VTFS_OP_LIST]     = "list",
+	[VTFS_OP_READ]     = "read",
+	[VTFS_OP_WRITE]    = "write",
+	[VTFS_OP_TRUNCATE] = "truncate",
+};
+
+/* "list" returns __le32 count followed by count of these */
+struct vtfs_wire_dirent {
+	struct vtfs_wire_attr attr;
+	__le16 name_len;
+	char name[];
+} __packed;
+
+struct vtfs_remote {
+	struct vtfs_http_pool pool;
+	struct super_block *sb;
+	struct vtfs_fs *fs;
+	bool binary;
+
+	bool writeback;
+	spinlock_t dirty_lock;		/* protects dirty_list and dirty_bytes */
+	struct list_head dirty_list;
+	size_t dirty_bytes;		/* written since the last flush */
+	struct mutex flush_lock;	/* one flusher at a time */
+	struct workqueue_struct *wq;
+	struct delayed_work flush_work;
+
+	size_t token_len;
+	char token[];
+};
+
+/*
+ * Maps what a call returned to the errno for userspace.  -EINTR is a
+ * signal while waiting for a pooled connection; a broken connection or a
+ * bad response is just -EIO.
+ */
+static int vtfs_remote_status(int64_t ret)
+{
+	if (ret > 0)
+		return -ret;	/* errno reported by the server */
+	if (ret == -ENOMEM || ret == -ENOSPC || ret == -EINTR)
+		return ret;
+	return ret ? -EIO : 0;
+}
+
+static void vtfs_wire_to_attr(const struct vtfs_wire_attr *w,
+                              struct vtfs_remote_attr *attr)
+{
+	attr->ino = le64_to_cpu(w->ino);
+	attr->mode = le32_to_cpu(w->mode);
+	attr->size = le64_to_cpu(w->size);
+}
+
+static void vtfs_remote_flush_work(struct work_struct *work)
+{
+	struct vtfs_remote *r = container_of(to_delayed_work(work),
+	                                     struct vtfs_remote, flush_work);
+
+	if (vtfs_remote_sync(r->fs, NULL))
+		queue_delayed_work(r->wq, &r->flush_work, VTFS_WB_INTERVAL);
+}
+
+static void vtfs_remote_observe(struct vtfs_http_pool *pool,
+                                const char *method, size_t sent,
+                                size_t received, u64 start, int64_t ret)
+{
+	struct vtfs_remote *r = container_of(pool, struct vtfs_remote, pool);
+	u64 ns = vtfs_stat_end(r->sb, VTFS_ST_REMOTE, start);
+
+	trace_vtfs_remote_call(r->sb, method, sent, received, ret, ns);
+	if (ret < 0)
+		vtfs_stat_remote_error(r->sb);
+}
+
+int vtfs_remote_init(struct super_block *sb,
+                     const struct vtfs_mount_opts *opts)
+{
+	struct vtfs_fs *fs = vtfs_fs(sb);
+	struct vtfs_remote *r;
+	int port, err;
+
+	r = kzalloc(struct_size(r, token, strlen(opts->token) + 1), GFP_KERNEL);
+	if (!r)
+		return -ENOMEM;
+	strcpy(r->token, opts->token);
+	r->token_len = strlen(opts->token);
+	r->sb = sb;
+	r->fs = fs;
+	r->binary = opts->binary;
+
+	r->writeback = opts->mode == VTFS_MODE_WRITEBACK;
+	spin_lock_init(&r->dirty_lock);
+	INIT_LIST_HEAD(&r->dirty_list);
+	mutex_init(&r->flush_lock);
+	INIT_DELAYED_WORK(&r->flush_work, vtfs_remote_flush_work);
+
+	if (r->writeback) {
+		r->wq = alloc_workqueue("vtfs-wb", WQ_MEM_RECLAIM | WQ_UNBOUND, 1);
+		if (!r->wq) {
+			kfree(r);
+			return -ENOMEM;
+		}
+	}
+
+	port = opts->port;
+	if (!port)
+		port = r->binary ? SERVER_BIN_PORT : SERVER_PORT;
+	err = vtfs_http_pool_init(&r->pool, opts->server, port, opts->pool);
+	if (err) {
+		if (r->wq)
+			destroy_workqueue(r->wq);
+		kfree(r);
+		return err;
+	}
+	r->pool.observe = vtfs_remote_observe;
+
+	fs->remote = r;
+	return 0;
+}
+
+void vtfs_remote_destroy(struct super_block *sb)
+{
+	struct vtfs_fs *fs = vtfs_fs(sb);
+	struct vtfs_remote *r;
+	struct vtfs_fileobj *f, *tmp;
+
+	if (!fs || !fs->remote)
+		return;
+	r = fs->remote;
+
+	if (r->writeback) {
+		cancel_delayed_work_sync(&r->flush_work);
+		if (vtfs_remote_sync(fs, NULL))
+			pr_warn("[vtfs] umount: unflushed writes are lost\n");
+		list_for_each_entry_safe(f, tmp, &r->dirty_list, dirty) {
+			list_del_init(&f->dirty);
+			vtfs_fileobj_put(f);
+		}
+		destroy_workqueue(r->wq);
+	}
+
+	vtfs_http_pool_destroy(&r->pool);
+	kfree(r);
+	fs->remote = NULL;
+}
+
+static char *vtfs_remote_encode(const char *name)
+{
+	char *enc = kmalloc(strlen(name) * 3 + 1, GFP_KERNEL);
+
+	if (enc)
+		encode(name, enc);
+	return enc;
+}
+
+/*
+ * One binary protocol request.  @name and @data go out from where they
+ * are and the payload lands directly in @resp: nothing is encoded or
+ * copied on the way.
+ */
+static int64_t vtfs_remote_bin(struct vtfs_remote *r, enum vtfs_bin_op op,
+                               ino_t ino, u64 arg0, u64 arg1,
+                               const char *name, const void *data,
+                               size_t data_len, void *resp, size_t resp_size,
+                               size_t *resp_len)
+{
+	size_t name_len = name ? strlen(name) : 0;
+	struct vtfs_bin_req req = {
+		.magic = cpu_to_le32(VTFS_BIN_MAGIC),
+		.op = cpu_to_le16(op),
+		.name_len = cpu_to_le16(name_len),
+		.token_len = cpu_to_le32(r->token_len),
+		.data_len = cpu_to_le32(data_len),
+		.ino = cpu_to_le64(ino),
+		.arg = { cpu_to_le64(arg0), cpu_to_le64(arg1) },
+	};
+	struct kvec vec[] = {
+		{ .iov_base = &req, .iov_len = sizeof(req) },
+		{ .iov_base = r->token, .iov_len = r->token_len },
+		{ .iov_base = (char *)name, .iov_len = name_len },
+		{ .iov_base = (void *)data, .iov_len = data_len },
+	};
+
+	return vtfs_bin_call(&r->pool, vtfs_bin_op_names[op], vec,
+	                     ARRAY_SIZE(vec), resp, resp_size, resp_len);
+}
+
+/* Requests of the form method(parent, name) with an optional attr reply. */
+static int vtfs_remote_name_call(struct vtfs_fs *fs, enum vtfs_bin_op op,
+                                 const char *method, ino_t parent,
+                                 const char *name,
+                                 struct vtfs_remote_attr *attr)
+{
+	struct vtfs_wire_attr w;
+	char parent_buf[24];
+	size_t len = 0;
+	int64_t ret;
+	char *enc;
+
+	if (fs->remote->binary) {
+		ret = vtfs_remote_bin(fs->remote, op, parent, 0, 0, name, NULL, 0,
+		                      &w, sizeof(w), &len);
+	} else {
+		enc = vtfs_remote_encode(name);
+		if (!enc)
+			return -ENOMEM;
+		snprintf(parent_buf, sizeof(parent_buf), "%lu", parent);
+
+		ret = vtfs_http_pool_call(&fs->remote->pool, fs->remote->token,
+		                          method, (char *)&w, sizeof(w), &len, 2,
+		                          "parent", parent_buf, "name", enc);
+		kfree(enc);
+	}
+
+	if (ret)
+		return vtfs_remote_status(ret);
+	if (attr) {
+		if (len < sizeof(w))
+			return -EIO;
+		vtfs_wire_to_attr(&w, attr);
+	}
+	return 0;
+}
+
+int vtfs_remote_lookup(struct vtfs_fs *fs, ino_t parent, const char *name,
+                       struct vtfs_remote_attr *attr)
+{
+	return vtfs_remote_name_call(fs, VTFS_OP_LOOKUP, "lookup", parent, name,
+	                             attr);
+}
+
+int vtfs_remote_create(struct vtfs_fs *fs, ino_t parent, const char *name,
+                       umode_t mode, struct vtfs_remote_attr *attr)
+{
+	if (S_ISDIR(mode))
+		return vtfs_remote_name_call(fs, VTFS_OP_MKDIR, "mkdir", parent,
+		                             name, attr);
+	return vtfs_remote_name_call(fs, VTFS_OP_CREATE, "create", parent, name,
+	                             attr);
+}
+
+int vtfs_remote_unlink(struct vtfs_fs *fs, ino_t parent, const char *name)
+{
+	return vtfs_remote_name_call(fs, VTFS_OP_UNLINK, "unlink", parent, name,
+	                             NULL);
+}
+
+int vtfs_remote_rmdir(struct vtfs_fs *fs, ino_t parent, const char *name)
+{
+	return vtfs_remote_name_call(fs, VTFS_OP_RMDIR, "rmdir", parent, name,
+	                             NULL);
+}
+
+int vtfs_remote_link(struct vtfs_fs *fs, ino_t ino, ino_t parent,
+                     const char *name)
+{
+	char ino_buf[24], parent_buf[24];
+	int64_t ret;
+	char *enc;
+
+	if (fs->remote->binary) {
+		ret = vtfs_remote_bin(fs->remote, VTFS_OP_LINK, ino, parent, 0,
+		                      name, NULL, 0, NULL, 0, NULL);
+		return vtfs_remote_status(ret);
+	}
+
+	enc = vtfs_remote_encode(name);
+	if (!enc)
+		return -ENOMEM;
+	snprintf(ino_buf, sizeof(ino_buf), "%lu", ino);
+	snprintf(parent_buf, sizeof(parent_buf), "%lu", parent);
+
+	ret = vtfs_http_pool_call(&fs->remote->pool, fs->remote->token, "link",
+	                          NULL, 0, NULL, 3, "ino", ino_buf,
+	                          "parent", parent_buf, "name", enc);
+	kfree(enc);
+
+	return vtfs_remote_status(ret);
+}
+
+int vtfs_remote_list(struct vtfs_fs *fs, ino_t ino,
+                     vtfs_remote_list_actor actor, void *ctx)
+{
+	const struct vtfs_wire_dirent *de;
+	struct vtfs_remote_attr attr;
+	size_t size = VTFS_REMOTE_LIST_MIN;
+	size_t len, off, name_len;
+	char ino_buf[24];
+	u32 count;
+	int64_t ret;
+	char *buf;
+	int err = 0;
+
+	snprintf(ino_buf, sizeof(ino_buf), "%lu", ino);
+
+	for (;;) {
+		buf = kvmalloc(size, GFP_KERNEL);
+		if (!buf)
+			return -ENOMEM;
+
+		if (fs->remote->binary)
+			ret = vtfs_remote_bin(fs->remote, VTFS_OP_LIST, ino, 0, 0,
+			                      NULL, NULL, 0, buf, size, &len);
+		else
+			ret = vtfs_http_pool_call(&fs->remote->pool,
+			                          fs->remote->token, "list", buf,
+			                          size, &len, 1, "ino", ino_buf);
+		if (ret != -ENOSPC || size >= VTFS_REMOTE_LIST_MAX)
+			break;
+
+		kvfree(buf);
+		size *= 4;
+	}
+
+	if (ret) {
+		err = vtfs_remote_status(ret);
+		goto out;
+	}
+	if (len < sizeof(__le32)) {
+		err = -EIO;
+		goto out;
+	}
+
+	count = le32_to_cpup((__le32 *)buf);
+	off = sizeof(__le32);
+	while (count--) {
+		if (off + sizeof(*de) > len) {
+			err = -EIO;
+			break;
+		}
+		de = (const struct vtfs_wire_dirent *)(buf + off);
+		name_len = le16_to_cpu(de->name_len);
+		if (!name_len || name_len > NAME_MAX ||
+		    off + sizeof(*de) + name_len > len) {
+			err = -EIO;
+			break;
+		}
+		off += sizeof(*de) + name_len;
+
+		vtfs_wire_to_attr(&de->attr, &attr);
+		err = actor(ctx, de->name, name_len, &attr);
+		if (err)
+			break;
+	}
+
+out:
+	kvfree(buf);
+	return err;
+}
+
+ssize_t vtfs_remote_read(struct vtfs_fs *fs, ino_t ino, loff_t pos,
+                         void *buf, size_t len)
+{
+	char ino_buf[24], pos_buf[24], len_buf[24];
+	size_t got = 0;
+	int64_t ret;
+
+	if (fs->remote->binary) {
+		ret = vtfs_remote_bin(fs->remote, VTFS_OP_READ, ino, pos, len,
+		                      NULL, NULL, 0, buf, len, &got);
+	} else {
+		snprintf(ino_buf, sizeof(ino_buf), "%lu", ino);
+		snprintf(pos_buf, sizeof(pos_buf), "%lld", pos);
+		snprintf(len_buf, sizeof(len_buf), "%zu", len);
+
+		ret = vtfs_http_pool_call(&fs->remote->pool, fs->remote->token,
+		                          "read", buf, len, &got, 3,
+		                          "ino", ino_buf, "offset", pos_buf,
+		                          "length", len_buf);
+	}
+	if (ret)
+		return vtfs_remote_status(ret);
+	return got;
+}
+
+int vtfs_remote_write(struct vtfs_fs *fs, ino_t ino, loff_t pos,
+                      const void *buf, size_t len)
+{
+	char ino_buf[24], pos_buf[24];
+	size_t n;
+	int64_t ret = 0;
+	char *enc;
+
+	if (fs->remote->binary) {
+		while (len && !ret) {
+			n = min_t(size_t, len, VTFS_REMOTE_IO_MAX);
+			ret = vtfs_remote_bin(fs->remote, VTFS_OP_WRITE, ino, pos, 0,
+			                      NULL, buf, n, NULL, 0, NULL);
+			buf += n;
+			pos += n;
+			len -= n;
+		}
+		return vtfs_remote_status(ret);
+	}
+
+	enc = kvmalloc(VTFS_REMOTE_WRITE_MAX * 3 + 1, GFP_KERNEL);
+	if (!enc)
+		return -ENOMEM;
+	snprintf(ino_buf, sizeof(ino_buf), "%lu", ino);
+
+	while (len) {
+		n = min_t(size_t, len, VTFS_REMOTE_WRITE_MAX);
+		encode_bytes(buf, n, enc);
+		snprintf(pos_buf, sizeof(pos_buf), "%lld", pos);
+
+		ret = vtfs_http_pool_call(&fs->remote->pool, fs->remote->token,
+		                          "write", NULL, 0, NULL, 3,
+		                          "ino", ino_buf, "offset", pos_buf,
+		                          "data", enc);
+		if (ret)
+			break;
+
+		buf += n;
+		pos += n;
+		len -= n;
+	}
+
+	kvfree(enc);
+	return vtfs_remote_status(ret);
+}
+
+int vtfs_remote_truncate(struct vtfs_fs *fs, ino_t ino, loff_t size)
+{
+	char ino_buf[24], size_buf[24];
+	int64_t ret;
+
+	if (fs->remote->binary) {
+		ret = vtfs_remote_bin(fs->remote, VTFS_OP_TRUNCATE, ino, size, 0,
+		                      NULL, NULL, 0, NULL, 0, NULL);
+		return vtfs_remote_status(ret);
+	}
+
+	snprintf(ino_buf, sizeof(ino_buf), "%lu", ino);
+	snprintf(size_buf, sizeof(size_buf), "%lld", size);
+
+	ret = vtfs_http_pool_call(&fs->remote->pool, fs->remote->token,
+	                          "truncate", NULL, 0, NULL, 2,
+	                          "ino", ino_buf, "size", size_buf);
+	return vtfs_remote_status(ret);
+}
+
+/*
+ * Extends @f's dirty range and makes sure @f is queued.  Returns true
+ * once enough has been written since the last flush to start one now.
+ */
+static bool vtfs_remote_mark_dirty(struct vtfs_remote *r, ino_t ino,
+                                   struct vtfs_fileobj *f,
+                                   loff_t pos, size_t len)
+{
+	bool over;
+
+	mutex_lock(&f->lock);
+	if (f->dirty_end > f->dirty_start) {
+		f->dirty_start = min(f->dirty_start, pos);
+		f->dirty_end = max_t(loff_t, f->dirty_end, pos + len);
+	} else {
+		f->dirty_start = pos;
+		f->dirty_end = pos + len;
+	}
+	f->remote_ino = ino;
+	mutex_unlock(&f->lock);
+
+	spin_lock(&r->dirty_lock);
+	if (list_empty(&f->dirty)) {
+		atomic_inc(&f->refcnt);
+		list_add_tail(&f->dirty, &r->dirty_list);
+	}
+	r->dirty_bytes += len;
+	over = r->dirty_bytes >= VTFS_WB_DIRTY_MAX;
+	spin_unlock(&r->dirty_lock);
+
+	return over;
+}
+
+/* Sends @f's dirty range; @f was already taken off the dirty list. */
+static int vtfs_remote_flush_one(struct vtfs_remote *r,
+                                 struct vtfs_fileobj *f, char *buf)
+{
+	loff_t pos, end;
+	size_t n;
+	int err = 0;
+
+	mutex_lock(&f->lock);
+	pos = f->dirty_start;
+	end = min(f->dirty_end, f->size);	/* truncated away meanwhile */
+	f->dirty_start = f->dirty_end = 0;
+	mutex_unlock(&f->lock);
+
+	while (pos < end) {
+		n = min_t(loff_t, end - pos, VTFS_REMOTE_IO_MAX);
+		err = vtfs_fileobj_read(f, pos, buf, n);
+		if (!err)
+			err = vtfs_remote_write(r->fs, f->remote_ino, pos, buf, n);
+		if (err == -ENOENT)
+			return 0;	/* unlinked on the server */
+		if (err) {
+			/* requeue the rest; the worker retries it later */
+			vtfs_remote_mark_dirty(r, f->remote_ino, f, pos, end - pos);
+			return err;
+		}
+		pos += n;
+	}
+	return 0;
+}
+
+/*
+ * Flushes @f, or every queued file if @f is NULL.  Files that fail stay
+ * queued and the first error is returned.
+ */
+int vtfs_remote_sync(struct vtfs_fs *fs, struct vtfs_fileobj *f)
+{
+	struct vtfs_remote *r = fs->remote;
+	LIST_HEAD(batch);
+	char *buf;
+	int err = 0, ret;
+
+	if (!r || !r->writeback)
+		return 0;
+
+	buf = kvmalloc(VTFS_REMOTE_IO_MAX, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	mutex_lock(&r->flush_lock);
+
+	spin_lock(&r->dirty_lock);
+	if (!f) {
+		list_splice_init(&r->dirty_list, &batch);
+		r->dirty_bytes = 0;
+	} else if (!list_empty(&f->dirty)) {
+		list_move(&f->dirty, &batch);
+	}
+	spin_unlock(&r->dirty_lock);
+
+	/*
+	 * A write racing with this either lands in the range flush_one
+	 * picks up, or finds the file off the list and requeues it.
+	 */
+	while (!list_empty(&batch)) {
+		spin_lock(&r->dirty_lock);
+		f = list_first_entry(&batch, struct vtfs_fileobj, dirty);
+		list_del_init(&f->dirty);
+		spin_unlock(&r->dirty_lock);
+
+		ret = vtfs_remote_flush_one(r, f, buf);
+		if (ret && !err)
+			err = ret;
+		vtfs_fileobj_put(f);
+	}
+
+	mutex_unlock(&r->flush_lock);
+	kvfree(buf);
+	return err;
+}
+
+/*
+ * Pushes [@pos, @pos + @len) of @f, whose data is @buf, to the server:
+ * right away, or in write-back mode by queueing it for the worker.
+ */
+int vtfs_remote_commit(struct vtfs_fs *fs, ino_t ino, struct vtfs_fileobj *f,
+                       loff_t pos, const void *buf, size_t len)
+{
+	struct vtfs_remote *r = fs->remote;
+
+	if (!r->writeback)
+		return vtfs_remote_write(fs, ino, pos, buf, len);
+
+	if (vtfs_remote_mark_dirty(r, ino, f, pos, len))
+		mod_delayed_work(r->wq, &r->flush_work, 0);
+	else
+		queue_delayed_work(r->wq, &r->flush_work, VTFS_WB_INTERVAL);
+	return 0;
+}
+
+/* Pulls the whole file into @f; caller holds the inode lock. */
+int vtfs_remote_fetch(struct vtfs_fs *fs, ino_t ino, struct vtfs_fileobj *f)
+{
+	loff_t size = f->size;
+	loff_t pos = 0;
+	ssize_t got;
+	char *buf;
+	int err;
+
+	if (!f->remote_pending)
+		return 0;
+
+	buf = kvmalloc(VTFS_REMOTE_IO_MAX, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	err = vtfs_fileobj_truncate(f, 0);
+	while (!err && pos < size) {
+		got = vtfs_remote_read(fs, ino, pos, buf,
+		                       min_t(loff_t, size - pos, VTFS_REMOTE_IO_MAX));
+		if (got <= 0) {
+			err = got ? got : -EIO;
+			break;
+		}
+		err = vtfs_fileobj_write(f, pos, buf, got);
+		pos += got;
+	}
+
+	if (err)
+		vtfs_fileobj_set_remote(f, size);	/* retry on next open */
+	else
+		f->remote_pending = false;
+
+	kvfree(buf);
+	return err;
+}
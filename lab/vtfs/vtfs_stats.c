@@ -0,0 +1,190 @@
+#include "vtfs.h"
+#include <linux/debugfs.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+
+#define CREATE_TRACE_POINTS
+#include "vtfs_trace.h"
+
+/*
+ * Per-mount counters, kept per CPU so that the hot paths only ever touch
+ * their own cache lines.  Each timed operation records a count, the total
+ * time, the bytes it moved (reads and writes) and a log2 histogram of its
+ * latency: bucket b holds calls that took [2^(b-1), 2^b) ns, the last one
+ * everything slower.
+ *
+ * Every mount gets /sys/kernel/debug/vtfs/<major>:<minor>/ with "stats"
+ * to read and "reset" to write.
+ */
+
+#define VTFS_STAT_BUCKETS 32
+
+struct vtfs_stats {
+	u64 count[VTFS_ST_NR];
+	u64 ns[VTFS_ST_NR];
+	u64 bytes[VTFS_ST_NR];
+	u64 hist[VTFS_ST_NR][VTFS_STAT_BUCKETS];
+	u64 remote_errors;
+};
+
+static const char *const vtfs_stat_names[VTFS_ST_NR] = {
+	[VTFS_ST_LOOKUP]    = "lookup",
+	[VTFS_ST_CREATE]    = "create",
+	[VTFS_ST_UNLINK]    = "unlink",
+	[VTFS_ST_MKDIR]     = "mkdir",
+	[VTFS_ST_RMDIR]     = "rmdir",
+	[VTFS_ST_LINK]      = "link",
+	[VTFS_ST_ITERATE]   = "iterate",
+	[VTFS_ST_GETATTR]   = "getattr",
+	[VTFS_ST_SETATTR]   = "setattr",
+	[VTFS_ST_OPEN]      = "open",
+	[VTFS_ST_READ]      = "read",
+	[VTFS_ST_WRITE]     = "write",
+	[VTFS_ST_MMAP]      = "mmap",
+	[VTFS_ST_FSYNC]     = "fsync",
+	[VTFS_ST_FALLOCATE] = "fallocate",
+	[VTFS_ST_LLSEEK]    = "llseek",
+	[VTFS_ST_REMAP]     = "remap",
+	[VTFS_ST_COPY]      = "copy_range",
+	[VTFS_ST_DIR_LOCK]  = "dir_lock_wait",
+	[VTFS_ST_ALLOC]     = "node_alloc",
+	[VTFS_ST_REMOTE]    = "remote_call",
+};
+
+static struct dentry *vtfs_debugfs_root;
+
+/* Returns the elapsed time, for callers that also trace it. */
+u64 vtfs_stat_end_bytes(struct super_block *sb, enum vtfs_stat_op op,
+                        u64 start, u64 bytes)
+{
+	struct vtfs_stats __percpu *st = vtfs_fs(sb)->stats;
+	u64 ns = ktime_get_ns() - start;
+	unsigned int b;
+
+	if (!st)
+		return ns;
+
+	b = min_t(unsigned int, fls64(ns), VTFS_STAT_BUCKETS - 1);
+	this_cpu_inc(st->count[op]);
+	this_cpu_add(st->ns[op], ns);
+	this_cpu_add(st->bytes[op], bytes);
+	this_cpu_inc(st->hist[op][b]);
+	return ns;
+}
+
+void vtfs_stat_remote_error(struct super_block *sb)
+{
+	struct vtfs_stats __percpu *st = vtfs_fs(sb)->stats;
+
+	if (st)
+		this_cpu_inc(st->remote_errors);
+}
+
+static int vtfs_stats_show(struct seq_file *m, void *v)
+{
+	struct vtfs_stats __percpu *st = m->private;
+	struct vtfs_stats *sum;
+	int cpu, op, b;
+
+	sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct vtfs_stats *c = per_cpu_ptr(st, cpu);
+
+		for (op = 0; op < VTFS_ST_NR; op++) {
+			sum->count[op] += c->count[op];
+			sum->ns[op] += c->ns[op];
+			sum->bytes[op] += c->bytes[op];
+			for (b = 0; b < VTFS_STAT_BUCKETS; b++)
+				sum->hist[op][b] += c->hist[op][b];
+		}
+		sum->remote_errors += c->remote_errors;
+	}
+
+	seq_printf(m, "%-14s %12s %16s %16s\n", "op", "count", "total_ns", "bytes");
+	for (op = 0; op < VTFS_ST_NR; op++)
+		seq_printf(m, "%-14s %12llu %16llu %16llu\n", vtfs_stat_names[op],
+		           sum->count[op], sum->ns[op], sum->bytes[op]);
+	seq_printf(m, "remote_errors %llu\n", sum->remote_errors);
+
+	for (op = 0; op < VTFS_ST_NR; op++) {
+		if (!sum->count[op])
+			continue;
+		seq_printf(m, "\n%s latency_ns:\n", vtfs_stat_names[op]);
+		for (b = 0; b < VTFS_STAT_BUCKETS; b++) {
+			if (!sum->hist[op][b])
+				continue;
+			if (b == VTFS_STAT_BUCKETS - 1)
+				seq_printf(m, "  >= %-12llu %llu\n",
+				           1ULL << (b - 1), sum->hist[op][b]);
+			else
+				seq_printf(m, "  <  %-12llu %llu\n",
+				           1ULL << b, sum->hist[op][b]);
+		}
+	}
+
+	kfree(sum);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vtfs_stats);
+
+static ssize_t vtfs_stats_reset(struct file *file, const char __user *buf,
+                                size_t len, loff_t *ppos)
+{
+	struct vtfs_stats __percpu *st = file_inode(file)->i_private;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(st, cpu), 0, sizeof(struct vtfs_stats));
+	return len;
+}
+
+static const struct file_operations vtfs_reset_fops = {
+	.owner = THIS_MODULE,
+	.open  = simple_open,
+	.write = vtfs_stats_reset,
+};
+
+void vtfs_stats_module_init(void)
+{
+	vtfs_debugfs_root = debugfs_create_dir("vtfs", NULL);
+}
+
+void vtfs_stats_module_exit(void)
+{
+	debugfs_remove_recursive(vtfs_debugfs_root);
+}
+
+/* Statistics are best effort: a mount without them works the same. */
+void vtfs_stats_init(struct super_block *sb)
+{
+	struct vtfs_fs *fs = vtfs_fs(sb);
+	char name[24];
+
+	fs->stats = alloc_percpu(struct vtfs_stats);
+	if (!fs->stats)
+		return;
+
+	snprintf(name, sizeof(name), "%u:%u", MAJOR(sb->s_dev), MINOR(sb->s_dev));
+	fs->debugfs = debugfs_create_dir(name, vtfs_debugfs_root);
+	debugfs_create_file("stats", 0444, fs->debugfs, fs->stats,
+	                    &vtfs_stats_fops);
+	debugfs_create_file("reset", 0200, fs->debugfs, fs->stats,
+	                    &vtfs_reset_fops);
+}
+
+void vtfs_stats_destroy(struct super_block *sb)
+{
+	struct vtfs_fs *fs = vtfs_fs(sb);
+
+	if (!fs || !fs->stats)
+		return;
+
+	debugfs_remove_recursive(fs->debugfs);
+	free_percpu(fs->stats);
+	fs->stats = NULL;
+}
@@ -2,6 +2,8 @@
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/errno.h>
+#include <linux/jhash.h>
+#include "vtfs_trace.h"
 
 struct vtfs_fs *vtfs_fs(struct super_block *sb)
 {
@@ -11,64 +13,379 @@ struct vtfs_fs *vtfs_fs(struct super_block *sb)
 static ino_t vtfs_next_ino(struct super_block *sb)
 {
 	struct vtfs_fs *fs = vtfs_fs(sb);
-	return fs->next_ino++;
+	return atomic64_inc_return(&fs->next_ino);
 }
 
-static void vtfs_fileobj_put(struct vtfs_fileobj *f)
+static u32 vtfs_name_hashfn(const void *data, u32 len, u32 seed)
 {
-	if (!f)
-		return;
+	const char *name = data;
+
+	return jhash(name, strlen(name), seed);
+}
+
+static u32 vtfs_node_hashfn(const void *data, u32 len, u32 seed)
+{
+	const struct vtfs_node *n = data;
+
+	return jhash(n->name, strlen(n->name), seed);
+}
+
+static int vtfs_node_cmpfn(struct rhashtable_compare_arg *arg, const void *obj)
+{
+	const struct vtfs_node *n = obj;
+
+	return strcmp(n->name, arg->key) != 0;
+}
 
-	if (atomic_dec_and_test(&f->refcnt)) {
-		kfree(f->data);
-		kfree(f);
+static const struct rhashtable_params vtfs_index_params = {
+	.head_offset = offsetof(struct vtfs_node, hnode),
+	.hashfn = vtfs_name_hashfn,
+	.obj_hashfn = vtfs_node_hashfn,
+	.obj_cmpfn = vtfs_node_cmpfn,
+	.nelem_hint = 2,
+	.automatic_shrinking = true,
+};
+
+/* Caller holds rcu_read_lock() or parent->rwsem. */
+static struct vtfs_node *vtfs_index_find(struct vtfs_node *parent,
+                                         const char *name)
+{
+	return rhashtable_lookup(&parent->index, name, vtfs_index_params);
+}
+
+/*
+ * Caller holds parent->rwsem for writing.  Besides the name index, every
+ * child gets a readdir cookie that is never reused within the directory,
+ * so a getdents call can resume right after the last entry it returned.
+ */
+static int vtfs_dir_add(struct vtfs_node *parent, struct vtfs_node *child)
+{
+	int err;
+
+	err = rhashtable_lookup_insert_key(&parent->index, child->name,
+	                                   &child->hnode, vtfs_index_params);
+	if (err)
+		return err;
+
+	child->cookie = parent->next_cookie;
+	err = xa_insert(&parent->entries, child->cookie, child,
+	                GFP_KERNEL_ACCOUNT);
+	if (err) {
+		rhashtable_remove_fast(&parent->index, &child->hnode,
+		                       vtfs_index_params);
+		return err;
 	}
+	parent->next_cookie++;
+
+	return 0;
 }
 
+/* Caller holds parent->rwsem for writing. */
+static void vtfs_dir_remove(struct vtfs_node *parent, struct vtfs_node *child)
+{
+	rhashtable_remove_fast(&parent->index, &child->hnode, vtfs_index_params);
+	xa_erase(&parent->entries, child->cookie);
+}
+
+/* down_write on a directory, counting the wait in the statistics */
+static void vtfs_dir_lock(struct super_block *sb, struct vtfs_node *dir)
+{
+	u64 start = vtfs_stat_start();
+
+	down_write(&dir->rwsem);
+	trace_vtfs_dir_lock(sb, dir->ino, vtfs_stat_end(sb, VTFS_ST_DIR_LOCK, start));
+	dir->locked_at = ktime_get_ns();
+}
+
+static void vtfs_dir_unlock(struct super_block *sb, struct vtfs_node *dir)
+{
+	u64 held = ktime_get_ns() - dir->locked_at;
+
+	up_write(&dir->rwsem);
+	trace_vtfs_dir_unlock(sb, dir->ino, held);
+}
+
+static struct kmem_cache *vtfs_dir_cachep;
+static struct kmem_cache *vtfs_file_cachep;
+static struct kmem_cache *vtfs_link_cachep;
+
+int vtfs_store_cache_init(void)
+{
+	vtfs_dir_cachep = kmem_cache_create("vtfs_dir_node",
+	                                    sizeof(struct vtfs_node),
+	                                    0, SLAB_ACCOUNT, NULL);
+	vtfs_file_cachep = kmem_cache_create("vtfs_file_node",
+	                                     offsetofend(struct vtfs_node, file),
+	                                     0, SLAB_ACCOUNT, NULL);
+	vtfs_link_cachep = kmem_cache_create("vtfs_link_node",
+	                                     offsetof(struct vtfs_node, file),
+	                                     0, SLAB_ACCOUNT, NULL);
+
+	if (!vtfs_dir_cachep || !vtfs_file_cachep || !vtfs_link_cachep) {
+		vtfs_store_cache_destroy();
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void vtfs_store_cache_destroy(void)
+{
+	kmem_cache_destroy(vtfs_link_cachep);
+	kmem_cache_destroy(vtfs_file_cachep);
+	kmem_cache_destroy(vtfs_dir_cachep);
+}
+
+static struct kmem_cache *vtfs_node_cachep(struct vtfs_node *n)
+{
+	if (S_ISDIR(n->mode))
+		return vtfs_dir_cachep;
+	if (n->f == &n->file)
+		return vtfs_file_cachep;
+	return vtfs_link_cachep;
+}
+
+static void vtfs_node_free(struct vtfs_node *n)
+{
+	if (n->name != n->iname)
+		kfree(n->name);
+	kmem_cache_free(vtfs_node_cachep(n), n);
+}
+
+static void vtfs_node_free_rcu(struct rcu_head *head)
+{
+	vtfs_node_free(container_of(head, struct vtfs_node, rcu));
+}
+
+/* Called once the fileobj embedded in a file node drops its last ref. */
+void vtfs_store_fileobj_free(struct vtfs_fileobj *f)
+{
+	struct vtfs_node *n = container_of(f, struct vtfs_node, file);
+
+	percpu_counter_dec(&f->fs->used_inodes);
+	call_rcu(&n->rcu, vtfs_node_free_rcu);
+}
+
+/*
+ * @f is NULL for directories and for the first name of a file, which
+ * gets a fresh fileobj; extra hard links pass the fileobj they share.
+ * Only the former count against nr_inodes.  Returns an ERR_PTR on
+ * failure.
+ */
 static struct vtfs_node *vtfs_node_alloc(struct super_block *sb,
                                          struct vtfs_node *parent,
                                          const char *name,
-                                         umode_t mode)
+                                         umode_t mode,
+                                         struct vtfs_fileobj *f)
 {
+	struct vtfs_fs *fs = vtfs_fs(sb);
+	struct kmem_cache *cachep;
 	struct vtfs_node *n;
+	size_t len = strlen(name);
+	u64 start;
+	int err;
+
+	if (S_ISDIR(mode))
+		cachep = vtfs_dir_cachep;
+	else
+		cachep = f ? vtfs_link_cachep : vtfs_file_cachep;
+
+	if (!f) {
+		err = vtfs_charge(&fs->used_inodes, fs->max_inodes, 1);
+		if (err)
+			return ERR_PTR(err);
+	}
 
-	n = kzalloc(sizeof(*n), GFP_KERNEL);
+	start = vtfs_stat_start();
+	n = kmem_cache_zalloc(cachep, GFP_KERNEL_ACCOUNT);
+	vtfs_stat_end(sb, VTFS_ST_ALLOC, start);
 	if (!n)
-		return NULL;
-
-	n->name = kstrdup(name, GFP_KERNEL);
-	if (!n->name) {
-		kfree(n);
-		return NULL;
-	}
+		goto fail;
 
 	n->mode = mode;
 	n->ino = vtfs_next_ino(sb);
 	n->parent = parent;
-	n->f = NULL;
+	n->f = f;
 
-	INIT_LIST_HEAD(&n->children);
-	INIT_LIST_HEAD(&n->siblings);
+	if (S_ISREG(mode) && !f) {
+		vtfs_fileobj_init(&n->file, fs);
+		n->f = &n->file;
+	}
+
+	if (len < VTFS_INLINE_NAME_LEN) {
+		memcpy(n->iname, name, len + 1);
+		n->name = n->iname;
+	} else {
+		n->name = kstrdup(name, GFP_KERNEL_ACCOUNT);
+		if (!n->name) {
+			kmem_cache_free(cachep, n);
+			goto fail;
+		}
+	}
+
+	if (S_ISDIR(mode)) {
+		xa_init(&n->entries);
+		n->next_cookie = VTFS_FIRST_COOKIE;
+		init_rwsem(&n->rwsem);
+		n->fs = fs;
+		atomic_set(&n->refcnt, 1);
+		if (rhashtable_init(&n->index, &vtfs_index_params)) {
+			vtfs_node_free(n);
+			goto fail;
+		}
+	}
 
 	return n;
+
+fail:
+	if (!f)
+		percpu_counter_dec(&fs->used_inodes);
+	return ERR_PTR(-ENOMEM);
+}
+
+static void vtfs_node_release(struct vtfs_node *n);
+
+/*
+ * Caller holds parent->rwsem for writing.  Unlike vtfs_dir_remove() plus
+ * a release, this is safe while the VFS holds the parent's i_rwsem only
+ * shared: a lookup there may have found @child and still be using it, so
+ * it is only queued, for vtfs_dir_purge() to release.
+ */
+static void vtfs_dir_unhash(struct vtfs_node *parent, struct vtfs_node *child)
+{
+	vtfs_dir_remove(parent, child);
+	child->stale_next = parent->stale;
+	parent->stale = child;
 }
 
-static void vtfs_node_free_recursive(struct vtfs_node *n)
+/*
+ * Caller holds parent->rwsem for writing, with either the VFS holding the
+ * parent's i_rwsem exclusively, as around create, unlink, rmdir and link,
+ * or nothing else able to see the directory any more.  Releases the
+ * children vtfs_dir_unhash() queued.
+ */
+static void vtfs_dir_purge(struct vtfs_node *parent)
 {
-	struct vtfs_node *child, *tmp;
+	struct vtfs_node *child;
 
-	list_for_each_entry_safe(child, tmp, &n->children, siblings) {
-		list_del(&child->siblings);
-		vtfs_node_free_recursive(child);
+	while ((child = parent->stale)) {
+		parent->stale = child->stale_next;
+		vtfs_node_release(child);
 	}
+}
+
+/*
+ * Drops a reference to a directory node: the parent's entry has one and
+ * its inode, whose i_private it is, another.  The last one releases the
+ * children a directory removed under a live inode may have picked up.
+ */
+void vtfs_store_dir_put(struct vtfs_node *dir)
+{
+	struct vtfs_node *child;
+	unsigned long idx;
+
+	if (!atomic_dec_and_test(&dir->refcnt))
+		return;
 
-	if (S_ISREG(n->mode) && n->f) {
-		vtfs_fileobj_put(n->f);
-		n->f = NULL;
+	xa_for_each(&dir->entries, idx, child)
+		vtfs_node_release(child);
+	xa_destroy(&dir->entries);
+	vtfs_dir_purge(dir);
+	rhashtable_destroy(&dir->index);
+	percpu_counter_dec(&dir->fs->used_inodes);
+	call_rcu(&dir->rcu, vtfs_node_free_rcu);
+}
+
+/*
+ * Lockless lookups may still be comparing against @n's name, so the node
+ * itself is only freed after a grace period.  A file node that embeds
+ * its fileobj lives on until the last link and inode drop that fileobj.
+ */
+static void vtfs_node_release(struct vtfs_node *n)
+{
+	struct vtfs_fileobj *f = n->f;
+
+	if (S_ISDIR(n->mode)) {
+		vtfs_store_dir_put(n);
+		return;
+	}
+
+	atomic_dec(&f->nlink);
+	if (f == &n->file) {
+		vtfs_fileobj_put(f);
+		return;
 	}
 
-	kfree(n->name);
-	kfree(n);
+	vtfs_fileobj_put(f);
+	call_rcu(&n->rcu, vtfs_node_free_rcu);
+}
+
+/*
+ * Remote mode: add a node for an entry the server already has.  If a
+ * racing lookup got there first, its node is returned instead.
+ */
+static struct vtfs_node *vtfs_store_add_remote(struct super_block *sb,
+                                               struct vtfs_node *parent,
+                                               const char *name,
+                                               const struct vtfs_remote_attr *attr)
+{
+	struct vtfs_node *child, *old = NULL;
+	umode_t mode;
+	int err;
+
+	mode = S_ISDIR(attr->mode) ? S_IFDIR | 0777 : S_IFREG | 0777;
+	child = vtfs_node_alloc(sb, parent, name, mode, NULL);
+	if (IS_ERR(child))
+		return child;
+
+	child->ino = attr->ino;
+	if (S_ISREG(mode))
+		vtfs_fileobj_set_remote(child->f, attr->size);
+
+	vtfs_dir_lock(sb, parent);
+	err = vtfs_dir_add(parent, child);
+	if (err == -EEXIST)
+		old = vtfs_index_find(parent, name);
+	vtfs_dir_unlock(sb, parent);
+
+	if (err) {
+		vtfs_node_release(child);
+		return old ?: ERR_PTR(err);
+	}
+	return child;
+}
+
+/*
+ * Image loading: adds a node while nothing else can see the tree yet,
+ * so without the directory lock.  @f is the fileobj of an earlier name
+ * for a hard link, NULL otherwise.
+ */
+struct vtfs_node *vtfs_store_insert(struct super_block *sb,
+                                    struct vtfs_node *parent,
+                                    const char *name,
+                                    umode_t mode,
+                                    ino_t ino,
+                                    struct vtfs_fileobj *f)
+{
+	struct vtfs_node *n;
+	int err;
+
+	n = vtfs_node_alloc(sb, parent, name, mode, f);
+	if (IS_ERR(n))
+		return n;
+
+	n->ino = ino;
+	if (f) {
+		atomic_inc(&f->refcnt);
+		atomic_inc(&f->nlink);
+	}
+
+	err = vtfs_dir_add(parent, n);
+	if (err) {
+		vtfs_node_release(n);
+		return ERR_PTR(err);
+	}
+	return n;
 }
 
 int vtfs_store_init(struct super_block *sb)
@@ -79,16 +396,21 @@ int vtfs_store_init(struct super_block *sb)
 	if (!fs)
 		return -ENOMEM;
 
-	mutex_init(&fs->lock);
-	fs->next_ino = 1001;
+	atomic64_set(&fs->next_ino, 1000);
+	fs->chunk_shift = VTFS_CHUNK_SHIFT;
+	init_rwsem(&fs->image_sem);
+	if (percpu_counter_init(&fs->used_blocks, 0, GFP_KERNEL))
+		goto free_fs;
+	if (percpu_counter_init(&fs->used_inodes, 0, GFP_KERNEL))
+		goto free_blocks;
 
 	sb->s_fs_info = fs;
 
-	fs->root = vtfs_node_alloc(sb, NULL, "", S_IFDIR | 0777);
-	if (!fs->root) {
+	fs->root = vtfs_node_alloc(sb, NULL, "", S_IFDIR | 0777, NULL);
+	if (IS_ERR(fs->root)) {
 		sb->s_fs_info = NULL;
-		kfree(fs);
-		return -ENOMEM;
+		percpu_counter_destroy(&fs->used_inodes);
+		goto free_blocks;
 	}
 
 	fs->root->ino = 1000;
@@ -97,6 +419,12 @@ int vtfs_store_init(struct super_block *sb)
 	fs->root->f = NULL;
 
 	return 0;
+
+free_blocks:
+	percpu_counter_destroy(&fs->used_blocks);
+free_fs:
+	kfree(fs);
+	return -ENOMEM;
 }
 
 void vtfs_store_destroy(struct super_block *sb)
@@ -106,13 +434,13 @@ void vtfs_store_destroy(struct super_block *sb)
 	if (!fs)
 		return;
 
-	mutex_lock(&fs->lock);
 	if (fs->root) {
-		vtfs_node_free_recursive(fs->root);
+		vtfs_node_release(fs->root);
 		fs->root = NULL;
 	}
-	mutex_unlock(&fs->lock);
 
+	percpu_counter_destroy(&fs->used_inodes);
+	percpu_counter_destroy(&fs->used_blocks);
 	kfree(fs);
 	sb->s_fs_info = NULL;
 }
@@ -123,26 +451,194 @@ struct vtfs_node *vtfs_store_root(struct super_block *sb)
 	return fs ? fs->root : NULL;
 }
 
+/*
+ * Remote mode, parent->rwsem held for write: drops a child the server no
+ * longer has.  A directory that still has cached children is kept.  The
+ * callers run under the parent's i_rwsem held shared at most, so the
+ * child is only unhashed, not released.
+ */
+static bool vtfs_store_forget(struct vtfs_node *parent, struct vtfs_node *child)
+{
+	if (vtfs_is_dir(child) && !xa_empty(&child->entries))
+		return false;
+
+	vtfs_dir_unhash(parent, child);
+	return true;
+}
+
+/*
+ * Remote mode: checks @name (ino @ino) in @parent against the server.
+ * Returns 1 with @attr filled in if it is still current, or 0 if the
+ * server no longer has it, or has a different file under that name; the
+ * local entry is then unhashed so that the lookup after d_invalidate()
+ * asks again.  Nothing is freed here: the parent's i_rwsem is not held.
+ */
+int vtfs_store_revalidate(struct super_block *sb,
+                          struct vtfs_node *parent,
+                          const char *name,
+                          ino_t ino,
+                          struct vtfs_remote_attr *attr)
+{
+	struct vtfs_fs *fs = vtfs_fs(sb);
+	struct vtfs_node *child;
+	int err, ret = 0;
+
+	err = vtfs_remote_lookup(fs, parent->ino, name, attr);
+	if (err && err != -ENOENT)
+		return err;
+	if (!err && attr->ino == ino)
+		return 1;
+
+	vtfs_dir_lock(sb, parent);
+	parent->listed = false;
+	child = vtfs_index_find(parent, name);
+	if (child && child->ino == ino && !vtfs_store_forget(parent, child))
+		ret = 1;
+	vtfs_dir_unlock(sb, parent);
+
+	return ret;
+}
+
+struct vtfs_fill_ctx {
+	struct super_block *sb;
+	struct vtfs_node *dir;
+	unsigned long gen;
+	vtfs_fill_fn fn;
+	void *fn_ctx;
+	char name[NAME_MAX + 1];
+};
+
+static int vtfs_fill_actor(void *ctx, const char *name, size_t len,
+                           const struct vtfs_remote_attr *attr)
+{
+	struct vtfs_fill_ctx *c = ctx;
+	struct vtfs_node *dir = c->dir;
+	struct vtfs_node *child;
+
+	if (!len || len > NAME_MAX)
+		return -EIO;
+	memcpy(c->name, name, len);
+	c->name[len] = '\0';
+
+	rcu_read_lock();
+	child = vtfs_index_find(dir, c->name);
+	rcu_read_unlock();
+
+	if (child && child->ino != attr->ino) {
+		/* replaced on the server since we last looked */
+		vtfs_dir_lock(c->sb, dir);
+		child = vtfs_index_find(dir, c->name);
+		if (child && child->ino != attr->ino &&
+		    vtfs_store_forget(dir, child))
+			child = NULL;
+		vtfs_dir_unlock(c->sb, dir);
+	}
+
+	if (!child) {
+		child = vtfs_store_add_remote(c->sb, dir, c->name, attr);
+		if (IS_ERR(child))
+			return PTR_ERR(child);
+	}
+
+	WRITE_ONCE(child->seen_gen, c->gen);
+	if (c->fn)
+		c->fn(c->fn_ctx, child, attr);
+	return 0;
+}
+
+/* Drops children that an earlier listing had and this one did not. */
+static void vtfs_store_prune(struct super_block *sb, struct vtfs_node *dir,
+                             unsigned long gen)
+{
+	struct vtfs_node *child;
+	unsigned long idx;
+
+	vtfs_dir_lock(sb, dir);
+	xa_for_each(&dir->entries, idx, child) {
+		if (child->seen_gen && child->seen_gen < gen)
+			vtfs_store_forget(dir, child);
+	}
+	vtfs_dir_unlock(sb, dir);
+}
+
+static bool vtfs_store_listed(struct vtfs_fs *fs, struct vtfs_node *dir)
+{
+	return READ_ONCE(dir->listed) &&
+	       time_before(jiffies, READ_ONCE(dir->list_time) + fs->attr_ttl);
+}
+
+/*
+ * Remote mode: instantiates every child the server lists for @dir, with
+ * its attributes, and calls @fn on each.  One round trip then answers
+ * all lookups in @dir, hits and misses alike, until actimeo runs out.
+ * Nothing is fetched while an earlier listing is still fresh.
+ */
+int vtfs_store_fill_dir(struct super_block *sb, struct vtfs_node *dir,
+                        vtfs_fill_fn fn, void *ctx)
+{
+	struct vtfs_fs *fs = vtfs_fs(sb);
+	struct vtfs_fill_ctx *c;
+	unsigned long start = jiffies;
+	int err;
+
+	if (!fs->remote || vtfs_store_listed(fs, dir))
+		return 0;
+
+	c = kmalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		return -ENOMEM;
+	c->sb = sb;
+	c->dir = dir;
+	c->gen = atomic_long_inc_return(&dir->list_gen);
+	c->fn = fn;
+	c->fn_ctx = ctx;
+
+	err = vtfs_remote_list(fs, dir->ino, vtfs_fill_actor, c);
+	if (!err) {
+		vtfs_store_prune(sb, dir, c->gen);
+		WRITE_ONCE(dir->list_time, start);
+		WRITE_ONCE(dir->listed, true);
+	}
+
+	kfree(c);
+	return err;
+}
+
 struct vtfs_node *vtfs_store_lookup(struct super_block *sb,
                                     struct vtfs_node *parent,
                                     const char *name)
 {
 	struct vtfs_fs *fs = vtfs_fs(sb);
+	struct vtfs_remote_attr attr;
 	struct vtfs_node *child;
+	int err;
 
 	if (!fs || !parent || !vtfs_is_dir(parent))
 		return NULL;
 
-	mutex_lock(&fs->lock);
-	list_for_each_entry(child, &parent->children, siblings) {
-		if (!strcmp(child->name, name)) {
-			mutex_unlock(&fs->lock);
-			return child;
-		}
+	rcu_read_lock();
+	child = vtfs_index_find(parent, name);
+	rcu_read_unlock();
+
+	if (child || !fs->remote || vtfs_store_listed(fs, parent))
+		return child;
+
+	/* first miss in a directory: fetch all of it in one go */
+	if (!READ_ONCE(parent->listed) &&
+	    !vtfs_store_fill_dir(sb, parent, NULL, NULL)) {
+		rcu_read_lock();
+		child = vtfs_index_find(parent, name);
+		rcu_read_unlock();
+		return child;
 	}
-	mutex_unlock(&fs->lock);
 
-	return NULL;
+	err = vtfs_remote_lookup(fs, parent->ino, name, &attr);
+	if (err == -ENOENT)
+		return NULL;
+	if (err)
+		return ERR_PTR(err);
+
+	return vtfs_store_add_remote(sb, parent, name, &attr);
 }
 
 struct vtfs_node *vtfs_store_create(struct super_block *sb,
@@ -151,45 +647,64 @@ struct vtfs_node *vtfs_store_create(struct super_block *sb,
                                     umode_t mode)
 {
 	struct vtfs_fs *fs = vtfs_fs(sb);
+	struct vtfs_remote_attr attr;
 	struct vtfs_node *child;
+	int err;
 
 	if (!fs || !parent || !vtfs_is_dir(parent))
-		return NULL;
+		return ERR_PTR(-ENOTDIR);
 
 	if (!name || !*name || !strcmp(name, ".") || !strcmp(name, ".."))
-		return NULL;
-
-	mutex_lock(&fs->lock);
+		return ERR_PTR(-EEXIST);
 
-	list_for_each_entry(child, &parent->children, siblings) {
-		if (!strcmp(child->name, name)) {
-			mutex_unlock(&fs->lock);
-			return NULL; /* exists */
-		}
+	if (fs->remote) {
+		err = vtfs_remote_create(fs, parent->ino, name, mode, &attr);
+		if (err)
+			return ERR_PTR(err);
 	}
 
-	child = vtfs_node_alloc(sb, parent, name, mode);
-	if (!child) {
-		mutex_unlock(&fs->lock);
-		return NULL;
+	child = vtfs_node_alloc(sb, parent, name, mode, NULL);
+	if (IS_ERR(child))
+		return child;
+	if (fs->remote)
+		child->ino = attr.ino;
+
+	vtfs_dir_lock(sb, parent);
+	vtfs_dir_purge(parent);
+	err = vtfs_dir_add(parent, child);
+	if (err) {
+		vtfs_dir_unlock(sb, parent);
+		vtfs_node_release(child);
+		return ERR_PTR(err);
 	}
+	vtfs_dir_unlock(sb, parent);
 
-	if (S_ISREG(mode)) {
-		child->f = kzalloc(sizeof(*child->f), GFP_KERNEL);
-		if (!child->f) {
-			kfree(child->name);
-			kfree(child);
-			mutex_unlock(&fs->lock);
-			return NULL;
-		}
-		child->f->data = NULL;
-		child->f->size = 0;
-		atomic_set(&child->f->refcnt, 1);
-	}
+	return child;
+}
+
+/*
+ * Remote mode: asks the server to remove @name while @parent is unlocked,
+ * so that lookups and listings there need not wait for the round trip.
+ * The VFS holds the parent's i_rwsem exclusively, so @child stays put,
+ * unless a listing drops it meanwhile; returns it if it is still there.
+ */
+static struct vtfs_node *vtfs_store_remote_remove(struct super_block *sb,
+                                                  struct vtfs_node *parent,
+                                                  const char *name,
+                                                  struct vtfs_node *child,
+                                                  int *err)
+{
+	struct vtfs_fs *fs = vtfs_fs(sb);
 
-	list_add_tail(&child->siblings, &parent->children);
-	mutex_unlock(&fs->lock);
+	vtfs_dir_unlock(sb, parent);
+	if (vtfs_is_dir(child))
+		*err = vtfs_remote_rmdir(fs, parent->ino, name);
+	else
+		*err = vtfs_remote_unlink(fs, parent->ino, name);
+	vtfs_dir_lock(sb, parent);
 
+	if (*err || vtfs_index_find(parent, name) != child)
+		return NULL;
 	return child;
 }
 
@@ -198,31 +713,36 @@ int vtfs_store_unlink(struct super_block *sb,
                       const char *name)
 {
 	struct vtfs_fs *fs = vtfs_fs(sb);
-	struct vtfs_node *child, *tmp;
+	struct vtfs_node *child;
+	int err = 0;
 
 	if (!fs || !parent || !vtfs_is_dir(parent))
 		return -ENOENT;
 
-	mutex_lock(&fs->lock);
+	vtfs_dir_lock(sb, parent);
+	vtfs_dir_purge(parent);
 
-	list_for_each_entry_safe(child, tmp, &parent->children, siblings) {
-		if (!strcmp(child->name, name)) {
-			if (vtfs_is_dir(child)) {
-				mutex_unlock(&fs->lock);
-				return -EISDIR;
-			}
+	child = vtfs_index_find(parent, name);
+	if (!child) {
+		vtfs_dir_unlock(sb, parent);
+		return -ENOENT;
+	}
 
-			list_del(&child->siblings);
+	if (vtfs_is_dir(child)) {
+		vtfs_dir_unlock(sb, parent);
+		return -EISDIR;
+	}
 
-			vtfs_node_free_recursive(child);
+	if (fs->remote)
+		child = vtfs_store_remote_remove(sb, parent, name, child, &err);
+	if (child)
+		vtfs_dir_remove(parent, child);
 
-			mutex_unlock(&fs->lock);
-			return 0;
-		}
-	}
+	vtfs_dir_unlock(sb, parent);
 
-	mutex_unlock(&fs->lock);
-	return -ENOENT;
+	if (child)
+		vtfs_node_release(child);
+	return err;
 }
 
 int vtfs_store_rmdir(struct super_block *sb,
@@ -230,70 +750,83 @@ int vtfs_store_rmdir(struct super_block *sb,
                      const char *name)
 {
 	struct vtfs_fs *fs = vtfs_fs(sb);
-	struct vtfs_node *child, *tmp;
+	struct vtfs_node *child;
+	bool empty;
+	int err = 0;
 
 	if (!fs || !parent || !vtfs_is_dir(parent))
 		return -ENOENT;
 
-	mutex_lock(&fs->lock);
-	list_for_each_entry_safe(child, tmp, &parent->children, siblings) {
-		if (!strcmp(child->name, name)) {
-			if (!vtfs_is_dir(child)) {
-				mutex_unlock(&fs->lock);
-				return -ENOTDIR;
-			}
-			if (!list_empty(&child->children)) {
-				mutex_unlock(&fs->lock);
-				return -ENOTEMPTY;
-			}
-			list_del(&child->siblings);
-			vtfs_node_free_recursive(child);
-			mutex_unlock(&fs->lock);
-			return 0;
-		}
+	vtfs_dir_lock(sb, parent);
+	vtfs_dir_purge(parent);
+	child = vtfs_index_find(parent, name);
+	if (!child) {
+		vtfs_dir_unlock(sb, parent);
+		return -ENOENT;
 	}
-	mutex_unlock(&fs->lock);
-
-	return -ENOENT;
+	if (!vtfs_is_dir(child)) {
+		vtfs_dir_unlock(sb, parent);
+		return -ENOTDIR;
+	}
+	/* the VFS holds the child's i_rwsem too, so it stays empty */
+	down_read_nested(&child->rwsem, SINGLE_DEPTH_NESTING);
+	empty = xa_empty(&child->entries);
+	up_read(&child->rwsem);
+	if (!empty) {
+		vtfs_dir_unlock(sb, parent);
+		return -ENOTEMPTY;
+	}
+	if (fs->remote)
+		child = vtfs_store_remote_remove(sb, parent, name, child, &err);
+	if (child)
+		vtfs_dir_remove(parent, child);
+	vtfs_dir_unlock(sb, parent);
+
+	if (child)
+		vtfs_node_release(child);
+	return err;
 }
 
 int vtfs_store_link(struct super_block *sb,
                     struct vtfs_node *parent,
                     const char *name,
-                    struct vtfs_node *target)
+                    struct vtfs_fileobj *f,
+                    ino_t ino)
 {
 	struct vtfs_fs *fs = vtfs_fs(sb);
 	struct vtfs_node *n;
+	int err;
 
 	if (!fs || !parent || !vtfs_is_dir(parent))
 		return -ENOTDIR;
-	if (!target || !S_ISREG(target->mode))
+	if (!f)
 		return -EPERM;
 	if (!name || !*name || !strcmp(name, ".") || !strcmp(name, ".."))
 		return -EINVAL;
 
-	mutex_lock(&fs->lock);
-
-	list_for_each_entry(n, &parent->children, siblings) {
-		if (!strcmp(n->name, name)) {
-			mutex_unlock(&fs->lock);
-			return -EEXIST;
-		}
+	if (fs->remote) {
+		err = vtfs_remote_link(fs, ino, parent->ino, name);
+		if (err)
+			return err;
 	}
 
-	n = vtfs_node_alloc(sb, parent, name, target->mode);
-	if (!n) {
-		mutex_unlock(&fs->lock);
-		return -ENOMEM;
+	n = vtfs_node_alloc(sb, parent, name, S_IFREG | 0777, f);
+	if (IS_ERR(n))
+		return PTR_ERR(n);
+
+	n->ino = ino;
+	atomic_inc(&f->refcnt);
+	atomic_inc(&f->nlink);
+
+	vtfs_dir_lock(sb, parent);
+	vtfs_dir_purge(parent);
+	err = vtfs_dir_add(parent, n);
+	if (err) {
+		vtfs_dir_unlock(sb, parent);
+		vtfs_node_release(n);
+		return err;
 	}
+	vtfs_dir_unlock(sb, parent);
 
-	n->ino = target->ino;
-	n->f = target->f;
-	if (n->f)
-		atomic_inc(&n->f->refcnt);
-
-	list_add_tail(&n->siblings, &parent->children);
-
-	mutex_unlock(&fs->lock);
 	return 0;
 }
\ No newline at end of file
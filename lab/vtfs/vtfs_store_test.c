@@ -0,0 +1,783 @@
+#include "vtfs.h"
+#include <kunit/test.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/mount.h>
+#include <linux/pagemap.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+
+/*
+ * KUnit tests for the vtfs_store API, run on a bare superblock: nothing is
+ * mounted, there are no inodes or dentries and the mount is local, so the
+ * store is exercised on its own.  Built into the module with
+ * "make VTFS_KUNIT=1" against a kernel with CONFIG_KUNIT; the suites run
+ * when the module is loaded (or under kunit.py in UML or QEMU) and report
+ * through the usual KUnit TAP output.
+ *
+ * The vtfs_file suite mounts a real instance with kern_mount() instead,
+ * for what goes through the VFS.
+ *
+ * The vtfs_store_bench suite times create and lookup in directories of
+ * 10, 10k and 1M entries and prints ns per call with kunit_info().
+ */
+
+struct vtfs_store_test {
+	struct super_block sb;
+	struct vtfs_node *root;
+};
+
+static int vtfs_store_test_init(struct kunit *test)
+{
+	struct vtfs_store_test *t;
+
+	t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, t);
+	KUNIT_ASSERT_EQ(test, vtfs_store_init(&t->sb), 0);
+	t->root = vtfs_store_root(&t->sb);
+	KUNIT_ASSERT_NOT_NULL(test, t->root);
+	test->priv = t;
+	return 0;
+}
+
+static void vtfs_store_test_exit(struct kunit *test)
+{
+	struct vtfs_store_test *t = test->priv;
+
+	vtfs_store_destroy(&t->sb);
+	/* the nodes go back to the slab caches after a grace period */
+	rcu_barrier();
+}
+
+static struct vtfs_node *vtfs_test_create(struct kunit *test,
+                                          struct vtfs_node *parent,
+                                          const char *name, umode_t mode)
+{
+	struct vtfs_store_test *t = test->priv;
+	struct vtfs_node *n = vtfs_store_create(&t->sb, parent, name, mode);
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, n);
+	return n;
+}
+
+static void vtfs_store_test_root(struct kunit *test)
+{
+	struct vtfs_store_test *t = test->priv;
+
+	KUNIT_EXPECT_TRUE(test, vtfs_is_dir(t->root));
+	KUNIT_EXPECT_EQ(test, t->root->ino, 1000);
+	KUNIT_EXPECT_NULL(test, t->root->parent);
+	KUNIT_EXPECT_NULL(test, vtfs_store_lookup(&t->sb, t->root, "missing"));
+}
+
+static void vtfs_store_test_create_lookup(struct kunit *test)
+{
+	struct vtfs_store_test *t = test->priv;
+	struct vtfs_node *a, *d, *b;
+	/* longer than VTFS_INLINE_NAME_LEN, so kept out of line */
+	static const char long_name[] =
+		"a-name-that-does-not-fit-in-the-inline-buffer";
+
+	a = vtfs_test_create(test, t->root, "a", S_IFREG | 0644);
+	d = vtfs_test_create(test, t->root, "d", S_IFDIR | 0755);
+	b = vtfs_test_create(test, d, long_name, S_IFREG | 0644);
+
+	KUNIT_EXPECT_PTR_EQ(test, vtfs_store_lookup(&t->sb, t->root, "a"), a);
+	KUNIT_EXPECT_PTR_EQ(test, vtfs_store_lookup(&t->sb, t->root, "d"), d);
+	KUNIT_EXPECT_PTR_EQ(test, vtfs_store_lookup(&t->sb, d, long_name), b);
+	KUNIT_EXPECT_NULL(test, vtfs_store_lookup(&t->sb, t->root, long_name));
+	KUNIT_EXPECT_STREQ(test, b->name, long_name);
+
+	KUNIT_EXPECT_PTR_EQ(test, a->parent, t->root);
+	KUNIT_EXPECT_PTR_EQ(test, b->parent, d);
+	KUNIT_EXPECT_NE(test, a->ino, d->ino);
+	KUNIT_EXPECT_NE(test, a->ino, b->ino);
+	KUNIT_EXPECT_PTR_EQ(test, a->f, &a->file);
+	KUNIT_EXPECT_NULL(test, d->f);
+
+	/* lookups on a file find nothing */
+	KUNIT_EXPECT_NULL(test, vtfs_store_lookup(&t->sb, a, "x"));
+}
+
+static void vtfs_store_test_create_errors(struct kunit *test)
+{
+	struct vtfs_store_test *t = test->priv;
+	struct vtfs_node *a;
+
+	a = vtfs_test_create(test, t->root, "a", S_IFREG | 0644);
+
+	KUNIT_EXPECT_EQ(test, PTR_ERR(vtfs_store_create(&t->sb, t->root, "a",
+	                                                S_IFREG | 0644)), -EEXIST);
+	KUNIT_EXPECT_EQ(test, PTR_ERR(vtfs_store_create(&t->sb, t->root, "a",
+	                                                S_IFDIR | 0755)), -EEXIST);
+	KUNIT_EXPECT_EQ(test, PTR_ERR(vtfs_store_create(&t->sb, t->root, ".",
+	                                                S_IFREG | 0644)), -EEXIST);
+	KUNIT_EXPECT_EQ(test, PTR_ERR(vtfs_store_create(&t->sb, t->root, "..",
+	                                                S_IFREG | 0644)), -EEXIST);
+	KUNIT_EXPECT_EQ(test, PTR_ERR(vtfs_store_create(&t->sb, a, "b",
+	                                                S_IFREG | 0644)), -ENOTDIR);
+
+	/* the failed creates left the original alone */
+	KUNIT_EXPECT_PTR_EQ(test, vtfs_store_lookup(&t->sb, t->root, "a"), a);
+}
+
+static void vtfs_store_test_unlink(struct kunit *test)
+{
+	struct vtfs_store_test *t = test->priv;
+
+	vtfs_test_create(test, t->root, "a", S_IFREG | 0644);
+	vtfs_test_create(test, t->root, "d", S_IFDIR | 0755);
+
+	KUNIT_EXPECT_EQ(test, vtfs_store_unlink(&t->sb, t->root, "d"), -EISDIR);
+	KUNIT_EXPECT_EQ(test, vtfs_store_unlink(&t->sb, t->root, "x"), -ENOENT);
+	KUNIT_EXPECT_EQ(test, vtfs_store_unlink(&t->sb, t->root, "a"), 0);
+	KUNIT_EXPECT_NULL(test, vtfs_store_lookup(&t->sb, t->root, "a"));
+	KUNIT_EXPECT_EQ(test, vtfs_store_unlink(&t->sb, t->root, "a"), -ENOENT);
+
+	/* the name can be used again */
+	vtfs_test_create(test, t->root, "a", S_IFDIR | 0755);
+	KUNIT_EXPECT_TRUE(test,
+	                  vtfs_is_dir(vtfs_store_lookup(&t->sb, t->root, "a")));
+}
+
+static void vtfs_store_test_rmdir(struct kunit *test)
+{
+	struct vtfs_store_test *t = test->priv;
+	struct vtfs_node *d;
+
+	d = vtfs_test_create(test, t->root, "d", S_IFDIR | 0755);
+	vtfs_test_create(test, d, "a", S_IFREG | 0644);
+	vtfs_test_create(test, t->root, "f", S_IFREG | 0644);
+
+	KUNIT_EXPECT_EQ(test, vtfs_store_rmdir(&t->sb, t->root, "d"), -ENOTEMPTY);
+	KUNIT_EXPECT_EQ(test, vtfs_store_rmdir(&t->sb, t->root, "f"), -ENOTDIR);
+	KUNIT_EXPECT_EQ(test, vtfs_store_rmdir(&t->sb, t->root, "x"), -ENOENT);
+
+	KUNIT_EXPECT_EQ(test, vtfs_store_unlink(&t->sb, d, "a"), 0);
+	KUNIT_EXPECT_EQ(test, vtfs_store_rmdir(&t->sb, t->root, "d"), 0);
+	KUNIT_EXPECT_NULL(test, vtfs_store_lookup(&t->sb, t->root, "d"));
+}
+
+static void vtfs_store_test_readdir_cookies(struct kunit *test)
+{
+	struct vtfs_store_test *t = test->priv;
+	struct vtfs_node *a, *b, *c;
+
+	a = vtfs_test_create(test, t->root, "a", S_IFREG | 0644);
+	b = vtfs_test_create(test, t->root, "b", S_IFREG | 0644);
+	KUNIT_EXPECT_GE(test, a->cookie, (unsigned long)VTFS_FIRST_COOKIE);
+	KUNIT_EXPECT_GT(test, b->cookie, a->cookie);
+	KUNIT_EXPECT_EQ(test, vtfs_store_unlink(&t->sb, t->root, "a"), 0);
+	c = vtfs_test_create(test, t->root, "c", S_IFREG | 0644);
+
+	/* cookies only grow, so a resumed readdir skips nothing it has not seen */
+	KUNIT_EXPECT_GT(test, c->cookie, b->cookie);
+	KUNIT_EXPECT_PTR_EQ(test, xa_load(&t->root->entries, b->cookie), b);
+	KUNIT_EXPECT_PTR_EQ(test, xa_load(&t->root->entries, c->cookie), c);
+}
+
+static void vtfs_store_test_link(struct kunit *test)
+{
+	struct vtfs_store_test *t = test->priv;
+	struct vtfs_node *a, *b, *d;
+	struct vtfs_fileobj *f;
+	char buf[4];
+
+	a = vtfs_test_create(test, t->root, "a", S_IFREG | 0644);
+	d = vtfs_test_create(test, t->root, "d", S_IFDIR | 0755);
+	f = a->f;
+
+	KUNIT_EXPECT_EQ(test, atomic_read(&f->refcnt), 1);
+	KUNIT_EXPECT_EQ(test, atomic_read(&f->nlink), 1);
+
+	KUNIT_ASSERT_EQ(test, vtfs_store_link(&t->sb, d, "b", f, a->ino), 0);
+	b = vtfs_store_lookup(&t->sb, d, "b");
+	KUNIT_ASSERT_NOT_NULL(test, b);
+	KUNIT_EXPECT_PTR_EQ(test, b->f, f);
+	KUNIT_EXPECT_EQ(test, b->ino, a->ino);
+	KUNIT_EXPECT_EQ(test, atomic_read(&f->refcnt), 2);
+	KUNIT_EXPECT_EQ(test, atomic_read(&f->nlink), 2);
+
+	/* data written through one name is seen through the other */
+	KUNIT_ASSERT_EQ(test, vtfs_fileobj_write(a->f, 0, "vtfs", 4), 0);
+	vtfs_fileobj_read(b->f, 0, buf, 4);
+	KUNIT_EXPECT_MEMEQ(test, buf, "vtfs", 4);
+
+	KUNIT_EXPECT_EQ(test, vtfs_store_link(&t->sb, d, "b", f, a->ino), -EEXIST);
+	KUNIT_EXPECT_EQ(test, vtfs_store_link(&t->sb, d, "c", NULL, a->ino),
+	                -EPERM);
+	KUNIT_EXPECT_EQ(test, vtfs_store_link(&t->sb, d, "..", f, a->ino),
+	                -EINVAL);
+	KUNIT_EXPECT_EQ(test, vtfs_store_link(&t->sb, a, "c", f, a->ino),
+	                -ENOTDIR);
+	KUNIT_EXPECT_EQ(test, atomic_read(&f->refcnt), 2);
+	KUNIT_EXPECT_EQ(test, atomic_read(&f->nlink), 2);
+}
+
+/*
+ * Unlinking the first name, whose node embeds the fileobj, must keep the
+ * fileobj alive for the remaining link; so must an in-core inode's ref
+ * once the last name is gone.
+ */
+static void vtfs_store_test_link_outlives_first(struct kunit *test)
+{
+	struct vtfs_store_test *t = test->priv;
+	struct vtfs_node *a, *b;
+	struct vtfs_fileobj *f;
+	char buf[4];
+
+	a = vtfs_test_create(test, t->root, "a", S_IFREG | 0644);
+	f = a->f;
+	KUNIT_ASSERT_EQ(test, vtfs_fileobj_write(f, 0, "vtfs", 4), 0);
+	KUNIT_ASSERT_EQ(test, vtfs_store_link(&t->sb, t->root, "b", f, a->ino), 0);
+
+	KUNIT_EXPECT_EQ(test, vtfs_store_unlink(&t->sb, t->root, "a"), 0);
+	rcu_barrier();
+	KUNIT_EXPECT_EQ(test, atomic_read(&f->refcnt), 1);
+	KUNIT_EXPECT_EQ(test, atomic_read(&f->nlink), 1);
+	b = vtfs_store_lookup(&t->sb, t->root, "b");
+	KUNIT_ASSERT_NOT_NULL(test, b);
+	KUNIT_EXPECT_PTR_EQ(test, b->f, f);
+	vtfs_fileobj_read(f, 0, buf, 4);
+	KUNIT_EXPECT_MEMEQ(test, buf, "vtfs", 4);
+
+	/* as an open inode would */
+	atomic_inc(&f->refcnt);
+	KUNIT_EXPECT_EQ(test, vtfs_store_unlink(&t->sb, t->root, "b"), 0);
+	rcu_barrier();
+	KUNIT_EXPECT_EQ(test, atomic_read(&f->refcnt), 1);
+	KUNIT_EXPECT_EQ(test, atomic_read(&f->nlink), 0);
+	vtfs_fileobj_read(f, 0, buf, 4);
+	KUNIT_EXPECT_MEMEQ(test, buf, "vtfs", 4);
+	vtfs_fileobj_put(f);
+}
+
+static void vtfs_store_test_limits(struct kunit *test)
+{
+	struct vtfs_store_test *t = test->priv;
+	struct vtfs_fs *fs = vtfs_fs(&t->sb);
+	struct vtfs_node *a;
+	static const char buf[VTFS_CHUNK_SIZE];
+
+	/* the root plus two */
+	fs->max_inodes = 3;
+	a = vtfs_test_create(test, t->root, "a", S_IFREG | 0644);
+	vtfs_test_create(test, t->root, "d", S_IFDIR | 0755);
+	KUNIT_EXPECT_EQ(test, PTR_ERR(vtfs_store_create(&t->sb, t->root, "b",
+	                                                S_IFREG | 0644)), -ENOSPC);
+	/* links are not inodes */
+	KUNIT_EXPECT_EQ(test, vtfs_store_link(&t->sb, t->root, "b", a->f, a->ino),
+	                0);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_inodes), 3);
+
+	fs->max_blocks = 2;
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_write(a->f, 0, buf, sizeof(buf)), 0);
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_write(a->f, VTFS_CHUNK_SIZE, buf,
+	                                         sizeof(buf)), 0);
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_write(a->f, 2 * VTFS_CHUNK_SIZE, buf,
+	                                         sizeof(buf)), -ENOSPC);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 2);
+
+	vtfs_fileobj_punch(a->f, 0, VTFS_CHUNK_SIZE);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 1);
+
+	/* both names gone: the file's chunk and inode are given back */
+	KUNIT_EXPECT_EQ(test, vtfs_store_unlink(&t->sb, t->root, "a"), 0);
+	KUNIT_EXPECT_EQ(test, vtfs_store_unlink(&t->sb, t->root, "b"), 0);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 0);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_inodes), 2);
+	vtfs_test_create(test, t->root, "c", S_IFREG | 0644);
+}
+
+static void vtfs_store_test_seek(struct kunit *test)
+{
+	struct vtfs_store_test *t = test->priv;
+	struct vtfs_node *a;
+
+	/* chunks 0, 1 and 3, with a hole at 2 */
+	a = vtfs_test_create(test, t->root, "a", S_IFREG | 0644);
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_write(a->f, 0, "x", 1), 0);
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_write(a->f, VTFS_CHUNK_SIZE, "x", 1), 0);
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_write(a->f, 3 * VTFS_CHUNK_SIZE, "x", 1),
+	                0);
+
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_seek(a->f, 0, SEEK_HOLE),
+	                2 * VTFS_CHUNK_SIZE);
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_seek(a->f, VTFS_CHUNK_SIZE + 5, SEEK_HOLE),
+	                2 * VTFS_CHUNK_SIZE);
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_seek(a->f, 2 * VTFS_CHUNK_SIZE + 1,
+	                                        SEEK_HOLE),
+	                2 * VTFS_CHUNK_SIZE + 1);
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_seek(a->f, 2 * VTFS_CHUNK_SIZE, SEEK_DATA),
+	                3 * VTFS_CHUNK_SIZE);
+	/* the end of the file counts as a hole */
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_seek(a->f, 3 * VTFS_CHUNK_SIZE, SEEK_HOLE),
+	                3 * VTFS_CHUNK_SIZE + 1);
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_seek(a->f, 3 * VTFS_CHUNK_SIZE + 1,
+	                                        SEEK_HOLE), -ENXIO);
+}
+
+static void vtfs_store_test_clone(struct kunit *test)
+{
+	struct vtfs_store_test *t = test->priv;
+	struct vtfs_fs *fs = vtfs_fs(&t->sb);
+	struct vtfs_node *a, *b;
+	static char buf[2 * VTFS_CHUNK_SIZE + 10];
+	char out[4];
+
+	a = vtfs_test_create(test, t->root, "a", S_IFREG | 0644);
+	b = vtfs_test_create(test, t->root, "b", S_IFREG | 0644);
+	memset(buf, 'a', sizeof(buf));
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_write(a->f, 0, buf, sizeof(buf)), 0);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 3);
+
+	/* the two whole chunks are shared, the partial one copied */
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_clone(b->f, 0, a->f, 0, sizeof(buf)), 0);
+	KUNIT_EXPECT_EQ(test, b->f->size, sizeof(buf));
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 4);
+
+	/* writing to a shared chunk copies it first */
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_write(b->f, 1, "bbb", 3), 0);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 5);
+	vtfs_fileobj_read(a->f, 0, out, 4);
+	KUNIT_EXPECT_MEMEQ(test, out, "aaaa", 4);
+	vtfs_fileobj_read(b->f, 0, out, 4);
+	KUNIT_EXPECT_MEMEQ(test, out, "abbb", 4);
+
+	/* chunk 1 outlives a, and its last user takes it over */
+	KUNIT_EXPECT_EQ(test, vtfs_store_unlink(&t->sb, t->root, "a"), 0);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 3);
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_write(b->f, VTFS_CHUNK_SIZE, "b", 1), 0);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 3);
+	vtfs_fileobj_read(b->f, VTFS_CHUNK_SIZE, out, 2);
+	KUNIT_EXPECT_MEMEQ(test, out, "ba", 2);
+}
+
+static void vtfs_store_test_copy_unaligned(struct kunit *test)
+{
+	struct vtfs_store_test *t = test->priv;
+	struct vtfs_fs *fs = vtfs_fs(&t->sb);
+	struct vtfs_node *a, *b;
+	static char buf[VTFS_CHUNK_SIZE + 4];
+	char out[6];
+
+	a = vtfs_test_create(test, t->root, "a", S_IFREG | 0644);
+	b = vtfs_test_create(test, t->root, "b", S_IFREG | 0644);
+	memset(buf, 'a', sizeof(buf));
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_write(a->f, 0, buf, sizeof(buf)), 0);
+
+	/* nothing lines up, so every byte is copied */
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_clone(b->f, 3 * VTFS_CHUNK_SIZE + 1,
+	                                         a->f, 1, sizeof(buf) - 1), 0);
+	KUNIT_EXPECT_EQ(test, b->f->size, 4 * VTFS_CHUNK_SIZE + 4);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 4);
+	vtfs_fileobj_read(b->f, 3 * VTFS_CHUNK_SIZE, out, 2);
+	KUNIT_EXPECT_MEMEQ(test, out, "\0a", 2);
+	vtfs_fileobj_read(b->f, 4 * VTFS_CHUNK_SIZE + 2, out, 2);
+	KUNIT_EXPECT_MEMEQ(test, out, "aa", 2);
+}
+
+static void vtfs_store_test_compress(struct kunit *test)
+{
+	struct vtfs_store_test *t = test->priv;
+	struct vtfs_fs *fs = vtfs_fs(&t->sb);
+	struct vtfs_mount_opts opts = {
+		.compress = VTFS_COMPRESS_LZ4,
+		.compress_age = 30,
+	};
+	struct vtfs_node *a;
+	static char buf[2 * VTFS_CHUNK_SIZE];
+	char out[4];
+
+	if (vtfs_compress_init(&t->sb, &opts))
+		kunit_skip(test, "no lz4 in the crypto API");
+
+	a = vtfs_test_create(test, t->root, "a", S_IFREG | 0644);
+	memset(buf, 'a', sizeof(buf));
+	buf[VTFS_CHUNK_SIZE] = 'b';
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_write(a->f, 0, buf, sizeof(buf)), 0);
+	KUNIT_EXPECT_FALSE(test, list_empty(&a->f->warm));
+
+	/* still charged as two chunks, and read without inflating them */
+	vtfs_fileobj_compact(a->f);
+	KUNIT_EXPECT_EQ(test, xa_pointer_tag(xa_load(&a->f->chunks, 1)), 3);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 2);
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_read(a->f, VTFS_CHUNK_SIZE - 1, out, 2), 0);
+	KUNIT_EXPECT_MEMEQ(test, out, "ab", 2);
+	KUNIT_EXPECT_EQ(test, xa_pointer_tag(xa_load(&a->f->chunks, 0)), 3);
+	KUNIT_EXPECT_EQ(test, xa_pointer_tag(xa_load(&a->f->chunks, 1)), 3);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 2);
+
+	/* a write to a compressed chunk lands in the inflated one */
+	vtfs_fileobj_compact(a->f);
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_write(a->f, 1, "cc", 2), 0);
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_read(a->f, 0, out, 4), 0);
+	KUNIT_EXPECT_MEMEQ(test, out, "acca", 4);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 2);
+
+	/* the warm list does not keep a deleted file's chunks around */
+	KUNIT_EXPECT_EQ(test, vtfs_store_unlink(&t->sb, t->root, "a"), 0);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 0);
+	vtfs_compress_destroy(&t->sb);
+}
+
+static void vtfs_store_test_dedup(struct kunit *test)
+{
+	struct vtfs_store_test *t = test->priv;
+	struct vtfs_fs *fs = vtfs_fs(&t->sb);
+	struct vtfs_node *a, *b;
+	static char buf[2 * VTFS_CHUNK_SIZE];
+	char out[4];
+
+	KUNIT_ASSERT_EQ(test, vtfs_dedup_init(&t->sb), 0);
+	a = vtfs_test_create(test, t->root, "a", S_IFREG | 0644);
+	b = vtfs_test_create(test, t->root, "b", S_IFREG | 0644);
+	memset(buf, 'a', sizeof(buf));
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_write(a->f, 0, buf, sizeof(buf)), 0);
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_write(b->f, 0, buf, sizeof(buf)), 0);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 4);
+
+	/* all four chunks have the same bytes */
+	vtfs_fileobj_compact(a->f);
+	vtfs_fileobj_compact(b->f);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 1);
+
+	/* a write gets its own copy, and leaves the others alone */
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_write(b->f, 1, "bb", 2), 0);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 2);
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_read(a->f, 0, out, 4), 0);
+	KUNIT_EXPECT_MEMEQ(test, out, "aaaa", 4);
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_read(b->f, 0, out, 4), 0);
+	KUNIT_EXPECT_MEMEQ(test, out, "abba", 4);
+
+	KUNIT_EXPECT_EQ(test, vtfs_store_unlink(&t->sb, t->root, "a"), 0);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 2);
+	vtfs_dedup_destroy(&t->sb);
+	KUNIT_EXPECT_EQ(test, vtfs_store_unlink(&t->sb, t->root, "b"), 0);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 0);
+}
+
+static void vtfs_store_test_compress_dedup(struct kunit *test)
+{
+	struct vtfs_store_test *t = test->priv;
+	struct vtfs_fs *fs = vtfs_fs(&t->sb);
+	struct vtfs_mount_opts opts = {
+		.compress = VTFS_COMPRESS_LZ4,
+		.dedup = true,
+		.compress_age = 30,
+	};
+	struct vtfs_node *a, *b;
+	static char buf[2 * VTFS_CHUNK_SIZE];
+	unsigned long zbytes;
+	char out[4];
+
+	if (vtfs_compress_init(&t->sb, &opts))
+		kunit_skip(test, "no lz4 in the crypto API");
+	KUNIT_ASSERT_EQ(test, vtfs_dedup_init(&t->sb), 0);
+
+	a = vtfs_test_create(test, t->root, "a", S_IFREG | 0644);
+	b = vtfs_test_create(test, t->root, "b", S_IFREG | 0644);
+	memset(buf, 'a', sizeof(buf));
+	buf[VTFS_CHUNK_SIZE] = 'b';
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_write(a->f, 0, buf, sizeof(buf)), 0);
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_write(b->f, 0, buf, sizeof(buf)), 0);
+	KUNIT_EXPECT_EQ(test, vtfs_compress_bytes(fs), 0);
+
+	/* the chunks of "a" go in the table compressed */
+	vtfs_fileobj_compact(a->f);
+	zbytes = vtfs_compress_bytes(fs);
+	KUNIT_EXPECT_GT(test, zbytes, 0);
+	KUNIT_EXPECT_LT(test, zbytes, 2 * VTFS_CHUNK_SIZE);
+	KUNIT_EXPECT_EQ(test, xa_pointer_tag(xa_load(&a->f->chunks, 1)), 1);
+
+	/* and those of "b" share them */
+	vtfs_fileobj_compact(b->f);
+	KUNIT_EXPECT_EQ(test, vtfs_compress_bytes(fs), zbytes);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 2);
+
+	/* reads leave them shared, and compressed */
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_read(b->f, VTFS_CHUNK_SIZE - 1, out, 2), 0);
+	KUNIT_EXPECT_MEMEQ(test, out, "ab", 2);
+	KUNIT_EXPECT_EQ(test, xa_pointer_tag(xa_load(&b->f->chunks, 1)), 1);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 2);
+	KUNIT_EXPECT_EQ(test, vtfs_compress_bytes(fs), zbytes);
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_read(a->f, VTFS_CHUNK_SIZE - 1, out, 2), 0);
+	KUNIT_EXPECT_MEMEQ(test, out, "ab", 2);
+
+	/* a write gets a plain copy of its own, and leaves the others alone */
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_write(b->f, VTFS_CHUNK_SIZE + 1, "c", 1), 0);
+	KUNIT_EXPECT_EQ(test, xa_pointer_tag(xa_load(&b->f->chunks, 1)), 0);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 3);
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_read(b->f, VTFS_CHUNK_SIZE, out, 2), 0);
+	KUNIT_EXPECT_MEMEQ(test, out, "bc", 2);
+	KUNIT_EXPECT_EQ(test, vtfs_fileobj_read(a->f, VTFS_CHUNK_SIZE, out, 2), 0);
+	KUNIT_EXPECT_MEMEQ(test, out, "ba", 2);
+
+	KUNIT_EXPECT_EQ(test, vtfs_store_unlink(&t->sb, t->root, "a"), 0);
+	KUNIT_EXPECT_EQ(test, vtfs_store_unlink(&t->sb, t->root, "b"), 0);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&fs->used_blocks), 0);
+	vtfs_compress_destroy(&t->sb);
+	vtfs_dedup_destroy(&t->sb);
+}
+
+/* images that must not mount: a root and two files, "a" and "b" */
+struct vtfs_bad_image {
+	const char *desc;
+	u64 next_ino;
+	struct {
+		u64 ino, link;
+		umode_t mode;
+		u16 flags;
+	} nodes[3];
+};
+
+static const struct vtfs_bad_image vtfs_bad_images[] = {
+	{ "file and directory share an ino", 1003, {
+		{ 1000, 0, S_IFDIR | 0755 },
+		{ 1001, 1, S_IFDIR | 0755 },
+		{ 1001, 2, S_IFREG | 0644 } } },
+	{ "hard link with another ino", 1003, {
+		{ 1000, 0, S_IFDIR | 0755 },
+		{ 1001, 1, S_IFREG | 0644, VTFS_IMAGE_LINKED },
+		{ 1002, 1, S_IFREG | 0644 } } },
+	{ "ino past next_ino", 1002, {
+		{ 1000, 0, S_IFDIR | 0755 },
+		{ 1001, 1, S_IFREG | 0644 },
+		{ 1002, 2, S_IFREG | 0644 } } },
+};
+
+static void vtfs_bad_image_desc(const struct vtfs_bad_image *img, char *desc)
+{
+	strscpy(desc, img->desc, KUNIT_PARAM_DESC_SIZE);
+}
+
+KUNIT_ARRAY_PARAM(vtfs_bad_image, vtfs_bad_images, vtfs_bad_image_desc);
+
+#define VTFS_TEST_IMAGE "/vtfs-kunit.img"
+
+static void vtfs_store_test_bad_image(struct kunit *test)
+{
+	const struct vtfs_bad_image *img = test->param_value;
+	struct vtfs_store_test *t = test->priv;
+	struct vtfs_fs *fs = vtfs_fs(&t->sb);
+	struct vtfs_image_node recs[3] = {};
+	struct vtfs_image_hdr hdr = {};
+	struct file *file;
+	loff_t pos = 0;
+	int i;
+
+	hdr.magic = cpu_to_le64(VTFS_IMAGE_MAGIC);
+	hdr.version = cpu_to_le32(VTFS_IMAGE_VERSION);
+	hdr.next_ino = cpu_to_le64(img->next_ino);
+	hdr.nr_nodes = cpu_to_le64(3);
+	hdr.nodes_off = cpu_to_le64(sizeof(hdr));
+	hdr.names_off = cpu_to_le64(sizeof(hdr) + sizeof(recs));
+	hdr.names_len = cpu_to_le64(2);
+	hdr.data_off = cpu_to_le64(PAGE_SIZE);
+	for (i = 0; i < 3; i++) {
+		recs[i].ino = cpu_to_le64(img->nodes[i].ino);
+		recs[i].link = cpu_to_le64(img->nodes[i].link);
+		recs[i].mode = cpu_to_le32(img->nodes[i].mode);
+		recs[i].name_len = cpu_to_le16(i ? 1 : 0);
+		recs[i].flags = cpu_to_le16(img->nodes[i].flags);
+	}
+
+	/* the image has to be a file on some other filesystem */
+	file = filp_open(VTFS_TEST_IMAGE, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+	if (IS_ERR(file))
+		kunit_skip(test, "cannot create " VTFS_TEST_IMAGE);
+	KUNIT_EXPECT_EQ(test, kernel_write(file, &hdr, sizeof(hdr), &pos),
+	                (ssize_t)sizeof(hdr));
+	KUNIT_EXPECT_EQ(test, kernel_write(file, recs, sizeof(recs), &pos),
+	                (ssize_t)sizeof(recs));
+	KUNIT_EXPECT_EQ(test, kernel_write(file, "ab", 2, &pos), 2);
+	fput(file);
+
+	fs->opts.image = VTFS_TEST_IMAGE;
+	KUNIT_EXPECT_EQ(test, vtfs_image_load(&t->sb), -EINVAL);
+	KUNIT_EXPECT_NULL(test, fs->image);
+	KUNIT_EXPECT_NULL(test, fs->image_dir.dentry);
+	fs->opts.image = NULL;
+}
+
+static struct kunit_case vtfs_store_test_cases[] = {
+	KUNIT_CASE(vtfs_store_test_root),
+	KUNIT_CASE(vtfs_store_test_create_lookup),
+	KUNIT_CASE(vtfs_store_test_create_errors),
+	KUNIT_CASE(vtfs_store_test_unlink),
+	KUNIT_CASE(vtfs_store_test_rmdir),
+	KUNIT_CASE(vtfs_store_test_readdir_cookies),
+	KUNIT_CASE(vtfs_store_test_link),
+	KUNIT_CASE(vtfs_store_test_link_outlives_first),
+	KUNIT_CASE(vtfs_store_test_limits),
+	KUNIT_CASE(vtfs_store_test_seek),
+	KUNIT_CASE(vtfs_store_test_clone),
+	KUNIT_CASE(vtfs_store_test_copy_unaligned),
+	KUNIT_CASE(vtfs_store_test_compress),
+	KUNIT_CASE(vtfs_store_test_dedup),
+	KUNIT_CASE(vtfs_store_test_compress_dedup),
+	KUNIT_CASE_PARAM(vtfs_store_test_bad_image, vtfs_bad_image_gen_params),
+	{}
+};
+
+static struct kunit_suite vtfs_store_test_suite = {
+	.name = "vtfs_store",
+	.init = vtfs_store_test_init,
+	.exit = vtfs_store_test_exit,
+	.test_cases = vtfs_store_test_cases,
+};
+
+/* ---- through the VFS ---- */
+
+static int vtfs_file_test_init(struct kunit *test)
+{
+	struct vfsmount *mnt = kern_mount(&vtfs_fs_type);
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, mnt);
+	test->priv = mnt;
+	return 0;
+}
+
+static void vtfs_file_test_exit(struct kunit *test)
+{
+	kern_unmount(test->priv);
+}
+
+/* Clears the expected page if a buffer in the pipe is some other one. */
+static int vtfs_test_splice_buf(struct pipe_inode_info *pipe,
+                                struct pipe_buffer *buf, struct splice_desc *sd)
+{
+	struct page **page = sd->u.data;
+
+	if (buf->page != *page)
+		*page = NULL;
+	return buf->len;
+}
+
+static int vtfs_test_splice_actor(struct pipe_inode_info *pipe,
+                                  struct splice_desc *sd)
+{
+	int ret;
+
+	pipe_lock(pipe);
+	ret = __splice_from_pipe(pipe, sd, vtfs_test_splice_buf);
+	pipe_unlock(pipe);
+	return ret;
+}
+
+/* Splicing to a pipe hands it the page cache's own page, not a copy. */
+static void vtfs_file_test_splice(struct kunit *test)
+{
+	struct vfsmount *mnt = test->priv;
+	static char buf[PAGE_SIZE];
+	struct splice_desc sd = { .total_len = PAGE_SIZE };
+	struct folio *folio;
+	struct page *page;
+	struct file *file;
+	loff_t pos = 0;
+
+	file = file_open_root_mnt(mnt, "f", O_CREAT | O_RDWR, 0644);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, file);
+	memset(buf, 'a', sizeof(buf));
+	KUNIT_EXPECT_EQ(test, kernel_write(file, buf, sizeof(buf), &pos),
+	                (ssize_t)sizeof(buf));
+
+	folio = filemap_get_folio(file->f_mapping, 0);
+	KUNIT_ASSERT_FALSE(test, IS_ERR(folio));
+	page = folio_page(folio, 0);
+	sd.u.data = &page;
+	KUNIT_EXPECT_EQ(test, splice_direct_to_actor(file, &sd,
+	                                             vtfs_test_splice_actor),
+	                (ssize_t)PAGE_SIZE);
+	KUNIT_EXPECT_PTR_EQ(test, page, folio_page(folio, 0));
+
+	folio_put(folio);
+	fput(file);
+}
+
+static struct kunit_case vtfs_file_test_cases[] = {
+	KUNIT_CASE(vtfs_file_test_splice),
+	{}
+};
+
+static struct kunit_suite vtfs_file_test_suite = {
+	.name = "vtfs_file",
+	.init = vtfs_file_test_init,
+	.exit = vtfs_file_test_exit,
+	.test_cases = vtfs_file_test_cases,
+};
+
+/* ---- microbenchmarks ---- */
+
+#define VTFS_BENCH_LOOKUPS 100000
+
+static const unsigned int vtfs_bench_sizes[] = { 10, 10000, 1000000 };
+
+static void vtfs_bench_size_desc(const unsigned int *n, char *desc)
+{
+	snprintf(desc, KUNIT_PARAM_DESC_SIZE, "%u children", *n);
+}
+
+KUNIT_ARRAY_PARAM(vtfs_bench, vtfs_bench_sizes, vtfs_bench_size_desc);
+
+/*
+ * Fills a directory with n files, timing the creates, then times
+ * VTFS_BENCH_LOOKUPS lookups of random existing names and as many of a
+ * missing one.
+ */
+static void vtfs_store_bench_create_lookup(struct kunit *test)
+{
+	struct vtfs_store_test *t = test->priv;
+	unsigned int n = *(const unsigned int *)test->param_value;
+	struct vtfs_node *d;
+	char name[16];
+	u64 start, ns;
+	unsigned int i;
+
+	d = vtfs_test_create(test, t->root, "d", S_IFDIR | 0755);
+
+	start = ktime_get_ns();
+	for (i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "f%u", i);
+		vtfs_test_create(test, d, name, S_IFREG | 0644);
+		if (!(i & 1023))
+			cond_resched();
+	}
+	ns = ktime_get_ns() - start;
+	kunit_info(test, "create: %u in %llu ns, %llu ns/op\n", n, ns,
+	           div_u64(ns, n));
+
+	start = ktime_get_ns();
+	for (i = 0; i < VTFS_BENCH_LOOKUPS; i++) {
+		snprintf(name, sizeof(name), "f%u", get_random_u32_below(n));
+		KUNIT_ASSERT_NOT_NULL(test, vtfs_store_lookup(&t->sb, d, name));
+	}
+	ns = ktime_get_ns() - start;
+	kunit_info(test, "lookup hit: %llu ns/op\n",
+	           div_u64(ns, VTFS_BENCH_LOOKUPS));
+
+	start = ktime_get_ns();
+	for (i = 0; i < VTFS_BENCH_LOOKUPS; i++)
+		KUNIT_ASSERT_NULL(test, vtfs_store_lookup(&t->sb, d, "missing"));
+	ns = ktime_get_ns() - start;
+	kunit_info(test, "lookup miss: %llu ns/op\n",
+	           div_u64(ns, VTFS_BENCH_LOOKUPS));
+}
+
+static struct kunit_case vtfs_store_bench_cases[] = {
+	KUNIT_CASE_PARAM_ATTR(vtfs_store_bench_create_lookup,
+	                      vtfs_bench_gen_params,
+	                      { .speed = KUNIT_SPEED_SLOW }),
+	{}
+};
+
+static struct kunit_suite vtfs_store_bench_suite = {
+	.name = "vtfs_store_bench",
+	.init = vtfs_store_test_init,
+	.exit = vtfs_store_test_exit,
+	.test_cases = vtfs_store_bench_cases,
+};
+
+kunit_test_suites(&vtfs_store_test_suite, &vtfs_file_test_suite,
+                  &vtfs_store_bench_suite);
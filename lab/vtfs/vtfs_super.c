@@ -1,14 +1,324 @@
 #include "vtfs.h"
+#include "source/http.h"
 #include <linux/pagemap.h>
 #include <linux/printk.h>
+#include <linux/fs_context.h>
+#include <linux/fs_parser.h>
+#include <linux/seq_file.h>
+#include <linux/statfs.h>
+#include <linux/log2.h>
+#include <linux/sizes.h>
+#include <linux/mm.h>
+#include <linux/capability.h>
 
-static struct dentry *vtfs_mount(struct file_system_type *fs_type,
-                                 int flags,
-                                 const char *dev_name,
-                                 void *data)
+/*
+ * Mount options.  In the remote modes the mount source is the token:
+ *
+ *   mount -t vtfs -o mode=writeback,server=10.0.0.2,pool=8 <token> /mnt
+ *
+ * Its connections are made from the initial network namespace, so only
+ * that namespace's admin may pick a remote mode.
+ *
+ * In mode=ram, image=<absolute path> keeps the tree in a snapshot file
+ * across mounts (vtfs_image.c); only the initial namespace's admin may
+ * name one.  compress=lz4|zstd compresses files left alone for
+ * compress_age seconds (vtfs_compress.c), and dedup shares their chunks
+ * with identical ones (vtfs_dedup.c).
+ *
+ * Remount can change actimeo, negtimeo, size, nr_inodes and compress_age;
+ * the others pick how the mount is built and may only be repeated with
+ * the same value.
+ */
+enum {
+	Opt_mode, Opt_server, Opt_port, Opt_binary, Opt_pool, Opt_chunk_size,
+	Opt_actimeo, Opt_negtimeo, Opt_size, Opt_nr_inodes, Opt_image,
+	Opt_compress, Opt_compress_age, Opt_dedup,
+};
+
+static const struct constant_table vtfs_param_modes[] = {
+	{ "ram",       VTFS_MODE_RAM },
+	{ "remote",    VTFS_MODE_REMOTE },
+	{ "writeback", VTFS_MODE_WRITEBACK },
+	{}
+};
+
+static const struct constant_table vtfs_param_compress[] = {
+	{ "none", VTFS_COMPRESS_NONE },
+	{ "lz4",  VTFS_COMPRESS_LZ4 },
+	{ "zstd", VTFS_COMPRESS_ZSTD },
+	{}
+};
+
+static const struct fs_parameter_spec vtfs_fs_parameters[] = {
+	fsparam_enum("mode",         Opt_mode, vtfs_param_modes),
+	fsparam_string("server",     Opt_server),
+	fsparam_u32("port",          Opt_port),
+	fsparam_flag("binary",       Opt_binary),
+	fsparam_u32("pool",          Opt_pool),
+	fsparam_string("chunk_size", Opt_chunk_size),
+	fsparam_u32("actimeo",       Opt_actimeo),
+	fsparam_u32("negtimeo",      Opt_negtimeo),
+	fsparam_string("size",       Opt_size),
+	fsparam_string("nr_inodes",  Opt_nr_inodes),
+	fsparam_string("image",      Opt_image),
+	fsparam_enum("compress",     Opt_compress, vtfs_param_compress),
+	fsparam_u32("compress_age",  Opt_compress_age),
+	fsparam_flag("dedup",        Opt_dedup),
+	{}
+};
+
+#define VTFS_REMOUNT_OPTS \
+	(BIT(Opt_actimeo) | BIT(Opt_negtimeo) | BIT(Opt_size) | \
+	 BIT(Opt_nr_inodes) | BIT(Opt_compress_age))
+
+struct vtfs_fs_context {
+	struct vtfs_mount_opts opts;
+	unsigned long seen;	/* BIT(Opt_*) of the options given */
+};
+
+static int vtfs_fill_super(struct super_block *sb, struct fs_context *fc);
+
+/* size=, nr_inodes= and chunk_size= take an optional k, m or g suffix */
+static int vtfs_parse_size(struct fs_context *fc, struct fs_parameter *param,
+                           unsigned long long *val)
+{
+	char *end;
+
+	*val = memparse(param->string, &end);
+	if (*end)
+		return invalfc(fc, "bad value for %s", param->key);
+	return 0;
+}
+
+static int vtfs_parse_param(struct fs_context *fc, struct fs_parameter *param)
+{
+	struct vtfs_fs_context *ctx = fc->fs_private;
+	struct vtfs_mount_opts *opts = &ctx->opts;
+	struct fs_parse_result result;
+	unsigned long long val;
+	u8 addr[4];
+	int opt, err;
+
+	opt = fs_parse(fc, vtfs_fs_parameters, param, &result);
+	if (opt < 0)
+		return opt;
+	ctx->seen |= BIT(opt);
+
+	switch (opt) {
+	case Opt_mode:
+		/* the server is reached from the initial network namespace */
+		if (result.uint_32 != VTFS_MODE_RAM && !capable(CAP_SYS_ADMIN)) {
+			errorfc(fc, "remote modes need CAP_SYS_ADMIN");
+			return -EPERM;
+		}
+		opts->mode = result.uint_32;
+		break;
+	case Opt_server:
+		if (!in4_pton(param->string, -1, addr, -1, NULL))
+			return invalfc(fc, "server must be an IPv4 address");
+		strscpy(opts->server, param->string, sizeof(opts->server));
+		break;
+	case Opt_port:
+		if (!result.uint_32 || result.uint_32 > U16_MAX)
+			return invalfc(fc, "bad port");
+		opts->port = result.uint_32;
+		break;
+	case Opt_binary:
+		opts->binary = true;
+		break;
+	case Opt_pool:
+		if (!result.uint_32 || result.uint_32 > VTFS_POOL_MAX)
+			return invalfc(fc, "pool must be 1 to %d", VTFS_POOL_MAX);
+		opts->pool = result.uint_32;
+		break;
+	case Opt_chunk_size:
+		err = vtfs_parse_size(fc, param, &val);
+		if (err)
+			return err;
+		if (!is_power_of_2(val) || val < PAGE_SIZE ||
+		    val > BIT(VTFS_CHUNK_SHIFT_MAX))
+			return invalfc(fc, "chunk_size must be a power of 2 from %lu to %lu",
+			               PAGE_SIZE, BIT(VTFS_CHUNK_SHIFT_MAX));
+		opts->chunk_shift = ilog2(val);
+		break;
+	case Opt_actimeo:
+		opts->actimeo = result.uint_32;
+		break;
+	case Opt_negtimeo:
+		opts->negtimeo = result.uint_32;
+		break;
+	case Opt_size:
+		return vtfs_parse_size(fc, param, &opts->size);
+	case Opt_nr_inodes:
+		return vtfs_parse_size(fc, param, &opts->nr_inodes);
+	case Opt_image:
+		/* the file is written at umount, by whoever drops the sb */
+		if (!capable(CAP_SYS_ADMIN)) {
+			errorfc(fc, "image needs CAP_SYS_ADMIN");
+			return -EPERM;
+		}
+		if (param->string[0] != '/')
+			return invalfc(fc, "image must be an absolute path");
+		kfree(opts->image);
+		opts->image = param->string;
+		param->string = NULL;
+		break;
+	case Opt_compress:
+		opts->compress = result.uint_32;
+		break;
+	case Opt_compress_age:
+		opts->compress_age = result.uint_32;
+		break;
+	case Opt_dedup:
+		opts->dedup = true;
+		break;
+	}
+
+	return 0;
+}
+
+static int vtfs_get_tree(struct fs_context *fc)
 {
+	struct vtfs_fs_context *ctx = fc->fs_private;
+
 	pr_info("[vtfs] mount request\n");
-	return mount_nodev(fs_type, flags, data, vtfs_fill_super);
+	if (ctx->opts.mode != VTFS_MODE_RAM) {
+		if (!fc->source || !*fc->source)
+			return invalfc(fc, "the remote modes take the token as the source");
+		ctx->opts.token = fc->source;
+		if (ctx->opts.image)
+			return invalfc(fc, "image needs mode=ram");
+	}
+
+	return get_tree_nodev(fc, vtfs_fill_super);
+}
+
+static s64 vtfs_size_to_blocks(struct vtfs_fs *fs, unsigned long long size)
+{
+	return DIV_ROUND_UP_ULL(size, 1ULL << fs->chunk_shift);
+}
+
+/* Checks that remount leaves the options it cannot change alone. */
+static int vtfs_check_fixed(struct fs_context *fc, struct vtfs_fs *fs)
+{
+	struct vtfs_fs_context *ctx = fc->fs_private;
+	const struct vtfs_mount_opts *new = &ctx->opts, *old = &fs->opts;
+	static const char *const names[] = {
+		[Opt_mode] = "mode", [Opt_server] = "server", [Opt_port] = "port",
+		[Opt_binary] = "binary", [Opt_pool] = "pool",
+		[Opt_chunk_size] = "chunk_size", [Opt_image] = "image",
+		[Opt_compress] = "compress", [Opt_dedup] = "dedup",
+	};
+	unsigned long changed = 0;
+
+	if (new->mode != old->mode)
+		changed |= BIT(Opt_mode);
+	if (strcmp(new->server, old->server))
+		changed |= BIT(Opt_server);
+	if (new->port != old->port)
+		changed |= BIT(Opt_port);
+	if (new->binary != old->binary)
+		changed |= BIT(Opt_binary);
+	if (new->pool != old->pool)
+		changed |= BIT(Opt_pool);
+	if (new->chunk_shift != old->chunk_shift)
+		changed |= BIT(Opt_chunk_size);
+	if (!new->image != !old->image ||
+	    (new->image && strcmp(new->image, old->image)))
+		changed |= BIT(Opt_image);
+	if (new->compress != old->compress)
+		changed |= BIT(Opt_compress);
+	if (new->dedup != old->dedup)
+		changed |= BIT(Opt_dedup);
+
+	changed &= ctx->seen & ~VTFS_REMOUNT_OPTS;
+	if (changed)
+		return invalfc(fc, "%s cannot be changed on remount",
+		               names[__ffs(changed)]);
+	return 0;
+}
+
+static int vtfs_reconfigure(struct fs_context *fc)
+{
+	struct vtfs_fs_context *ctx = fc->fs_private;
+	struct vtfs_fs *fs = vtfs_fs(fc->root->d_sb);
+	struct vtfs_mount_opts *opts = &ctx->opts;
+	s64 max_blocks = fs->max_blocks, max_inodes = fs->max_inodes;
+	int err;
+
+	err = vtfs_check_fixed(fc, fs);
+	if (err)
+		return err;
+
+	if (ctx->seen & BIT(Opt_size)) {
+		max_blocks = vtfs_size_to_blocks(fs, opts->size);
+		if (max_blocks &&
+		    percpu_counter_compare(&fs->used_blocks, max_blocks) > 0)
+			return invalfc(fc, "size is below what is in use");
+	}
+	if (ctx->seen & BIT(Opt_nr_inodes)) {
+		max_inodes = opts->nr_inodes;
+		if (max_inodes &&
+		    percpu_counter_compare(&fs->used_inodes, max_inodes) > 0)
+			return invalfc(fc, "nr_inodes is below what is in use");
+	}
+
+	WRITE_ONCE(fs->max_blocks, max_blocks);
+	WRITE_ONCE(fs->max_inodes, max_inodes);
+	if (ctx->seen & BIT(Opt_size))
+		fs->opts.size = opts->size;
+	if (ctx->seen & BIT(Opt_nr_inodes))
+		fs->opts.nr_inodes = opts->nr_inodes;
+	if (ctx->seen & BIT(Opt_actimeo)) {
+		fs->opts.actimeo = opts->actimeo;
+		WRITE_ONCE(fs->attr_ttl, opts->actimeo * HZ);
+	}
+	if (ctx->seen & BIT(Opt_negtimeo)) {
+		fs->opts.negtimeo = opts->negtimeo;
+		WRITE_ONCE(fs->neg_ttl, opts->negtimeo * HZ);
+	}
+	if (ctx->seen & BIT(Opt_compress_age)) {
+		fs->opts.compress_age = opts->compress_age;
+		vtfs_compress_set_age(fs, opts->compress_age);
+	}
+	return 0;
+}
+
+static void vtfs_free_fc(struct fs_context *fc)
+{
+	struct vtfs_fs_context *ctx = fc->fs_private;
+
+	if (ctx)
+		kfree(ctx->opts.image);
+	kfree(ctx);
+}
+
+static const struct fs_context_operations vtfs_context_ops = {
+	.parse_param = vtfs_parse_param,
+	.get_tree    = vtfs_get_tree,
+	.reconfigure = vtfs_reconfigure,
+	.free        = vtfs_free_fc,
+};
+
+static int vtfs_init_fs_context(struct fs_context *fc)
+{
+	struct vtfs_fs_context *ctx;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+
+	ctx->opts.mode = VTFS_MODE_RAM;
+	strscpy(ctx->opts.server, SERVER_IP, sizeof(ctx->opts.server));
+	ctx->opts.pool = VTFS_POOL_DEFAULT;
+	ctx->opts.chunk_shift = VTFS_CHUNK_SHIFT;
+	ctx->opts.actimeo = 3;
+	ctx->opts.negtimeo = 3;
+	ctx->opts.compress_age = 30;
+
+	fc->fs_private = ctx;
+	fc->ops = &vtfs_context_ops;
+	return 0;
 }
 
 static void vtfs_kill_sb(struct super_block *sb)
@@ -18,33 +328,125 @@ static void vtfs_kill_sb(struct super_block *sb)
 }
 
 struct file_system_type vtfs_fs_type = {
-	.owner   = THIS_MODULE,
-	.name    = "vtfs",
-	.mount   = vtfs_mount,
-	.kill_sb = vtfs_kill_sb,
-	.fs_flags = FS_USERNS_MOUNT,
+	.owner           = THIS_MODULE,
+	.name            = "vtfs",
+	.init_fs_context = vtfs_init_fs_context,
+	.parameters      = vtfs_fs_parameters,
+	.kill_sb         = vtfs_kill_sb,
+	.fs_flags        = FS_USERNS_MOUNT,
 };
 
 static void vtfs_put_super(struct super_block *sb)
 {
+	vtfs_remote_destroy(sb);
+	vtfs_image_destroy(sb);
+	vtfs_compress_destroy(sb);
+	vtfs_dedup_destroy(sb);
+	vtfs_stats_destroy(sb);
 	vtfs_store_destroy(sb);
 }
 
+static void vtfs_evict_inode(struct inode *inode)
+{
+	/* the page cache may hold the file's only copy of its chunks */
+	if (S_ISREG(inode->i_mode))
+		vtfs_file_evict(inode);
+	else
+		truncate_inode_pages_final(&inode->i_data);
+	clear_inode(inode);
+
+	if (S_ISREG(inode->i_mode))
+		vtfs_fileobj_put(inode->i_private);
+	else if (S_ISDIR(inode->i_mode))
+		vtfs_store_dir_put(inode->i_private);
+}
+
+/*
+ * Usage is what the counters say.  Without a limit, the free space is
+ * the memory still available and the free inodes as many nodes as that
+ * memory would hold.
+ */
+static int vtfs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct super_block *sb = dentry->d_sb;
+	struct vtfs_fs *fs = vtfs_fs(sb);
+	s64 blocks = percpu_counter_sum_positive(&fs->used_blocks);
+	s64 inodes = percpu_counter_sum_positive(&fs->used_inodes);
+	s64 avail = si_mem_available();
+
+	buf->f_type = sb->s_magic;
+	buf->f_bsize = 1UL << fs->chunk_shift;
+	buf->f_namelen = NAME_MAX;
+	buf->f_fsid = u64_to_fsid(huge_encode_dev(sb->s_dev));
+
+	if (fs->max_blocks) {
+		buf->f_blocks = fs->max_blocks;
+		buf->f_bfree = fs->max_blocks - min(blocks, fs->max_blocks);
+	} else {
+		/* in pages; chunks are never smaller than one */
+		buf->f_bfree = avail >> (fs->chunk_shift - PAGE_SHIFT);
+		buf->f_blocks = blocks + buf->f_bfree;
+	}
+	buf->f_bavail = buf->f_bfree;
+
+	if (fs->max_inodes) {
+		buf->f_files = fs->max_inodes;
+		buf->f_ffree = fs->max_inodes - min(inodes, fs->max_inodes);
+	} else {
+		buf->f_ffree = (avail << PAGE_SHIFT) / sizeof(struct vtfs_node);
+		buf->f_files = inodes + buf->f_ffree;
+	}
+	return 0;
+}
+
+static int vtfs_show_options(struct seq_file *m, struct dentry *root)
+{
+	const struct vtfs_mount_opts *opts = &vtfs_fs(root->d_sb)->opts;
+
+	if (opts->mode != VTFS_MODE_RAM) {
+		seq_printf(m, ",mode=%s", vtfs_param_modes[opts->mode].name);
+		seq_printf(m, ",server=%s", opts->server);
+		if (opts->port)
+			seq_printf(m, ",port=%u", opts->port);
+		if (opts->binary)
+			seq_puts(m, ",binary");
+		seq_printf(m, ",pool=%u,actimeo=%u,negtimeo=%u", opts->pool,
+		           opts->actimeo, opts->negtimeo);
+	}
+	if (opts->chunk_shift != VTFS_CHUNK_SHIFT)
+		seq_printf(m, ",chunk_size=%lu", BIT(opts->chunk_shift));
+	if (opts->size)
+		seq_printf(m, ",size=%llu", opts->size);
+	if (opts->nr_inodes)
+		seq_printf(m, ",nr_inodes=%llu", opts->nr_inodes);
+	if (opts->image)
+		seq_show_option(m, "image", opts->image);
+	if (opts->compress)
+		seq_printf(m, ",compress=%s",
+		           vtfs_param_compress[opts->compress].name);
+	if (opts->dedup)
+		seq_puts(m, ",dedup");
+	if (opts->compress || opts->dedup)
+		seq_printf(m, ",compress_age=%u", opts->compress_age);
+	return 0;
+}
+
 const struct super_operations vtfs_super_ops = {
-	.put_super  = vtfs_put_super,
-	.statfs     = simple_statfs,
-	.drop_inode = generic_delete_inode,
+	.put_super    = vtfs_put_super,
+	.statfs       = vtfs_statfs,
+	.evict_inode  = vtfs_evict_inode,
+	.show_options = vtfs_show_options,
 };
 
-int vtfs_fill_super(struct super_block *sb, void *data, int silent)
+static int vtfs_fill_super(struct super_block *sb, struct fs_context *fc)
 {
+	struct vtfs_fs_context *ctx = fc->fs_private;
+	struct vtfs_mount_opts *opts = &ctx->opts;
 	struct inode *root_inode;
 	struct vtfs_node *root_node;
+	struct vtfs_fs *fs;
 	int err;
 
-	(void)data;
-	(void)silent;
-
 	sb->s_magic = 0x76746673; /* "vtfs" */
 	sb->s_maxbytes = MAX_LFS_FILESIZE;
 	sb->s_op = &vtfs_super_ops;
@@ -53,6 +455,51 @@ int vtfs_fill_super(struct super_block *sb, void *data, int silent)
 	err = vtfs_store_init(sb);
 	if (err)
 		return err;
+	fs = vtfs_fs(sb);
+	fs->opts = *opts;
+	fs->opts.token = NULL;
+	fs->opts.image = NULL;
+	fs->chunk_shift = opts->chunk_shift;
+	fs->max_blocks = vtfs_size_to_blocks(fs, opts->size);
+	fs->max_inodes = opts->nr_inodes;
+	vtfs_stats_init(sb);
+
+	err = opts->dedup ? vtfs_dedup_init(sb) : 0;
+	if (!err && (opts->compress || opts->dedup))
+		err = vtfs_compress_init(sb, opts);
+	if (err) {
+		vtfs_dedup_destroy(sb);
+		vtfs_stats_destroy(sb);
+		vtfs_store_destroy(sb);
+		return err;
+	}
+
+	if (opts->mode != VTFS_MODE_RAM) {
+		err = vtfs_remote_init(sb, opts);
+		if (err) {
+			vtfs_compress_destroy(sb);
+			vtfs_dedup_destroy(sb);
+			vtfs_stats_destroy(sb);
+			vtfs_store_destroy(sb);
+			return err;
+		}
+		fs->attr_ttl = opts->actimeo * HZ;
+		fs->neg_ttl = opts->negtimeo * HZ;
+		sb->s_d_op = &vtfs_dentry_ops;
+	}
+
+	if (opts->image) {
+		fs->opts.image = kstrdup(opts->image, GFP_KERNEL);
+		err = fs->opts.image ? vtfs_image_load(sb) : -ENOMEM;
+		if (err) {
+			kfree(fs->opts.image);	/* nothing to save over it */
+			vtfs_compress_destroy(sb);
+			vtfs_dedup_destroy(sb);
+			vtfs_stats_destroy(sb);
+			vtfs_store_destroy(sb);
+			return err;
+		}
+	}
 
 	root_node = vtfs_store_root(sb);
 	if (!root_node)
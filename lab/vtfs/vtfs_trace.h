@@ -0,0 +1,166 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM vtfs
+
+#if !defined(_VTFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _VTFS_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/fs.h>
+#include <linux/dcache.h>
+
+/*
+ * Operations are traced on the way out, with their result and how long
+ * they took in ns, so that a slow call can be told apart from its
+ * neighbours.  Disabled tracepoints cost a patched-out branch.
+ */
+
+DECLARE_EVENT_CLASS(vtfs_name_class,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, long ret, u64 ns),
+	TP_ARGS(dir, dentry, ret, ns),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, dir)
+		__string(name, dentry->d_name.name)
+		__field(long, ret)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__assign_str(name, dentry->d_name.name);
+		__entry->ret = ret;
+		__entry->ns = ns;
+	),
+	TP_printk("dev %d:%d dir %lu name %s ret %ld ns %llu",
+	          MAJOR(__entry->dev), MINOR(__entry->dev),
+	          (unsigned long)__entry->dir, __get_str(name),
+	          __entry->ret, __entry->ns)
+);
+
+DEFINE_EVENT(vtfs_name_class, vtfs_lookup,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, long ret, u64 ns),
+	TP_ARGS(dir, dentry, ret, ns));
+
+DEFINE_EVENT(vtfs_name_class, vtfs_create,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, long ret, u64 ns),
+	TP_ARGS(dir, dentry, ret, ns));
+
+DEFINE_EVENT(vtfs_name_class, vtfs_unlink,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, long ret, u64 ns),
+	TP_ARGS(dir, dentry, ret, ns));
+
+TRACE_EVENT(vtfs_iterate,
+	TP_PROTO(struct inode *dir, loff_t from, loff_t to, int ret, u64 ns),
+	TP_ARGS(dir, from, to, ret, ns),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, dir)
+		__field(loff_t, from)
+		__field(loff_t, to)
+		__field(int, ret)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->from = from;
+		__entry->to = to;
+		__entry->ret = ret;
+		__entry->ns = ns;
+	),
+	TP_printk("dev %d:%d dir %lu pos %lld..%lld ret %d ns %llu",
+	          MAJOR(__entry->dev), MINOR(__entry->dev),
+	          (unsigned long)__entry->dir, __entry->from, __entry->to,
+	          __entry->ret, __entry->ns)
+);
+
+DECLARE_EVENT_CLASS(vtfs_rw_class,
+	TP_PROTO(struct inode *inode, loff_t pos, ssize_t ret, u64 ns),
+	TP_ARGS(inode, pos, ret, ns),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, ino)
+		__field(loff_t, pos)
+		__field(ssize_t, ret)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->pos = pos;
+		__entry->ret = ret;
+		__entry->ns = ns;
+	),
+	TP_printk("dev %d:%d ino %lu pos %lld ret %zd ns %llu",
+	          MAJOR(__entry->dev), MINOR(__entry->dev),
+	          (unsigned long)__entry->ino, __entry->pos, __entry->ret,
+	          __entry->ns)
+);
+
+DEFINE_EVENT(vtfs_rw_class, vtfs_read,
+	TP_PROTO(struct inode *inode, loff_t pos, ssize_t ret, u64 ns),
+	TP_ARGS(inode, pos, ret, ns));
+
+DEFINE_EVENT(vtfs_rw_class, vtfs_write,
+	TP_PROTO(struct inode *inode, loff_t pos, ssize_t ret, u64 ns),
+	TP_ARGS(inode, pos, ret, ns));
+
+/* store directory lock: ns is the wait on lock, the hold time on unlock */
+DECLARE_EVENT_CLASS(vtfs_lock_class,
+	TP_PROTO(struct super_block *sb, ino_t dir, u64 ns),
+	TP_ARGS(sb, dir, ns),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, dir)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->dir = dir;
+		__entry->ns = ns;
+	),
+	TP_printk("dev %d:%d dir %lu ns %llu",
+	          MAJOR(__entry->dev), MINOR(__entry->dev),
+	          (unsigned long)__entry->dir, __entry->ns)
+);
+
+DEFINE_EVENT(vtfs_lock_class, vtfs_dir_lock,
+	TP_PROTO(struct super_block *sb, ino_t dir, u64 ns),
+	TP_ARGS(sb, dir, ns));
+
+DEFINE_EVENT(vtfs_lock_class, vtfs_dir_unlock,
+	TP_PROTO(struct super_block *sb, ino_t dir, u64 ns),
+	TP_ARGS(sb, dir, ns));
+
+TRACE_EVENT(vtfs_remote_call,
+	TP_PROTO(struct super_block *sb, const char *method, size_t sent,
+	         size_t received, long long ret, u64 ns),
+	TP_ARGS(sb, method, sent, received, ret, ns),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__string(method, method)
+		__field(size_t, sent)
+		__field(size_t, received)
+		__field(long long, ret)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__assign_str(method, method);
+		__entry->sent = sent;
+		__entry->received = received;
+		__entry->ret = ret;
+		__entry->ns = ns;
+	),
+	TP_printk("dev %d:%d %s sent %zu received %zu ret %lld ns %llu",
+	          MAJOR(__entry->dev), MINOR(__entry->dev), __get_str(method),
+	          __entry->sent, __entry->received, __entry->ret, __entry->ns)
+);
+
+#endif /* _VTFS_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE vtfs_trace
+#include <trace/define_trace.h>